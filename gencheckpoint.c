@@ -0,0 +1,263 @@
+/* Synthetic checkpoints for llama2.cu
+
+Writes a checkpoint of any Config shape in the legacy llama2.c format that
+read_checkpoint() takes: the Config header (a negative vocab_size flags an
+unshared classifier), then every weight in the order of memory_map_weights(),
+the two unused RoPE tables and the classifier when it isn't shared. The weights
+are random from a seed or all the same constant, either way the same arguments
+give the same file, so the benchmarks and scaling runs need no downloads.
+Norm weights are 1.0 like in a freshly initialized model.
+
+With -o, a byte-level tokenizer of vocab_size tokens is written too, for shapes
+whose vocab_size differs from the one of tokenizer.bin.
+
+build:
+    gcc -O3 -o gencheckpoint gencheckpoint.c
+run:
+    ./gencheckpoint -s 7B -c 7b.bin
+    ./gencheckpoint -s 15M -v 512 -c tiny.bin -o tok512.bin
+    ./main -m tiny.bin -z tok512.bin -M bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// same layout as the Config of llama2.cu
+typedef struct {
+    int dim; // transformer dimension
+    int hidden_dim; // ffn layer dimension
+    int n_layers; // number of transformer layers
+    int n_heads; // number of query heads
+    int n_kv_heads; // number of k/v heads
+    int vocab_size; // vocabulary size, usually 256 (byte-level)
+    int max_seq_len; // maximum sequence length to generate
+} Config;
+
+typedef struct {
+    const char *name;
+    Config config;
+} Preset;
+
+static Preset presets[] = {
+    // dim, hidden_dim, n_layers, n_heads, n_kv_heads, vocab_size, max_seq_len
+    {"15M", {288, 768, 6, 6, 6, 32000, 256}},
+    {"42M", {512, 1376, 8, 8, 8, 32000, 1024}},
+    {"110M", {768, 2048, 12, 12, 12, 32000, 1024}},
+    {"7B", {4096, 11008, 32, 32, 32, 32000, 4096}},
+    {"13B", {5120, 13824, 40, 40, 40, 32000, 4096}},
+    {"70B", {8192, 28672, 80, 64, 8, 32000, 4096}},
+};
+#define N_PRESETS (int)(sizeof(presets) / sizeof(presets[0]))
+
+#define CHUNK (1 << 20) // floats generated and written at a time
+
+// ----------------------------------------------------------------------------
+// weights
+
+typedef struct {
+    FILE *file;
+    const char *path;
+    int constant;               // all weights are `value` instead of random
+    float value;
+    float scale;                // random weights are uniform in [-scale, scale)
+    unsigned long long rng_state;
+    float *buffer;              // (CHUNK,)
+    uint64_t bytes;             // written so far
+} Writer;
+
+unsigned int random_u32(unsigned long long *state) {
+    // xorshift rng, the same as the sampler of llama2.cu
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+void write_floats(Writer *w, const float *x, size_t n) {
+    if (fwrite(x, sizeof(float), n, w->file) != n) {
+        fprintf(stderr, "write to %s failed\n", w->path);
+        exit(EXIT_FAILURE);
+    }
+    w->bytes += n * sizeof(float);
+}
+
+void write_tensor(Writer *w, uint64_t n, int norm) {
+    // n weights: ones for a norm, zeros when norm < 0, otherwise random or the constant
+    while (n > 0) {
+        size_t len = n < CHUNK ? (size_t)n : CHUNK;
+        for (size_t i = 0; i < len; i++) {
+            if (norm > 0) { w->buffer[i] = 1.0f; }
+            else if (norm < 0) { w->buffer[i] = 0.0f; }
+            else if (w->constant) { w->buffer[i] = w->value; }
+            else { w->buffer[i] = ((random_u32(&w->rng_state) >> 8) / 16777216.0f * 2.0f - 1.0f) * w->scale; }
+        }
+        write_floats(w, w->buffer, len);
+        n -= len;
+    }
+}
+
+void write_checkpoint(Writer *w, Config c, int shared_weights) {
+    // the order of memory_map_weights() in llama2.cu, 64 bit counts for the 13B+ shapes
+    uint64_t dim = c.dim, hidden_dim = c.hidden_dim, n_layers = c.n_layers, vocab_size = c.vocab_size;
+    uint64_t head_size = dim / c.n_heads;
+    uint64_t kv_dim = head_size * c.n_kv_heads;
+    Config header = c;
+    if (!shared_weights) { header.vocab_size = -header.vocab_size; }
+    if (fwrite(&header, sizeof(Config), 1, w->file) != 1) {
+        fprintf(stderr, "write to %s failed\n", w->path);
+        exit(EXIT_FAILURE);
+    }
+    w->bytes += sizeof(Config);
+    write_tensor(w, vocab_size * dim, 0);           // token_embedding_table
+    write_tensor(w, n_layers * dim, 1);             // rms_att_weight
+    write_tensor(w, n_layers * dim * dim, 0);       // wq
+    write_tensor(w, n_layers * dim * kv_dim, 0);    // wk
+    write_tensor(w, n_layers * dim * kv_dim, 0);    // wv
+    write_tensor(w, n_layers * dim * dim, 0);       // wo
+    write_tensor(w, n_layers * dim, 1);             // rms_ffn_weight
+    write_tensor(w, n_layers * dim * hidden_dim, 0); // w1
+    write_tensor(w, n_layers * hidden_dim * dim, 0); // w2
+    write_tensor(w, n_layers * dim * hidden_dim, 0); // w3
+    write_tensor(w, dim, 1);                        // rms_final_weight
+    write_tensor(w, c.max_seq_len * head_size, -1); // freq_cis_real and freq_cis_imag, unused
+    if (!shared_weights) { write_tensor(w, vocab_size * dim, 0); } // wcls
+}
+
+// ----------------------------------------------------------------------------
+// tokenizer
+
+void write_tokenizer(const char *path, int vocab_size) {
+    // <unk>, <s>, </s>, the 256 byte tokens encode() falls back to, the printable ASCII
+    // characters (the space is the dummy prefix encode() looks up), then filler tokens
+    // that never merge. the file format is the one build_tokenizer() reads
+    FILE *file = fopen(path, "wb");
+    if (!file) { fprintf(stderr, "couldn't open %s\n", path); exit(EXIT_FAILURE); }
+    int max_token_length = 16;
+    fwrite(&max_token_length, sizeof(int), 1, file);
+    char piece[32];
+    for (int i = 0; i < vocab_size; i++) {
+        if (i == 0) { strcpy(piece, "<unk>"); }
+        else if (i == 1) { strcpy(piece, "\n<s>\n"); }
+        else if (i == 2) { strcpy(piece, "\n</s>\n"); }
+        else if (i < 3 + 256) { sprintf(piece, "<0x%02X>", i - 3); }
+        else if (i < 3 + 256 + 95) { sprintf(piece, "%c", ' ' + i - 3 - 256); }
+        else { sprintf(piece, "<tok%d>", i); }
+        float score = 0.0f;
+        int len = (int)strlen(piece);
+        fwrite(&score, sizeof(float), 1, file);
+        fwrite(&len, sizeof(int), 1, file);
+        fwrite(piece, 1, len, file);
+    }
+    if (fclose(file) != 0) { fprintf(stderr, "write to %s failed\n", path); exit(EXIT_FAILURE); }
+}
+
+// ----------------------------------------------------------------------------
+// CLI
+
+void error_usage() {
+    fprintf(stderr, "Usage:   gencheckpoint [options]\n");
+    fprintf(stderr, "Example: gencheckpoint -s 7B -c 7b.bin\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -c <string> checkpoint output path, required\n");
+    fprintf(stderr, "  -s <string> preset shape: 15M, 42M, 110M, 7B, 13B or 70B, default 15M\n");
+    fprintf(stderr, "  -d <int>    dim, overrides the preset\n");
+    fprintf(stderr, "  -f <int>    hidden_dim\n");
+    fprintf(stderr, "  -l <int>    n_layers\n");
+    fprintf(stderr, "  -h <int>    n_heads\n");
+    fprintf(stderr, "  -k <int>    n_kv_heads\n");
+    fprintf(stderr, "  -v <int>    vocab_size\n");
+    fprintf(stderr, "  -q <int>    max_seq_len\n");
+    fprintf(stderr, "  -u <int>    1 = unshared classifier (wcls), default 0 = shared with the embedding\n");
+    fprintf(stderr, "  -w <string> weights: random or const, default random\n");
+    fprintf(stderr, "  -r <int>    random seed, default 42\n");
+    fprintf(stderr, "  -a <float>  scale: the range of random weights or the value of constant ones, default 0.02\n");
+    fprintf(stderr, "  -o <string> also write a byte-level tokenizer of vocab_size tokens to this path\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    char *checkpoint_path = NULL;
+    char *tokenizer_path = NULL;
+    char *preset = (char *)"15M";
+    Config over = {0, 0, 0, 0, 0, 0, 0}; // fields given on the command line, 0 = from the preset
+    int unshared = 0;
+    char *weights = (char *)"random";
+    unsigned long long seed = 42;
+    float scale = 0.02f;
+
+    for (int i = 1; i < argc; i += 2) {
+        // do some basic validation
+        if (i + 1 >= argc) { error_usage(); } // must have arg after flag
+        if (argv[i][0] != '-') { error_usage(); } // must start with dash
+        if (strlen(argv[i]) != 2) { error_usage(); } // must be -x (one dash, one letter)
+        // read in the args
+        if (argv[i][1] == 'c') { checkpoint_path = argv[i + 1]; }
+        else if (argv[i][1] == 's') { preset = argv[i + 1]; }
+        else if (argv[i][1] == 'd') { over.dim = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'f') { over.hidden_dim = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'l') { over.n_layers = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'h') { over.n_heads = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'k') { over.n_kv_heads = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'v') { over.vocab_size = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'q') { over.max_seq_len = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'u') { unshared = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'w') { weights = argv[i + 1]; }
+        else if (argv[i][1] == 'r') { seed = strtoull(argv[i + 1], NULL, 10); }
+        else if (argv[i][1] == 'a') { scale = atof(argv[i + 1]); }
+        else if (argv[i][1] == 'o') { tokenizer_path = argv[i + 1]; }
+        else { error_usage(); }
+    }
+    if (checkpoint_path == NULL) { error_usage(); }
+
+    // the preset, then the overrides on top
+    Config c;
+    int found = 0;
+    for (int i = 0; i < N_PRESETS; i++) {
+        if (strcmp(presets[i].name, preset) == 0) { c = presets[i].config; found = 1; }
+    }
+    if (!found) { fprintf(stderr, "unknown preset %s\n", preset); error_usage(); }
+    if (over.dim) { c.dim = over.dim; }
+    if (over.hidden_dim) { c.hidden_dim = over.hidden_dim; }
+    if (over.n_layers) { c.n_layers = over.n_layers; }
+    if (over.n_heads) { c.n_heads = over.n_heads; }
+    // a preset's n_kv_heads only makes sense with its own n_heads
+    if (over.n_kv_heads) { c.n_kv_heads = over.n_kv_heads; } else if (over.n_heads) { c.n_kv_heads = c.n_heads; }
+    if (over.vocab_size) { c.vocab_size = over.vocab_size; }
+    if (over.max_seq_len) { c.max_seq_len = over.max_seq_len; }
+
+    // the shapes llama2.cu can run
+    if (c.dim <= 0 || c.hidden_dim <= 0 || c.n_layers <= 0 || c.n_heads <= 0 || c.n_kv_heads <= 0 || c.vocab_size <= 0 || c.max_seq_len <= 0) {
+        fprintf(stderr, "every Config field has to be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (c.dim % c.n_heads != 0 || (c.dim / c.n_heads) % 2 != 0) { fprintf(stderr, "dim has to split into n_heads heads of even size\n"); exit(EXIT_FAILURE); }
+    if (c.n_heads % c.n_kv_heads != 0) { fprintf(stderr, "n_heads has to be a multiple of n_kv_heads\n"); exit(EXIT_FAILURE); }
+    if (tokenizer_path != NULL && c.vocab_size < 3 + 256 + 95) { fprintf(stderr, "a byte-level tokenizer needs a vocab_size of at least 354\n"); exit(EXIT_FAILURE); }
+    if (strcmp(weights, "random") != 0 && strcmp(weights, "const") != 0) { fprintf(stderr, "unknown weights %s\n", weights); error_usage(); }
+
+    Writer w;
+    w.path = checkpoint_path;
+    w.file = fopen(checkpoint_path, "wb");
+    if (!w.file) { fprintf(stderr, "couldn't open %s\n", checkpoint_path); exit(EXIT_FAILURE); }
+    w.constant = strcmp(weights, "const") == 0;
+    w.value = scale;
+    w.scale = scale;
+    w.rng_state = seed ? seed : 1; // xorshift never leaves 0
+    w.buffer = (float *)malloc(CHUNK * sizeof(float));
+    w.bytes = 0;
+    if (!w.buffer) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    write_checkpoint(&w, c, !unshared);
+    if (fclose(w.file) != 0) { fprintf(stderr, "write to %s failed\n", checkpoint_path); exit(EXIT_FAILURE); }
+    free(w.buffer);
+    printf("%s: dim %d hidden_dim %d n_layers %d n_heads %d n_kv_heads %d vocab_size %d max_seq_len %d, %s wcls, %s weights, %.2f MB\n",
+           checkpoint_path, c.dim, c.hidden_dim, c.n_layers, c.n_heads, c.n_kv_heads, c.vocab_size, c.max_seq_len,
+           unshared ? "unshared" : "shared", weights, w.bytes / 1048576.0);
+
+    if (tokenizer_path != NULL) {
+        write_tokenizer(tokenizer_path, c.vocab_size);
+        printf("%s: byte-level tokenizer of %d tokens\n", tokenizer_path, c.vocab_size);
+    }
+    return 0;
+}
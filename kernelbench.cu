@@ -0,0 +1,503 @@
+/* Kernel microbenchmarks for llama2.cu
+
+Times every compute kernel in isolation at the shapes of real models: the matmul
+of each weight matrix at a few batch sizes, rmsnorm, RoPE, attention at several
+context lengths, the fused classifier log-softmax, softmax and sampling. Every
+result is set against the roofline of the machine, from its measured memory
+bandwidth (a STREAM triad) and peak FLOPs (independent vector multiply-add
+chains), so it shows both how fast a kernel is and how much headroom it has left. the roof
+is the one of DRAM, kernels whose working set fits in cache (the small vectors of
+rmsnorm or sampling) can go past it.
+
+The kernels timed are the ones a model of the shape runs with, its shape kernels
+where the backend has them. On the CPU backends every matrix is timed row major
+(matmul), packed into the panels a loaded model reads (panels), and quantized to
+int8 as with --quant int8 (w8a8), the quantization of its input included. The
+roof of w8a8 is the int8 peak, of the dot product instruction its kernel runs on
+(vpdpbusd with VNNI, vpmaddwd on AVX2), a product counted as 2 ops like a flop.
+
+build:
+    nvcc -O3 -Xcompiler "-fopenmp -march=native" kernelbench.cu -o kernelbench
+run:
+    ./kernelbench                       # CPU, every model shape
+    ./kernelbench -k simd -s 110M       # the simd backend, against the numbers of the line above
+    ./kernelbench -d 0 -s 7B -b 1,32    # GPU 0, the 7B shapes at batch 1 and 32
+*/
+
+#define LLAMA2_NO_MAIN
+#include "llama2.cu"
+
+#define MAX_SAMPLES 1000
+
+// ----------------------------------------------------------------------------
+// the model shapes, as in the Config of their checkpoints
+
+typedef struct {
+    const char *name;
+    Config config;
+} Shape;
+
+static Shape shapes[] = {
+    // dim, hidden_dim, n_layers, n_heads, n_kv_heads, vocab_size, max_seq_len
+    {"15M", {288, 768, 6, 6, 6, 32000, 256}},
+    {"42M", {512, 1376, 8, 8, 8, 32000, 1024}},
+    {"110M", {768, 2048, 12, 12, 12, 32000, 1024}},
+    {"7B", {4096, 11008, 32, 32, 32, 32000, 4096}},
+};
+#define N_SHAPES (int)(sizeof(shapes) / sizeof(shapes[0]))
+
+// ----------------------------------------------------------------------------
+// roofline: what the machine can do at best, measured rather than taken from a spec sheet
+
+typedef struct {
+    double gb_s;        // STREAM triad bandwidth
+    double gflop_s;     // multiply-add throughput
+    double gop_s;       // int8 dot product throughput, the peak of the w8a8 rows, 0 for none
+} Roofline;
+
+__global__ void triad_kernel(float *a, const float *b, const float *c, float scalar, size_t n) {
+    size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < n) { a[i] = b[i] + scalar * c[i]; }
+}
+
+__global__ void fma_kernel(float *out, int iters) {
+    // eight independent chains per thread, enough to hide the latency of the multiply-add
+    float a0 = threadIdx.x, a1 = a0 + 1, a2 = a0 + 2, a3 = a0 + 3, a4 = a0 + 4, a5 = a0 + 5, a6 = a0 + 6, a7 = a0 + 7;
+    for (int i = 0; i < iters; i++) {
+        a0 = a0 * 0.9999f + 0.0001f; a1 = a1 * 0.9999f + 0.0001f; a2 = a2 * 0.9999f + 0.0001f; a3 = a3 * 0.9999f + 0.0001f;
+        a4 = a4 * 0.9999f + 0.0001f; a5 = a5 * 0.9999f + 0.0001f; a6 = a6 * 0.9999f + 0.0001f; a7 = a7 * 0.9999f + 0.0001f;
+    }
+    out[(size_t)blockIdx.x * blockDim.x + threadIdx.x] = a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7;
+}
+
+double stream_triad(int device) {
+    // a = b + s * c over arrays far larger than any cache, best of a few runs. counted as
+    // 3 arrays moved, like STREAM does, so write-allocate traffic is not in the figure
+    size_t n = (size_t)1 << 24;
+    size_t bytes = n * sizeof(float);
+    float *a, *b, *c;
+    checkCudaErrors(cudaMallocManaged((void **)&a, bytes));
+    checkCudaErrors(cudaMallocManaged((void **)&b, bytes));
+    checkCudaErrors(cudaMallocManaged((void **)&c, bytes));
+    for (size_t i = 0; i < n; i++) { a[i] = 0.0f; b[i] = 1.0f; c[i] = 2.0f; }
+    checkCudaErrors(cudaMemPrefetchAsync(a, bytes, device));
+    checkCudaErrors(cudaMemPrefetchAsync(b, bytes, device));
+    checkCudaErrors(cudaMemPrefetchAsync(c, bytes, device));
+    checkCudaErrors(cudaDeviceSynchronize());
+    long best = 0;
+    for (int rep = 0; rep < 6; rep++) {
+        long start = time_in_ns();
+        if (device == cudaCpuDeviceId) {
+            long i;
+            #pragma omp parallel for private(i)
+            for (i = 0; i < (long)n; i++) { a[i] = b[i] + 3.0f * c[i]; }
+        } else {
+            triad_kernel<<< (n + BLOCKSIZE - 1) / BLOCKSIZE, BLOCKSIZE >>>(a, b, c, 3.0f, n);
+            checkCudaErrors(cudaDeviceSynchronize());
+        }
+        long ns = time_in_ns() - start;
+        if (rep > 0 && (best == 0 || ns < best)) { best = ns; } // the first run pays for the page faults
+    }
+    checkCudaErrors(cudaFree(a));
+    checkCudaErrors(cudaFree(b));
+    checkCudaErrors(cudaFree(c));
+    return 3.0 * bytes / best;
+}
+
+// the chains of the CPU peaks: more independent accumulators than the latency of the
+// instruction times the ports that run it, so it issues every cycle. written out, the
+// compiler would not keep an array of them in registers
+#define PEAK_CHAINS 12          // of 16 vector registers on AVX2, two hold the operands
+#define PEAK_REPEAT(op) op(0) op(1) op(2) op(3) op(4) op(5) op(6) op(7) op(8) op(9) op(10) op(11)
+
+double peak_chunk_f32(int chunk, int iters) {
+    // PEAK_CHAINS vector multiply-add chains over iters, returns the flops
+#if defined(__AVX512F__)
+    __m512 a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11;
+    __m512 m = _mm512_set1_ps(0.9999f), c = _mm512_set1_ps(0.0001f);
+#define PEAK_INIT(j) a##j = _mm512_set1_ps(chunk + j * 1e-3f);
+#define PEAK_FMA(j) a##j = _mm512_fmadd_ps(a##j, m, c);
+#define PEAK_SUM(j) _mm512_reduce_add_ps(a##j) +
+    const int lanes = 16;
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11;
+    __m256 m = _mm256_set1_ps(0.9999f), c = _mm256_set1_ps(0.0001f);
+#define PEAK_INIT(j) a##j = _mm256_set1_ps(chunk + j * 1e-3f);
+#define PEAK_FMA(j) a##j = _mm256_fmadd_ps(a##j, m, c);
+#define PEAK_SUM(j) _mm256_cvtss_f32(a##j) +
+    const int lanes = 8;
+#else
+    float a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11;
+#define PEAK_INIT(j) a##j = chunk + j * 1e-3f;
+#define PEAK_FMA(j) a##j = a##j * 0.9999f + 0.0001f;
+#define PEAK_SUM(j) a##j +
+    const int lanes = 1;
+#endif
+    PEAK_REPEAT(PEAK_INIT)
+    for (int i = 0; i < iters; i++) { PEAK_REPEAT(PEAK_FMA) }
+    float sum = PEAK_REPEAT(PEAK_SUM) 0.0f;
+    if (sum == 12345.0f) { fprintf(stderr, " "); } // keeps the chains alive
+#undef PEAK_INIT
+#undef PEAK_FMA
+#undef PEAK_SUM
+    return 2.0 * lanes * PEAK_CHAINS * iters;
+}
+
+double peak_chunk_int8(int chunk, int iters) {
+    // the same over the int8 dot product matmul_q8 runs on, returns the ops (2 per product),
+    // 0 without one
+#if defined(__AVX2__)
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    __m512i a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11;
+    __m512i x = _mm512_set1_epi8(chunk + 1), w = _mm512_set1_epi8(-3);
+#define PEAK_INIT(j) a##j = _mm512_set1_epi32(j);
+#define PEAK_DOT(j) a##j = _mm512_dpbusd_epi32(a##j, x, w);
+#define PEAK_SUM(j) _mm512_reduce_add_epi32(a##j) +
+    const int products = 64;
+#elif defined(__AVXVNNI__)
+    __m256i a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11;
+    __m256i x = _mm256_set1_epi8(chunk + 1), w = _mm256_set1_epi8(-3);
+#define PEAK_INIT(j) a##j = _mm256_set1_epi32(j);
+#define PEAK_DOT(j) a##j = _mm256_dpbusd_avx_epi32(a##j, x, w);
+#define PEAK_SUM(j) _mm256_extract_epi32(a##j, 0) +
+    const int products = 32;
+#else
+    // pairs of 16 bit products added into 32 bits, after the widening the kernel does too
+    __m256i a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11;
+    __m256i x = _mm256_set1_epi16(chunk + 1), w = _mm256_set1_epi16(-3);
+#define PEAK_INIT(j) a##j = _mm256_set1_epi32(j);
+#define PEAK_DOT(j) a##j = _mm256_add_epi32(a##j, _mm256_madd_epi16(x, w));
+#define PEAK_SUM(j) _mm256_extract_epi32(a##j, 0) +
+    const int products = 16;
+#endif
+    PEAK_REPEAT(PEAK_INIT)
+    for (int i = 0; i < iters; i++) { PEAK_REPEAT(PEAK_DOT) }
+    int sum = PEAK_REPEAT(PEAK_SUM) 0;
+    if (sum == 12345) { fprintf(stderr, " "); } // keeps the chains alive
+#undef PEAK_INIT
+#undef PEAK_DOT
+#undef PEAK_SUM
+    return 2.0 * products * PEAK_CHAINS * iters;
+#else
+    return 0.0;
+#endif
+}
+
+double peak_flops(int device, int int8) {
+    // GFLOP/s of independent multiply-add chains, counted as 2 flops each. int8: GOP/s of the
+    // int8 dot product, 0 where there is none (or on a GPU, which has no w8a8 kernel)
+    long best = 0;
+    double flops = 0;
+    if (int8 && (device != cudaCpuDeviceId || peak_chunk_int8(0, 1) == 0)) { return 0.0; }
+    for (int rep = 0; rep < 4; rep++) {
+        long start = time_in_ns();
+        if (device == cudaCpuDeviceId) {
+            // the chunks spread over the threads
+            const int n_chunks = 256, iters = 1 << 16;
+            double chunk_flops[256];
+            int chunk;
+            #pragma omp parallel for private(chunk)
+            for (chunk = 0; chunk < n_chunks; chunk++) {
+                chunk_flops[chunk] = int8 ? peak_chunk_int8(chunk, iters) : peak_chunk_f32(chunk, iters);
+            }
+            flops = chunk_flops[0] * n_chunks;
+        } else {
+            int blocks = 1024, iters = 1 << 14;
+            float *out;
+            checkCudaErrors(cudaMalloc((void **)&out, (size_t)blocks * BLOCKSIZE * sizeof(float)));
+            fma_kernel<<< blocks, BLOCKSIZE >>>(out, iters);
+            checkCudaErrors(cudaDeviceSynchronize());
+            checkCudaErrors(cudaFree(out));
+            flops = 2.0 * 8 * iters * blocks * BLOCKSIZE;
+        }
+        long ns = time_in_ns() - start;
+        if (best == 0 || ns < best) { best = ns; }
+    }
+    return flops / best;
+}
+
+// ----------------------------------------------------------------------------
+// timing and reporting
+
+int compare_longs(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// runs stmt once to warm up, then until at least 3 samples and min_ns have gone by, into the median ns
+#define BENCH(result, stmt) do { \
+        stmt; \
+        long samples[MAX_SAMPLES]; \
+        int n_samples = 0; \
+        long bench_start = time_in_ns(); \
+        while (n_samples < MAX_SAMPLES) { \
+            long t0 = time_in_ns(); \
+            stmt; \
+            samples[n_samples++] = time_in_ns() - t0; \
+            if (n_samples >= 3 && time_in_ns() - bench_start > min_ns) { break; } \
+        } \
+        qsort(samples, n_samples, sizeof(long), compare_longs); \
+        result = samples[n_samples / 2]; \
+    } while (0)
+
+void report(Roofline *roof, const char *shape, const char *kernel, const char *dims, long ns, double bytes, double flops) {
+    // the roof of a kernel is bandwidth * arithmetic intensity until it reaches the peak FLOPs
+    double intensity = flops / bytes;
+    double roof_gflop_s = intensity * roof->gb_s < roof->gflop_s ? intensity * roof->gb_s : roof->gflop_s;
+    double gflop_s = flops / ns;
+    printf("%-5s %-10s %-28s %11.2f %9.2f %9.2f %7.3f %9.2f %6.1f%% %s\n", shape, kernel, dims, ns / 1e3, bytes / ns, gflop_s,
+           intensity, roof_gflop_s, roof_gflop_s > 0 ? 100.0 * gflop_s / roof_gflop_s : 0.0,
+           intensity * roof->gb_s < roof->gflop_s ? "memory" : "compute");
+    fflush(stdout);
+}
+
+float *alloc_random(size_t n, unsigned long long *rng, const Backend *backend) {
+    // allocated like the weights of a loaded model, filled with small values so nothing overflows
+    float *x = (float *)backend->alloc(n * sizeof(float));
+    for (size_t i = 0; i < n; i++) { x[i] = random_f32(rng) * 0.2f - 0.1f; }
+    backend->prefetch(x, n * sizeof(float), backend->device);
+    checkCudaErrors(cudaDeviceSynchronize());
+    return x;
+}
+
+// ----------------------------------------------------------------------------
+// the kernels of one model shape
+
+void bench_shape(Shape *shape, Roofline *roof, int *batches, int n_batches, int *contexts, int n_contexts, long min_ns, const Backend *backend) {
+    Config *p = &shape->config;
+    int dim = p->dim;
+    int kv_dim = p->dim * p->n_kv_heads / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads;
+    int head_size = dim / p->n_heads;
+    int hidden_dim = p->hidden_dim;
+    int vocab_size = p->vocab_size;
+    int max_batch = 1;
+    for (int i = 0; i < n_batches; i++) { if (batches[i] > max_batch) { max_batch = batches[i]; } }
+    int max_n = hidden_dim > dim ? hidden_dim : dim;
+    unsigned long long rng = 42;
+    char dims[64];
+    long ns;
+
+    // activations for the largest batch, in and out of every kernel
+    float *x = alloc_random((size_t)max_batch * max_n, &rng, backend);
+    float *out = alloc_random((size_t)max_batch * (vocab_size > max_n ? vocab_size : max_n), &rng, backend);
+
+    // matmuls, one weight matrix at a time so the 7B classifier is the largest allocation
+    struct { const char *name; int n, d; } mats[] = {
+        {"wq", dim, dim}, {"wk", dim, kv_dim}, {"wv", dim, kv_dim}, {"wo", dim, dim},
+        {"w1", dim, hidden_dim}, {"w2", hidden_dim, dim}, {"w3", dim, hidden_dim}, {"wcls", dim, vocab_size},
+    };
+    for (int m = 0; m < (int)(sizeof(mats) / sizeof(mats[0])); m++) {
+        int n = mats[m].n, d = mats[m].d;
+        // wk and wv, w1 and w3 have the same shape, the second one would only repeat the first
+        if (strcmp(mats[m].name, "wv") == 0 || strcmp(mats[m].name, "w3") == 0) { continue; }
+        float *w = alloc_random((size_t)d * n, &rng, backend);
+        for (int i = 0; i < n_batches; i++) {
+            int batch = batches[i];
+            BENCH(ns, backend_matmul(backend, n)(out, x, w, n, d, batch));
+            snprintf(dims, sizeof(dims), "%s %dx%d b%d", mats[m].name, d, n, batch);
+            report(roof, shape->name, "matmul", dims, ns, 4.0 * ((double)d * n + (double)batch * (n + d)), 2.0 * batch * d * n);
+        }
+        if (backend->panel_rows > 0) {
+            // the same matrix repacked into panels, as a loaded model runs it
+            float *panels = (float *)backend->alloc(panel_floats(n, d, backend->panel_rows) * sizeof(float));
+            pack_panels(panels, w, n, d);
+            for (int i = 0; i < n_batches; i++) {
+                int batch = batches[i];
+                BENCH(ns, backend_matmul_panels(backend, n)(out, x, panels, n, d, batch));
+                snprintf(dims, sizeof(dims), "%s %dx%d b%d", mats[m].name, d, n, batch);
+                report(roof, shape->name, "panels", dims, ns, 4.0 * ((double)d * n + (double)batch * (n + d)), 2.0 * batch * d * n);
+            }
+            backend->free(panels);
+        }
+        if (backend->matmul_q8 != NULL && strcmp(mats[m].name, "wcls") != 0) {
+            // the same matrix in int8, as a model loaded with --quant int8 runs it
+            QuantMatrix q;
+            q.w = (int8_t *)malloc((size_t)d * n);
+            q.scale = (float *)malloc(d * sizeof(float));
+            q.sum = (int *)malloc(d * sizeof(int));
+            quantize_matrix(q.w, q.scale, q.sum, w, n, d);
+            uint8_t *xq = (uint8_t *)malloc((size_t)max_batch * n);
+            Roofline int8_roof = {roof->gb_s, roof->gop_s > 0 ? roof->gop_s : roof->gflop_s, 0.0};
+            float *xq_scale = (float *)malloc(max_batch * sizeof(float));
+            for (int i = 0; i < n_batches; i++) {
+                int batch = batches[i];
+                BENCH(ns, quantize_rows(xq, xq_scale, x, n, batch); backend->matmul_q8(out, xq, xq_scale, &q, n, d, batch));
+                snprintf(dims, sizeof(dims), "%s %dx%d b%d", mats[m].name, d, n, batch);
+                report(&int8_roof, shape->name, "w8a8", dims, ns, (double)d * n + 8.0 * d + (double)batch * (6.0 * n + 4.0 * d), 2.0 * batch * d * n);
+            }
+            free(q.w);
+            free(q.scale);
+            free(q.sum);
+            free(xq);
+            free(xq_scale);
+        }
+        if (strcmp(mats[m].name, "wcls") == 0) {
+            // the fused classifier log-softmax of scoring, against the same matrix
+            float *partial;
+            int *target;
+            partial = (float *)backend->alloc((size_t)max_batch * LOGPROB_SLICES * 2 * sizeof(float));
+            target = (int *)backend->alloc(max_batch * sizeof(int));
+            for (int b = 0; b < max_batch; b++) { target[b] = (b * 7919) % vocab_size; }
+            for (int i = 0; i < n_batches; i++) {
+                int batch = batches[i];
+                BENCH(ns, backend_logprob(backend, n)(out, partial, x, w, target, n, d, batch));
+                snprintf(dims, sizeof(dims), "wcls %dx%d b%d", d, n, batch);
+                report(roof, shape->name, "logprob", dims, ns, 4.0 * ((double)d * n + (double)batch * n), 2.0 * batch * d * n);
+            }
+            backend->free(partial);
+            backend->free(target);
+        }
+        backend->free(w);
+    }
+
+    // rmsnorm of one token, like every call in the forward pass
+    float *weight = alloc_random(dim, &rng, backend);
+    float *partial_sum = alloc_random(dim, &rng, backend);
+    BENCH(ns, backend_rmsnorm(backend, dim)(out, x, partial_sum, weight, dim));
+    snprintf(dims, sizeof(dims), "%d", dim);
+    report(roof, shape->name, "rmsnorm", dims, ns, 4.0 * 3 * dim, 4.0 * dim);
+    backend->free(weight);
+    backend->free(partial_sum);
+
+    // RoPE of one token's q and k, the flops leave out the sines, cosines and powers it is bound by
+    float *q = alloc_random(dim, &rng, backend);
+    float *k = alloc_random(kv_dim, &rng, backend);
+    BENCH(ns, backend->rope(q, k, p->max_seq_len / 2, dim, kv_dim, head_size));
+    snprintf(dims, sizeof(dims), "q %d k %d", dim, kv_dim);
+    report(roof, shape->name, "rope", dims, ns, 4.0 * 2 * (dim + kv_dim), 3.0 * (dim + kv_dim));
+    backend->free(k);
+
+    // attention of one decoding token over a context of one layer, through a block table as in the cache
+    Config layer = *p;
+    layer.n_layers = 1;
+    for (int c = 0; c < n_contexts; c++) {
+        int ctx = contexts[c] < p->max_seq_len ? contexts[c] : p->max_seq_len;
+        if (c > 0 && ctx <= (contexts[c - 1] < p->max_seq_len ? contexts[c - 1] : p->max_seq_len)) { break; }
+        KVCache kv;
+        int n_blocks = (ctx + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+        build_kv_cache(&kv, layer, n_blocks, backend);
+        for (size_t i = 0; i < (size_t)n_blocks * kv.block_floats; i++) { kv.key_pool[i] = random_f32(&rng) - 0.5f; kv.value_pool[i] = random_f32(&rng) - 0.5f; }
+        int *blocks = (int *)malloc(n_blocks * sizeof(int));
+        for (int i = 0; i < n_blocks; i++) { blocks[i] = i; }
+        int pos = ctx - 1;
+        Batch batch;
+        memset(&batch, 0, sizeof(batch));
+        batch.n_tokens = 1;
+        batch.pos = &pos;
+        batch.blocks = &blocks;
+        BENCH(ns, backend_attention(backend, head_size)(out, q, &kv, &batch, 0, p->n_heads, kv_mul, head_size));
+        snprintf(dims, sizeof(dims), "ctx %d heads %d/%d", ctx, p->n_heads, p->n_kv_heads);
+        report(roof, shape->name, "attention", dims, ns, 4.0 * (2.0 * ctx * kv_dim + 2 * dim), 4.0 * ctx * dim);
+        free(blocks);
+        free_kv_cache(&kv);
+    }
+    backend->free(q);
+
+    // softmax and sampling over the vocabulary, on the host as in the scheduler. both work in
+    // place, so every run restores the logits first and the copy is part of the time
+    float *logits = (float *)malloc(vocab_size * sizeof(float));
+    float *probs = (float *)malloc(vocab_size * sizeof(float));
+    for (int i = 0; i < vocab_size; i++) { logits[i] = random_f32(&rng) * 20.0f - 10.0f; }
+    snprintf(dims, sizeof(dims), "vocab %d", vocab_size);
+    BENCH(ns, memcpy(probs, logits, vocab_size * sizeof(float)); softmax(probs, vocab_size));
+    report(roof, shape->name, "softmax", dims, ns, 4.0 * 7 * vocab_size, 4.0 * vocab_size);
+    Sampler sampler;
+    float temperatures[] = {0.0f, 1.0f, 1.0f};
+    float topps[] = {0.9f, 1.0f, 0.9f};
+    const char *names[] = {"argmax", "multinom", "top-p 0.9"};
+    for (int i = 0; i < 3; i++) {
+        build_sampler(&sampler, vocab_size, temperatures[i], topps[i], 1234);
+        BENCH(ns, memcpy(probs, logits, vocab_size * sizeof(float)); sample(&sampler, probs));
+        snprintf(dims, sizeof(dims), "%s vocab %d", names[i], vocab_size);
+        report(roof, shape->name, "sample", dims, ns, 4.0 * 8 * vocab_size, 5.0 * vocab_size);
+        free_sampler(&sampler);
+    }
+    free(logits);
+    free(probs);
+    backend->free(x);
+    backend->free(out);
+}
+
+// ----------------------------------------------------------------------------
+// CLI
+
+void error_usage() {
+    fprintf(stderr, "Usage:   kernelbench [options]\n");
+    fprintf(stderr, "Example: kernelbench -s 15M,110M -b 1,16\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -d <int>    CUDA device to use, default the CPU\n");
+    fprintf(stderr, "  -k <string> backend of the kernels: cpu, simd or cuda, default cuda with a device and cpu without\n");
+    fprintf(stderr, "  -s <list>   comma separated model shapes out of 15M,42M,110M,7B, default all\n");
+    fprintf(stderr, "  -b <list>   comma separated batch sizes of the matmuls, default 1,16\n");
+    fprintf(stderr, "  -c <list>   comma separated attention context lengths, default 128,512,2048 (capped at max_seq_len)\n");
+    fprintf(stderr, "  -t <int>    milliseconds spent timing each kernel, default 200\n");
+    exit(EXIT_FAILURE);
+}
+
+int parse_list(char *list, int *out, int max) {
+    int n = 0;
+    for (char *s = list; *s != '\0' && n < max; ) {
+        out[n++] = atoi(s);
+        char *comma = strchr(s, ',');
+        if (comma == NULL) { break; }
+        s = comma + 1;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    int device = -1;
+    char *backend_name = NULL;
+    char *shape_list = NULL;
+    int batches[16] = {1, 16};
+    int n_batches = 2;
+    int contexts[16] = {128, 512, 2048};
+    int n_contexts = 3;
+    long min_ns = 200 * 1000000L;
+
+    for (int i = 1; i < argc; i += 2) {
+        // do some basic validation
+        if (i + 1 >= argc) { error_usage(); } // must have arg after flag
+        if (argv[i][0] != '-') { error_usage(); } // must start with dash
+        if (strlen(argv[i]) != 2) { error_usage(); } // must be -x (one dash, one letter)
+        // read in the args
+        if (argv[i][1] == 'd') { device = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'k') { backend_name = argv[i + 1]; }
+        else if (argv[i][1] == 's') { shape_list = argv[i + 1]; }
+        else if (argv[i][1] == 'b') { n_batches = parse_list(argv[i + 1], batches, 16); }
+        else if (argv[i][1] == 'c') { n_contexts = parse_list(argv[i + 1], contexts, 16); }
+        else if (argv[i][1] == 't') { min_ns = atol(argv[i + 1]) * 1000000L; }
+        else { error_usage(); }
+    }
+    for (int i = 0; i < n_batches; i++) { if (batches[i] < 1) { error_usage(); } }
+    for (int i = 0; i < n_contexts; i++) { if (contexts[i] < 1) { error_usage(); } }
+    const Backend *backend = select_backend(backend_name, device);
+    device = backend->device;
+
+    Roofline roof;
+    roof.gb_s = stream_triad(device);
+    roof.gflop_s = peak_flops(device, 0);
+    roof.gop_s = backend->matmul_q8 != NULL ? peak_flops(device, 1) : 0.0;
+    printf("backend %s: stream triad %.2f GB/s, peak %.2f GFLOP/s, ridge at %.2f flop/byte", backend->name, roof.gb_s, roof.gflop_s,
+           roof.gflop_s / roof.gb_s);
+    if (roof.gop_s > 0) { printf(", int8 peak %.2f GOP/s", roof.gop_s); }
+    printf("\n");
+    printf("%-5s %-10s %-28s %11s %9s %9s %7s %9s %7s %s\n", "shape", "kernel", "dims", "us", "GB/s", "GFLOP/s", "flop/B", "roof", "%roof", "bound");
+
+    for (int i = 0; i < N_SHAPES; i++) {
+        if (shape_list != NULL) {
+            // match whole names only, 15M is not in 115M
+            size_t len = strlen(shapes[i].name);
+            const char *s = shape_list;
+            int found = 0;
+            while ((s = strstr(s, shapes[i].name)) != NULL) {
+                if ((s == shape_list || s[-1] == ',') && (s[len] == '\0' || s[len] == ',')) { found = 1; break; }
+                s += len;
+            }
+            if (!found) { continue; }
+        }
+        bench_shape(&shapes[i], &roof, batches, n_batches, contexts, n_contexts, min_ns, backend);
+    }
+    return 0;
+}
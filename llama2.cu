@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <alloca.h>
 #include <getopt.h>
 #include <string.h>
 #include <time.h>
@@ -11,6 +12,30 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <assert.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <limits.h>
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // CUDA headers
 #include "cuda.h"
@@ -106,34 +131,382 @@ typedef struct {
     float* wcls;
 } TransformerWeights;
 
-// RunState definition
+// the matrices as the matmul kernels of the backend read them: the row major weights of
+// the checkpoint, or the same repacked into panels of rows by pack_weights(). a pipeline
+// stage packs only its own layers, the plans read the others row major (see packed_layer())
+typedef struct {
+    int rows;       // rows per panel, 0 for the row major weights
+    int l0, l1;     // the layers in here
+    float *wq, *wk, *wv, *wo;   // (layer - l0, panels), as in TransformerWeights otherwise
+    float *w1, *w2, *w3;
+    float *wcls;    // NULL if left row major
+    void *map;      // the mapping of the panels, NULL for the row major weights
+    size_t map_bytes;
+} PackedWeights;
+
+// a matrix quantized to int8 by quantize_weights(), a scale per row: W[i][j] ~ w[i][j] * scale[i]
+typedef struct {
+    int8_t *w;      // (layer - l0, d, n), as in TransformerWeights
+    float *scale;   // (layer - l0, d)
+    int *sum;       // (layer - l0, d) sum of each row of w, see matmul_q8()
+} QuantMatrix;
+
+// the layer matrices of a W8A8 model, the embedding, rmsnorms and classifier stay fp32. a
+// pipeline stage quantizes only its own layers, the plans read the others in fp32
+typedef struct {
+    int l0, l1;     // the layers in here
+    QuantMatrix wq, wk, wv, wo, w1, w2, w3;
+    void *map;      // the mapping of all of them, NULL for an fp32 model
+    size_t map_bytes;
+} QuantWeights;
+
+typedef struct Backend Backend;
+
+// paged kv cache: the cache is a pool of fixed size blocks handed out to sequences,
+// each sequence maps its positions to blocks through a block table
+#define KV_BLOCK_SIZE 16    // positions per kv cache block
+
+typedef struct {
+    int n_blocks;           // blocks in the pool
+    size_t block_floats;    // floats per block, (layer, KV_BLOCK_SIZE, kv_dim), for keys and again for values
+    int kv_dim;             // floats per position, the stride of the positions in a block
+    float *key_pool;        // (n_blocks, layer, KV_BLOCK_SIZE, kv_dim)
+    float *value_pool;      // (n_blocks, layer, KV_BLOCK_SIZE, kv_dim)
+    int *free_blocks;       // stack of free block ids
+    int n_free;
+    int *refs;              // (n_blocks,) sequences holding each block, forks share blocks copy on write
+    // (optional) swap tier in host memory or a file, preempted sequences park their blocks here
+    int n_swap_blocks;
+    size_t swap_bytes;      // size of the swap mapping
+    float *swap_keys;       // (n_swap_blocks, layer, KV_BLOCK_SIZE, kv_dim)
+    float *swap_values;
+    int *free_swap;         // stack of free swap slots
+    int n_free_swap;
+    const Backend *backend; // owner of the pools
+    int shared;             // the pools are in the mapping of a TensorParallel instead, unmapped with it
+    // (optional) the block copies since the last forward, (n_log, 3) of kind, destination and
+    // source, for the remote pipeline stages that keep the kv cache of their layers, see kv_log()
+    int *log;
+    int n_log, max_log;
+} KVCache;
+
+#define LOGPROB_SLICES 64   // vocab slices the fused classifier and log-softmax is split into
+
+// RunState definition, activations hold one row per token of the batch being forwarded
 typedef struct {
-    float *x; // activation at current time stamp (dim,)
+    float *x; // activation at current time stamp (batch, dim)
     float *partial_sum; // uses to save temporary reduce results from RMSNorm
-    float *xb; // same, but insize a residual branch (dim,)
-    float *xb2; // an additional buffer just for convenience (dim,)
-    float *hb; // buffer for hidden dimension in the ffn (hidden_dim,)
-    float *hb2; // bufffer for hidden dimension in the ffn (hidden_dim,)
-    float *q; // query (dim,)
-    float *k; // key (dim,)
-    float *v; // value (dim,)
-    float *att; // buffer for the scores/attention avlues (n_heads, seq_len)
-    float *logits; // output logits
+    float *xb; // same, but insize a residual branch (batch, dim)
+    float *xb2; // an additional buffer just for convenience (batch, dim)
+    float *hb; // buffer for hidden dimension in the ffn (batch, hidden_dim)
+    float *hb2; // bufffer for hidden dimension in the ffn (batch, hidden_dim)
+    float *q; // query (batch, dim)
+    float *k; // key (batch, kv_dim)
+    float *v; // value (batch, kv_dim)
+    float *logits; // output logits (max_logits, vocab_size)
+    float *logprobs; // log-probability of the target token of every scored row (max_batch,)
+    float *logprob_partial; // running max and sum of exponentials per row and vocab slice (max_batch, LOGPROB_SLICES, 2)
+    int *targets; // target token of every scored row (max_batch,)
+    uint8_t *xq; // the input of the int8 matmuls, quantized per row and offset by 128 (batch, hidden_dim)
+    float *xq_scale; // the scale of every row of xq (batch,)
+    int max_batch; // tokens per forward
+    int max_logits; // logits rows per forward
+    void *arena; // every buffer above is carved from this one block, see carve_run_state()
+    size_t arena_bytes;
     // kv cache
-    float *key_cache; // (layer, seq_len, dim)
-    float *value_cache; // (layer , seq_len, dim)
+    KVCache kv;
 } RunState;
 
-// Transformer definition
+// a batch of tokens from any number of sequences, forwarded together
+typedef struct {
+    int n_tokens;
+    int *token;         // (max_batch,) token ids
+    int *pos;           // (max_batch,) position of each token in its sequence
+    int **blocks;       // (max_batch,) kv block table of the sequence each token belongs to
+    int *logits_row;    // (max_batch,) row of RunState.logits to fill for this token, -1 if not needed
+    int n_logits;
+    int *score_row;     // (max_batch,) row of RunState.logprobs to fill for this token, -1 if not scored
+    int *target;        // (max_batch,) by score row: the token whose log-probability is wanted
+    int n_scored;
+} Batch;
+
+typedef void (*MatmulFn)(float *xout, float *x, float *w, int n, int d, int batch);
+typedef void (*RmsnormFn)(float *o, float *x, float *partial_o, float *weight, int size);
+typedef void (*AttentionFn)(float *out, float *q_all, KVCache *kv, Batch *batch, size_t loff, int n_heads, int kv_mul, int head_size);
+typedef void (*LogprobFn)(float *out, float *partial, float *x, float *w, int *target, int n, int d, int batch);
+typedef void (*MatmulQ8Fn)(float *xout, const uint8_t *xq, const float *xscale, const QuantMatrix *w, int n, int d, int batch);
+
+// a compute backend: where the buffers live and the kernels that run over them, see select_backend()
+struct Backend {
+    const char *name;
+    int device;         // cudaCpuDeviceId, or the CUDA device of the backend
+    void *(*alloc)(size_t bytes);
+    void (*free)(void *ptr);
+    void (*copy)(void *dst, const void *src, size_t bytes);
+    void (*prefetch)(const void *ptr, size_t bytes, int device);
+    void *(*map)(int fd, size_t bytes);     // the checkpoint, read only
+    void (*unmap)(void *ptr, size_t bytes);
+    MatmulFn matmul;
+    RmsnormFn rmsnorm;
+    void (*rope)(float *q, float *k, int pos, int dim, int kv_dim, int head_size);
+    AttentionFn attention;
+    void (*residual)(float *x, float *y, size_t n);     // x += y
+    void (*swiglu)(float *hb, float *hb2, size_t n);    // hb = silu(hb) * hb2
+    LogprobFn logprob;
+    // (optional) the kernels compiled for one size: the n of matmul and logprob, the size of
+    // rmsnorm, the head_size of attention. they return NULL for a size they don't have
+    MatmulFn (*matmul_for)(int n);
+    RmsnormFn (*rmsnorm_for)(int size);
+    AttentionFn (*attention_for)(int head_size);
+    LogprobFn (*logprob_for)(int n);
+    // (optional) matmul over weights packed into panels of panel_rows rows, see pack_weights()
+    int panel_rows;
+    MatmulFn matmul_panels;
+    MatmulFn (*matmul_panels_for)(int n);
+    // (optional) matmul over int8 weights of x quantized per row, see quantize_weights()
+    MatmulQ8Fn matmul_q8;
+};
+
+// the forward pass compiled once per model by build_plan(): a flat list of kernel calls with
+// their weights, buffers and sizes resolved, replayed by forward_batch() for every batch
+typedef struct PlanOp PlanOp;
+typedef void (*PlanKernel)(const PlanOp *op, RunState *s, Batch *batch);
+
+typedef enum { ROWS_TOKENS, ROWS_ATTENDED, ROWS_OUTPUT, ROWS_LOGITS, ROWS_SCORED } PlanRows;
+
+struct PlanOp {
+    PlanKernel run;     // the op
+    const Backend *backend; // what it runs on
+    // and the kernel of the backend it calls, for its sizes when the backend has one for them
+    MatmulFn matmul;
+    RmsnormFn rmsnorm;
+    AttentionFn attention;
+    LogprobFn logprob;
+    MatmulQ8Fn matmul_q8;
+    void *ctx;          // (optional) what else the op runs on, e.g. the TensorParallel of op_allreduce
+    float *w;           // weights, already at the layer
+    QuantMatrix q8;     // or the int8 ones of op_matmul_q8, already at the layer
+    float *in;          // activations read, (batch, n)
+    float *out;         // activations written, (batch, d)
+    int n, d;           // W is (d, n), the elementwise ops run over (batch, d)
+    int n_heads, kv_mul, head_size; // attention and rope
+    size_t loff;        // layer offset inside a kv block
+    // for the profiler: the op this kernel closes (-1 if the next kernel is part of it),
+    // its layer, and the bytes and flops it moves per forward and per row of what it runs over
+    int prof;
+    int layer;
+    PlanRows rows;
+    double bytes, bytes_row, flops_row;
+};
+
+typedef struct {
+    PlanOp *ops;
+    int n_ops;
+    const Backend *backend; // of every op so far
+} ExecPlan;
+
+typedef struct Profiler Profiler;
+typedef struct Pipeline Pipeline;
+typedef struct TensorParallel TensorParallel;
+
+// Model definition, the read only half of a Transformer: mapped once, shared by all of them
 typedef struct {
     Config config;
     TransformerWeights weights; // model weights
-    RunState state; // buffer required to store intermediate values during forward pass
+    PackedWeights packed; // the matrices the plans read
+    QuantWeights quant; // or their int8 copies, read instead when quantize_weights() made them
     int fd; // file descriptor required for memory mapping, explained later TODO
     float *data; // data pointer, TODO
     uint64_t file_size; // size of the model checkpoint file in bytes
+    uint64_t file_id[4]; // st_dev, st_ino and st_mtime (s, ns) of the checkpoint, see checkpoint_hash()
+    const Backend *backend; // where the weights live
+} Model;
+
+// Transformer definition, a context over a Model: everything a forward writes is its own
+typedef struct {
+    Config config; // of the model, with max_seq_len as capped for this context
+    const Model *model; // the weights, shared with every other context over it
+    RunState state; // buffer required to store intermediate values during forward pass
+    const Backend *backend; // runs the forward pass
+    ExecPlan plan; // the forward pass, built once
+    Profiler *profiler; // per op timings, NULL unless profiling
+    Pipeline *pipeline; // stages the layers are split into, NULL for one
+    TensorParallel *tp; // ranks the heads and ffn columns are split over, NULL for one
 } Transformer;
 
+// ----------------------------------------------------------------------------
+// utilities: time
+
+long time_in_ms() {
+    // return time in milliseconds, for benchmarking the model speed. the clock is monotonic,
+    // every use is a difference or a deadline and neither should jump with the wall clock
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+long time_in_ns() {
+    // same clock in nanoseconds, for the latencies of bench mode
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000L + time.tv_nsec;
+}
+
+// ----------------------------------------------------------------------------
+// trace: a timeline of the whole request pipeline (tokenization, forward steps,
+// sampling, output) as Chrome trace_event JSON, for Perfetto or chrome://tracing.
+// every thread records into a buffer of its own, claimed on its first event, so
+// recording takes no lock. the buffers are only read when the trace is written at
+// exit, once the other threads are done. sequences show up as async tracks from
+// submission to finish, e.g.
+//   ./main -m model.bin -M server --trace trace.json
+//   (Ctrl-C the server, then open trace.json in https://ui.perfetto.dev)
+
+#define TRACE_MAX_THREADS 64
+#define TRACE_MAX_EVENTS (1 << 20)  // per thread, later events are dropped
+
+typedef struct {
+    const char *name;
+    const char *arg;    // name of value in the event's args, NULL if it has none
+    char phase;         // 'X' complete, 'b'/'e' begin/end of a sequence, 'n' instant on a sequence
+    long ts;            // time_in_ns() at the start
+    long dur;
+    long id;            // sequence of the async events
+    long value;
+} TraceEvent;
+
+typedef struct {
+    TraceEvent *events;
+    int n_events;
+    int capacity;
+    long dropped;
+    const char *thread_name;
+} TraceBuffer;
+
+typedef struct {
+    TraceBuffer buffers[TRACE_MAX_THREADS];
+    int n_buffers;      // claimed with an atomic add
+    long start;
+    char *path;
+} Tracer;
+
+// the trace is process wide like the threads it follows, NULL unless --trace
+static Tracer *tracer = NULL;
+static __thread TraceBuffer *trace_local = NULL;
+
+void build_tracer(Tracer *t, char *path) {
+    memset(t, 0, sizeof(Tracer));
+    t->start = time_in_ns();
+    t->path = path;
+    tracer = t;
+}
+
+void free_tracer(Tracer *t) {
+    for (int i = 0; i < t->n_buffers && i < TRACE_MAX_THREADS; i++) { free(t->buffers[i].events); }
+    tracer = NULL;
+}
+
+TraceBuffer* trace_buffer() {
+    // the calling thread's buffer, NULL when there are too many threads
+    if (trace_local == NULL) {
+        int slot = __atomic_fetch_add(&tracer->n_buffers, 1, __ATOMIC_RELAXED);
+        if (slot >= TRACE_MAX_THREADS) { return NULL; }
+        trace_local = &tracer->buffers[slot];
+    }
+    return trace_local;
+}
+
+TraceEvent* trace_event() {
+    // a slot in the calling thread's buffer, NULL when it is full
+    TraceBuffer *b = trace_buffer();
+    if (b == NULL) { return NULL; }
+    if (b->n_events == b->capacity) {
+        if (b->capacity == TRACE_MAX_EVENTS) { b->dropped++; return NULL; }
+        b->capacity = b->capacity == 0 ? 4096 : 2 * b->capacity;
+        b->events = (TraceEvent *)realloc(b->events, b->capacity * sizeof(TraceEvent));
+        if (!b->events) {
+            fprintf(stderr, "malloc failed!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return &b->events[b->n_events++];
+}
+
+long trace_begin() {
+    // start time of a complete event, the clock is only read when tracing
+    return tracer != NULL ? time_in_ns() : 0;
+}
+
+void trace_end(const char *name, long start, const char *arg, long value) {
+    if (tracer == NULL) { return; }
+    long now = time_in_ns();
+    TraceEvent *e = trace_event();
+    if (e == NULL) { return; }
+    e->name = name;
+    e->arg = arg;
+    e->phase = 'X';
+    e->ts = start;
+    e->dur = now - start;
+    e->id = 0;
+    e->value = value;
+}
+
+void trace_seq(char phase, const char *name, long id, const char *arg, long value) {
+    // async events of sequence id: 'b' and 'e' bound its track, 'n' marks a point on it
+    if (tracer == NULL) { return; }
+    TraceEvent *e = trace_event();
+    if (e == NULL) { return; }
+    e->name = name;
+    e->arg = arg;
+    e->phase = phase;
+    e->ts = time_in_ns();
+    e->dur = 0;
+    e->id = id;
+    e->value = value;
+}
+
+void trace_thread_name(const char *name) {
+    // labels the track of the calling thread
+    if (tracer == NULL) { return; }
+    TraceBuffer *b = trace_buffer();
+    if (b != NULL) { b->thread_name = name; }
+}
+
+void write_trace(Tracer *t) {
+    FILE *file = fopen(t->path, "w");
+    if (!file) {
+        fprintf(stderr, "couldn't open %s\n", t->path);
+        return;
+    }
+    long n_events = 0, dropped = 0;
+    int n_buffers = t->n_buffers < TRACE_MAX_THREADS ? t->n_buffers : TRACE_MAX_THREADS;
+    int first = 1;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0; i < n_buffers; i++) {
+        TraceBuffer *b = &t->buffers[i];
+        if (b->thread_name != NULL) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", i + 1, b->thread_name);
+            first = 0;
+        }
+        for (int j = 0; j < b->n_events; j++) {
+            TraceEvent *e = &b->events[j];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", first ? "" : ",\n", e->name, e->phase, i + 1, (e->ts - t->start) / 1e3);
+            first = 0;
+            if (e->phase == 'X') { fprintf(file, ",\"dur\":%.3f", e->dur / 1e3); }
+            else { fprintf(file, ",\"cat\":\"sequence\",\"id\":%ld", e->id); }
+            if (e->arg != NULL) { fprintf(file, ",\"args\":{\"%s\":%ld}", e->arg, e->value); }
+            fprintf(file, "}");
+        }
+        n_events += b->n_events;
+        dropped += b->dropped;
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    fprintf(stderr, "trace: %ld events of %d threads written to %s", n_events, n_buffers, t->path);
+    if (dropped > 0) { fprintf(stderr, ", %ld dropped past %d per thread", dropped, TRACE_MAX_EVENTS); }
+    fprintf(stderr, "\n");
+}
+
 // ----------------------------------------------------------------------------
 // Sampler
 // ----------------------------------------------------------------------------
@@ -151,6 +524,131 @@ void free_sampler(Sampler *sampler) {
     free(sampler->probindex);
 }
 
+void softmax(float *x, int size) {
+    // find max value (for numerical stability)
+    float max_val = x[0];
+    for (int i = 1; i < size; i++) {
+        if (x[i] > max_val) { max_val = x[i]; }
+    }
+    // exp and sum
+    float sum = 0.0f;
+    for (int i = 0; i < size; i++) {
+        x[i] = expf(x[i] - max_val);
+        sum += x[i];
+    }
+    // normalize
+    for (int i = 0; i < size; i++) { x[i] /= sum; }
+}
+
+int sample_argmax(float *probabilities, int n) {
+    // return the index that has the highest probability
+    int max_i = 0;
+    float max_p = probabilities[0];
+    for (int i = 1; i < n; i++) {
+        if (probabilities[i] > max_p) {
+            max_i = i;
+            max_p = probabilities[i];
+        }
+    }
+    return max_i;
+}
+
+int sample_mult(float *probabilities, int n, float coin) {
+    // sample index from probabilities (they must sum to 1!)
+    // coin is a random number in [0, 1), usually from random_f32()
+    float cdf = 0.0f;
+    for (int i = 0; i < n; i++) {
+        cdf += probabilities[i];
+        if (coin < cdf) { return i; }
+    }
+    return n - 1; // in case of rounding errors
+}
+
+int compare_probs(const void *a, const void *b) {
+    ProbIndex *a_ = (ProbIndex *)a;
+    ProbIndex *b_ = (ProbIndex *)b;
+    if (a_->prob > b_->prob) return -1;
+    if (a_->prob < b_->prob) return 1;
+    return 0;
+}
+
+int sample_topp(float *probabilities, int n, float topp, ProbIndex *probindex, float coin) {
+    // top-p sampling (or "nucleus sampling") samples from the smallest set of
+    // tokens that exceed probability topp. This way we never sample tokens that
+    // have very low probabilities and are less likely to go "off the rails".
+    // coin is a random number in [0, 1), usually from random_f32()
+    int n0 = 0;
+    // quicksort indices in descending order of probabilities
+    // values smaller than (1 - topp) / (n - 1) cannot be part of the result
+    // so for efficiency we crop these out as candidates before sorting
+    const float cutoff = (1.0f - topp) / (n - 1);
+    for (int i = 0; i < n; i++) {
+        if (probabilities[i] >= cutoff) {
+            probindex[n0].index = i;
+            probindex[n0].prob = probabilities[i];
+            n0++;
+        }
+    }
+    qsort(probindex, n0, sizeof(ProbIndex), compare_probs);
+
+    // truncate the list where cumulative probability exceeds topp
+    float cumulative_prob = 0.0f;
+    int last_idx = n0 - 1; // in case of rounding errors consider all elements
+    for (int i = 0; i < n0; i++) {
+        cumulative_prob += probindex[i].prob;
+        if (cumulative_prob > topp) {
+            last_idx = i;
+            break; // we've exceeded topp by including last_idx
+        }
+    }
+
+    // sample from the truncated list
+    float r = coin * cumulative_prob;
+    float cdf = 0.0f;
+    for (int i = 0; i <= last_idx; i++) {
+        cdf += probindex[i].prob;
+        if (r < cdf) { return probindex[i].index; }
+    }
+    return probindex[last_idx].index; // in case of rounding errors
+}
+
+unsigned int random_u32(unsigned long long *state) {
+    // xorshift rng: https://en.wikipedia.org/wiki/Xorshift#xorshift.2A
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+float random_f32(unsigned long long *state) { // random float32 in [0,1)
+    return (random_u32(state) >> 8) / 16777216.0f;
+}
+
+int sample(Sampler *sampler, float *logits) {
+    // sample the token given the logits and some hyperparameters
+    int next;
+    if (sampler->temperature == 0.0f) {
+        // greedy argmax sampling: take the token with the highest probability
+        next = sample_argmax(logits, sampler->vocab_size);
+    } else {
+        // apply the temperature to the logits
+        for (int q = 0; q < sampler->vocab_size; q++) { logits[q] /= sampler->temperature; }
+        // apply softmax to the logits to get the probabilities for next token
+        softmax(logits, sampler->vocab_size);
+        // flip a (float) coin (this is our source of entropy for sampling)
+        float coin = random_f32(&sampler->rng_state);
+        // we sample from this distribution to get the next token
+        if (sampler->topp <= 0 || sampler->topp >= 1) {
+            // simply sample from the predicted probability distribution
+            next = sample_mult(logits, sampler->vocab_size, coin);
+        } else {
+            // top-p (nucleus) sampling, clamping the least likely tokens to zero
+            next = sample_topp(logits, sampler->vocab_size, sampler->topp, sampler->probindex, coin);
+        }
+    }
+    return next;
+}
+
 // ----------------------------------------------------------------------------
 // Tokenizer
 // ----------------------------------------------------------------------------
@@ -199,27 +697,31 @@ int str_lookup(char *str, const TokenIndex *sorted_vocab, size_t vocab_size) {
     return res != NULL ? res->id : -1;
 }
 
+void sort_vocab(Tokenizer *t) {
+    // alloc and sort the vocabulary (host only, released with free() in free_tokenizer).
+    // encode() does this lazily, threads sharing a Tokenizer call it once up front
+    t->sorted_vocab = (TokenIndex *)malloc(t->vocab_size * sizeof(TokenIndex));
+    for (int i = 0; i < t->vocab_size; i++) {
+        t->sorted_vocab[i].str = t->vocab[i];
+        t->sorted_vocab[i].id = i;
+    }
+    qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
+}
+
 void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *n_tokens) {
     // byte-pair encoding tokenization, more explanation can be found at: https://huggingface.co/learn/nlp-course/chapter6/5?fw=pt
 
     // encode the string text (input) into an upper-bound preallocated tokens[] array
     // bos != 0 means prepend the BOS token (=1), eos != 0 means append the EOS token (=2)
     if (text == NULL) {fprintf(stderr, "cannot encode NULL text\n"); exit(EXIT_FAILURE);}
+    long trace_start = trace_begin();
 
-    if (t->sorted_vocab == NULL) {
-        // lazily alloc and sort the vocabulary
-        checkCudaErrors(cudaMallocManaged((void **)&t->sorted_vocab, t->vocab_size * sizeof(TokenIndex)));
-        for (int i = 0; i < t->vocab_size; i++) {
-            t->sorted_vocab[i].str = t->vocab[i];
-            t->sorted_vocab[i].id = i;
-        }
-        qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
-    }
+    if (t->sorted_vocab == NULL) { sort_vocab(t); }
 
     // create a temporary buffer that will store merge candidates of always two consecutive tokens
     // *2 for concat, +1 for null terminator +2 for UTF8 (in case max_token_length is 1)
-    char *str_buffer = (char *)malloc((t->max_token_length*2 +1 +2) * sizeof(char));
-    printf("max token len: %d\n", t->max_token_length);
+    // on the stack: encode runs for every request, from several threads at once
+    char *str_buffer = (char *)alloca((t->max_token_length*2 +1 +2) * sizeof(char));
     size_t str_len = 0;
 
     // start at 0 tokens
@@ -234,7 +736,6 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
     // energy to read more of the sentencepiece code to figure out what it's doing
     if (text[0] != '\0') {
         int dummy_prefix = str_lookup((char *)" ", t->sorted_vocab, t->vocab_size);
-        printf("dummy prefix %d\n", dummy_prefix);
         tokens[(*n_tokens)++] = dummy_prefix;
     }
 
@@ -322,55 +823,258 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
     // add optional EOS (=2) token, if desired
     if (eos) tokens[(*n_tokens)++] = 2;
 
-    free(str_buffer);
+    trace_end("encode", trace_start, "tokens", *n_tokens);
+}
+
+char* decode(Tokenizer *t, int prev_token, int token) {
+    char *piece = t->vocab[token];
+    // following BOS (1) token, sentencepiece decoder strips any leading whitespace (see PR #89)
+    if (prev_token == 1 && piece[0] == ' ') { piece++; }
+    // careful, some tokens designate raw bytes, and look like e.g. '<0x01>'
+    // parse this and convert and return the actual byte
+    unsigned char byte_val;
+    if (sscanf(piece, "<0x%02hhX>", &byte_val) == 1) {
+        piece = (char *)t->byte_pieces + byte_val * 2;
+    }
+    return piece;
+}
+
+int is_safe_piece(const char *piece) {
+    // piece might be a raw byte token, and we only want to print printable chars or whitespace
+    // because some of the other bytes can be various control codes, backspace, etc.
+    if (piece == NULL) { return 0; }
+    if (piece[0] == '\0') { return 0; }
+    if (piece[1] == '\0') {
+        unsigned char byte_val = piece[0];
+        if (!(isprint(byte_val) || isspace(byte_val))) {
+            return 0; // bad byte, don't print it
+        }
+    }
+    return 1;
+}
+
+void safe_printf(char *piece) {
+    if (is_safe_piece(piece)) { printf("%s", piece); }
 }
 
 // ----------------------------------------------------------------------------
 // Transformer
 // ----------------------------------------------------------------------------
+// a Model is the Config and the weights of a checkpoint, mapped once and read only
+// from then on. a Transformer is a context over one: its own RunState, kv cache and
+// plan, so threads can each forward their own Transformer over one shared Model
+// (with a Scheduler and Sampler per thread, and one Tokenizer after sort_vocab()).
+// pack_weights() and autotune() change what every context reads, they go first.
+// to embed the engine, define LLAMA2_NO_MAIN and include this file, e.g.
+//   Model model;
+//   build_model(&model, "model.bin", select_backend(NULL, -1));
+//   Transformer t[N]; // one per thread, each then
+//   build_transformer(&t[i], &model, 256, 8, 0, 0);
+//   ...
+//   free_transformer(&t[i]);
+//   free_model(&model);
 
-void alloc_run_state(RunState *s, Config config, int device) {
+void build_kv_cache(KVCache *kv, Config config, int n_blocks, const Backend *backend) {
     int kv_dim = config.dim * config.n_kv_heads / config.n_heads;
-    checkCudaErrors(cudaMallocManaged((void **)&s->x, config.dim * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->x, config.dim * sizeof(float), device));
-
-
-    // calculate RMS norm partial reduce output buffer size
-    checkCudaErrors(cudaMallocManaged((void **)&s->partial_sum, config.dim * sizeof(float)));   // TODO: may need to reduce the size for partial sum
-    checkCudaErrors(cudaMemPrefetchAsync(s->partial_sum, config.dim * sizeof(float), device));
-
-
-    checkCudaErrors(cudaMallocManaged((void **)&s->xb, config.dim * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->xb, config.dim * sizeof(float), device));
-    checkCudaErrors(cudaMallocManaged((void **)&s->xb2, config.dim * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->xb2, config.dim * sizeof(float), device));
-    checkCudaErrors(cudaMallocManaged((void **)&s->hb, config.hidden_dim * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->hb, config.hidden_dim * sizeof(float), device));
-    checkCudaErrors(cudaMallocManaged((void **)&s->hb2, config.hidden_dim * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->hb2, config.hidden_dim * sizeof(float), device));
-    checkCudaErrors(cudaMallocManaged((void **)&s->q, config.dim * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->q, config.dim * sizeof(float), device));
-    checkCudaErrors(cudaMallocManaged((void **)&s->key_cache, config.n_layers * config.max_seq_len * kv_dim * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->key_cache, config.n_layers * config.max_seq_len * kv_dim * sizeof(float), device));
-    checkCudaErrors(cudaMallocManaged((void **)&s->value_cache, config.n_layers * config.max_seq_len * kv_dim * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->value_cache, config.n_layers * config.max_seq_len * kv_dim * sizeof(float), device));
-    checkCudaErrors(cudaMallocManaged((void **)&s->att, config.n_heads * config.max_seq_len * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->att, config.n_heads * config.max_seq_len * sizeof(float), device));
-    checkCudaErrors(cudaMallocManaged((void **)&s->logits, config.vocab_size * sizeof(float)));
-    checkCudaErrors(cudaMemPrefetchAsync(s->logits, config.vocab_size * sizeof(float), device));
-}
-
-void free_run_state(RunState *s) {
-    checkCudaErrors(cudaFree((void *)s->x));
-    checkCudaErrors(cudaFree((void *)s->xb));
-    checkCudaErrors(cudaFree((void *)s->xb2));
-    checkCudaErrors(cudaFree((void *)s->hb));
-    checkCudaErrors(cudaFree((void *)s->hb2));
-    checkCudaErrors(cudaFree((void *)s->q));
-    checkCudaErrors(cudaFree((void *)s->key_cache));
-    checkCudaErrors(cudaFree((void *)s->value_cache));
-    checkCudaErrors(cudaFree((void *)s->att));
-    checkCudaErrors(cudaFree((void *)s->logits));
+    kv->backend = backend;
+    kv->n_blocks = n_blocks;
+    kv->kv_dim = kv_dim;
+    kv->shared = 0;
+    kv->block_floats = (size_t)config.n_layers * KV_BLOCK_SIZE * kv_dim;
+    size_t pool_bytes = (size_t)n_blocks * kv->block_floats * sizeof(float);
+    kv->key_pool = (float *)backend->alloc(pool_bytes);
+    backend->prefetch(kv->key_pool, pool_bytes, backend->device);
+    kv->value_pool = (float *)backend->alloc(pool_bytes);
+    backend->prefetch(kv->value_pool, pool_bytes, backend->device);
+    kv->free_blocks = (int *)malloc(n_blocks * sizeof(int));
+    kv->refs = (int *)calloc(n_blocks, sizeof(int));
+    // hand out low block ids first
+    for (int i = 0; i < n_blocks; i++) { kv->free_blocks[i] = n_blocks - 1 - i; }
+    kv->n_free = n_blocks;
+    kv->n_swap_blocks = 0;
+    kv->n_free_swap = 0;
+    kv->swap_keys = kv->swap_values = NULL;
+    kv->free_swap = NULL;
+    kv->log = NULL;
+    kv->n_log = kv->max_log = 0;
+}
+
+void build_kv_swap(KVCache *kv, int n_swap_blocks, char *swap_file) {
+    // the swap tier is anonymous host memory, or a file mapping when swap_file is given
+    if (n_swap_blocks <= 0) { return; }
+    kv->n_swap_blocks = n_swap_blocks;
+    kv->swap_bytes = 2 * (size_t)n_swap_blocks * kv->block_floats * sizeof(float);
+    void *swap;
+    if (swap_file != NULL) {
+        int fd = open(swap_file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd == -1 || ftruncate(fd, kv->swap_bytes) != 0) { fprintf(stderr, "couldn't create swap file %s\n", swap_file); exit(EXIT_FAILURE); }
+        swap = mmap(NULL, kv->swap_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        swap = mmap(NULL, kv->swap_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (swap == MAP_FAILED) { fprintf(stderr, "mmap of the kv swap tier failed\n"); exit(EXIT_FAILURE); }
+    kv->swap_keys = (float *)swap;
+    kv->swap_values = kv->swap_keys + (size_t)n_swap_blocks * kv->block_floats;
+    kv->free_swap = (int *)malloc(n_swap_blocks * sizeof(int));
+    for (int i = 0; i < n_swap_blocks; i++) { kv->free_swap[i] = n_swap_blocks - 1 - i; }
+    kv->n_free_swap = n_swap_blocks;
+}
+
+void free_kv_cache(KVCache *kv) {
+    if (!kv->shared) {
+        kv->backend->free(kv->key_pool);
+        kv->backend->free(kv->value_pool);
+    }
+    free(kv->free_blocks);
+    free(kv->refs);
+    if (kv->n_swap_blocks > 0) {
+        munmap(kv->swap_keys, kv->swap_bytes);
+        free(kv->free_swap);
+    }
+    free(kv->log);
+}
+
+int kv_alloc_block(KVCache *kv) {
+    // returns a free block id, or -1 when the pool is exhausted
+    if (kv->n_free == 0) { return -1; }
+    int block = kv->free_blocks[--kv->n_free];
+    kv->refs[block] = 1;
+    return block;
+}
+
+void kv_free_block(KVCache *kv, int block) {
+    // drops one reference, the block goes back to the pool with the last one
+    if (--kv->refs[block] == 0) { kv->free_blocks[kv->n_free++] = block; }
+}
+
+// what a logged copy moves: a block to a block, a block to a swap slot, a swap slot to a block
+enum { KV_COPY, KV_SWAP_OUT, KV_SWAP_IN };
+
+void kv_log(KVCache *kv, int kind, int dst, int src) {
+    // remembers a copy for the remote pipeline stages, a no-op unless there are any
+    if (kv->log == NULL) { return; }
+    if (kv->n_log == kv->max_log) {
+        kv->max_log *= 2;
+        kv->log = (int *)realloc(kv->log, kv->max_log * 3 * sizeof(int));
+    }
+    int *entry = kv->log + 3 * kv->n_log++;
+    entry[0] = kind;
+    entry[1] = dst;
+    entry[2] = src;
+}
+
+void kv_replay(KVCache *kv, const int *entry, int l0, int l1) {
+    // a logged copy, of the layers [l0, l1) of the blocks only: the others aren't this stage's
+    size_t layer = (size_t)KV_BLOCK_SIZE * kv->kv_dim;
+    size_t dst = entry[1] * kv->block_floats + l0 * layer, src = entry[2] * kv->block_floats + l0 * layer;
+    size_t bytes = (l1 - l0) * layer * sizeof(float);
+    float *dst_keys = entry[0] == KV_SWAP_OUT ? kv->swap_keys : kv->key_pool;
+    float *dst_values = entry[0] == KV_SWAP_OUT ? kv->swap_values : kv->value_pool;
+    float *src_keys = entry[0] == KV_SWAP_IN ? kv->swap_keys : kv->key_pool;
+    float *src_values = entry[0] == KV_SWAP_IN ? kv->swap_values : kv->value_pool;
+    kv->backend->copy(dst_keys + dst, src_keys + src, bytes);
+    kv->backend->copy(dst_values + dst, src_values + src, bytes);
+}
+
+void kv_copy_block(KVCache *kv, int dst, int src) {
+    kv_log(kv, KV_COPY, dst, src);
+    size_t bytes = kv->block_floats * sizeof(float);
+    kv->backend->copy(kv->key_pool + dst * kv->block_floats, kv->key_pool + src * kv->block_floats, bytes);
+    kv->backend->copy(kv->value_pool + dst * kv->block_floats, kv->value_pool + src * kv->block_floats, bytes);
+}
+
+int kv_swap_out(KVCache *kv, int *blocks, int n) {
+    // moves n blocks to the swap tier, rewriting blocks[] to swap slots. returns -1 if it doesn't fit.
+    // a block shared with other sequences stays in the pool for them, this one takes a private copy
+    if (kv->n_free_swap < n) { return -1; }
+    size_t bytes = kv->block_floats * sizeof(float);
+    for (int i = 0; i < n; i++) {
+        int slot = kv->free_swap[--kv->n_free_swap];
+        kv_log(kv, KV_SWAP_OUT, slot, blocks[i]);
+        kv->backend->copy(kv->swap_keys + slot * kv->block_floats, kv->key_pool + blocks[i] * kv->block_floats, bytes);
+        kv->backend->copy(kv->swap_values + slot * kv->block_floats, kv->value_pool + blocks[i] * kv->block_floats, bytes);
+        kv_free_block(kv, blocks[i]);
+        blocks[i] = slot;
+    }
+    return 0;
+}
+
+int kv_swap_in(KVCache *kv, int *blocks, int n) {
+    // inverse of kv_swap_out. returns -1 if the pool doesn't have n free blocks
+    if (kv->n_free < n) { return -1; }
+    size_t bytes = kv->block_floats * sizeof(float);
+    for (int i = 0; i < n; i++) {
+        int block = kv_alloc_block(kv);
+        kv_log(kv, KV_SWAP_IN, block, blocks[i]);
+        kv->backend->copy(kv->key_pool + block * kv->block_floats, kv->swap_keys + blocks[i] * kv->block_floats, bytes);
+        kv->backend->copy(kv->value_pool + block * kv->block_floats, kv->swap_values + blocks[i] * kv->block_floats, bytes);
+        kv->free_swap[kv->n_free_swap++] = blocks[i];
+        blocks[i] = block;
+    }
+    return 0;
+}
+
+// a bump allocator over one block: every buffer is carved at a 64 byte aligned offset. a pass
+// without a block (base NULL) only adds up the bytes, so the block can be sized exactly first
+#define ARENA_ALIGN 64
+
+typedef struct {
+    char *base;
+    size_t used;
+} Arena;
+
+void *arena_take(Arena *a, size_t bytes) {
+    void *ptr = a->base != NULL ? a->base + a->used : NULL;
+    a->used += (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    return ptr;
+}
+
+void carve_run_state(RunState *s, Arena *a, Config config) {
+    // the buffers of s out of a, sized in 64 bit for the big configs
+    size_t batch = s->max_batch;
+    size_t dim = config.dim;
+    size_t kv_dim = dim * config.n_kv_heads / config.n_heads;
+    size_t f = sizeof(float);
+    s->x = (float *)arena_take(a, batch * dim * f);
+    s->partial_sum = (float *)arena_take(a, dim * f); // rmsnorm partial sums, one token at a time
+    s->xb = (float *)arena_take(a, batch * dim * f);
+    s->xb2 = (float *)arena_take(a, batch * dim * f);
+    s->hb = (float *)arena_take(a, batch * config.hidden_dim * f);
+    s->hb2 = (float *)arena_take(a, batch * config.hidden_dim * f);
+    s->q = (float *)arena_take(a, batch * dim * f);
+    s->k = (float *)arena_take(a, batch * kv_dim * f);
+    s->v = (float *)arena_take(a, batch * kv_dim * f);
+    s->logits = (float *)arena_take(a, (size_t)s->max_logits * config.vocab_size * f);
+    s->logprobs = (float *)arena_take(a, batch * f);
+    s->logprob_partial = (float *)arena_take(a, batch * LOGPROB_SLICES * 2 * f);
+    s->targets = (int *)arena_take(a, batch * sizeof(int));
+    s->xq = (uint8_t *)arena_take(a, batch * (config.hidden_dim > dim ? config.hidden_dim : dim));
+    s->xq_scale = (float *)arena_take(a, batch * f);
+}
+
+void alloc_activations(RunState *s, Config config, int max_batch, int max_logits, const Backend *backend) {
+    s->max_batch = max_batch;
+    s->max_logits = max_logits;
+    // measure, then one allocation and one prefetch for all of it
+    Arena a = {NULL, 0};
+    carve_run_state(s, &a, config);
+    s->arena_bytes = a.used;
+    s->arena = backend->alloc(s->arena_bytes);
+    a.base = (char *)s->arena;
+    a.used = 0;
+    carve_run_state(s, &a, config);
+    backend->prefetch(s->arena, s->arena_bytes, backend->device);
+}
+
+void alloc_run_state(RunState *s, Config config, int max_batch, int max_logits, int kv_blocks, const Backend *backend) {
+    alloc_activations(s, config, max_batch, max_logits, backend);
+    build_kv_cache(&s->kv, config, kv_blocks, backend);
+}
+
+void free_run_state(RunState *s, const Backend *backend) {
+    backend->free(s->arena);
+    free_kv_cache(&s->kv);
 }
 
 void memory_map_weights(TransformerWeights *w, Config config, float *ptr, int shared_weights) {
@@ -378,7 +1082,7 @@ void memory_map_weights(TransformerWeights *w, Config config, float *ptr, int sh
     // make sure the multiplications below are done in 64bit to fit the parameter counts of 13B+ models
     unsigned long long n_layers = config.n_layers;
     w->token_embedding_table = ptr;
-    ptr += config.vocab_size * config.dim;
+    ptr += (size_t)config.vocab_size * config.dim;
     w->rms_att_weight = ptr;
     ptr += n_layers * config.dim;
     w->wq = ptr;
@@ -404,8 +1108,8 @@ void memory_map_weights(TransformerWeights *w, Config config, float *ptr, int sh
     w->wcls = shared_weights ? w->token_embedding_table : ptr;
 }
 
-void read_checkpoint(char *checkpoint, Transformer *transformer, int device) {
-    Config *config = &(transformer->config);
+int read_config(char *checkpoint, Config *config, uint64_t *file_size) {
+    // the Config header and the size of a checkpoint, returns whether the classifier shares the embedding
     FILE *file = fopen(checkpoint, "rb");   // "rb" for openning binary file
     if (file == NULL) {fprintf(stderr, "Failed to open checkpoint file %s\n", checkpoint); exit(EXIT_FAILURE);}
     // read in the config header
@@ -417,43 +1121,215 @@ void read_checkpoint(char *checkpoint, Transformer *transformer, int device) {
     config->vocab_size = abs(config->vocab_size);
     // figure out the file size
     fseek(file, 0, SEEK_END); // move file pointer to end of file
-    transformer->file_size = ftell(file);
+    *file_size = ftell(file);
     fclose(file);
+    return shared_weights;
+}
+
+PackedWeights row_major_weights(const Model *model) {
+    // the matrices of the checkpoint as they are, all of the layers
+    const TransformerWeights *w = &model->weights;
+    PackedWeights m = {0, 0, model->config.n_layers, w->wq, w->wk, w->wv, w->wo, w->w1, w->w2, w->w3, w->wcls, NULL, 0};
+    return m;
+}
+
+int packed_layer(const PackedWeights *m, int layer, int n_layers) {
+    // whether the matrices of layer are in panels, layer n_layers for wcls
+    return m->rows > 0 && ((layer >= m->l0 && layer < m->l1) || (layer == n_layers && m->wcls != NULL));
+}
+
+void read_checkpoint(char *checkpoint, Model *transformer) {
+    int shared_weights = read_config(checkpoint, &transformer->config, &transformer->file_size);
     // memory map the Transformer weights into the data pointer
     transformer->fd = open(checkpoint, O_RDONLY);
     if (transformer->fd == -1) { fprintf(stderr, "open checkpoint failed!\n"); exit(EXIT_FAILURE); }
-    checkCudaErrors(cudaMallocManaged((void **)&transformer->data, transformer->file_size+1));
+    struct stat st;
+    if (fstat(transformer->fd, &st) != 0) { fprintf(stderr, "stat checkpoint failed!\n"); exit(EXIT_FAILURE); }
+    transformer->file_id[0] = st.st_dev;
+    transformer->file_id[1] = st.st_ino;
+    transformer->file_id[2] = st.st_mtim.tv_sec;
+    transformer->file_id[3] = st.st_mtim.tv_nsec;
+    transformer->data = (float *)transformer->backend->map(transformer->fd, transformer->file_size);
     float *weights_ptr = transformer->data + sizeof(Config) / sizeof(float);
     memory_map_weights(&transformer->weights, transformer->config, weights_ptr, shared_weights);
-    checkCudaErrors(cudaMemPrefetchAsync((const void *)weights_ptr, (size_t)((transformer->file_size+1) - sizeof(Config) / sizeof(float)), device));
+    // the matmuls read them as they are until pack_weights()
+    transformer->packed = row_major_weights(transformer);
+    transformer->backend->prefetch(weights_ptr, (size_t)(transformer->file_size - sizeof(Config)), transformer->backend->device);
     if (transformer->fd != -1) {close(transformer->fd);}
 }
 
-void build_transformer(Transformer *transformer, char *checkpoint_path, int device) {
-    // read in Config and the Weights from the checkpoint
-    read_checkpoint(checkpoint_path, transformer, device);
+void build_model(Model *model, char *checkpoint_path, const Backend *backend) {
+    // read in Config and the Weights from the checkpoint, onto backend
+    model->backend = backend;
+    read_checkpoint(checkpoint_path, model);
+    memset(&model->quant, 0, sizeof(QuantWeights));
+}
+
+void free_model(Model *model) {
+    // close the memory mappings, after every Transformer over the model is freed
+    if (model->packed.map != NULL) { munmap(model->packed.map, model->packed.map_bytes); }
+    if (model->quant.map != NULL) { munmap(model->quant.map, model->quant.map_bytes); }
+    model->backend->unmap(model->data, model->file_size);
+}
+
+void build_plan(Transformer *t); // with the kernels it points at, in the neural net blocks
+
+void build_transformer(Transformer *transformer, const Model *model, int max_batch, int max_seqs, int kv_blocks, int max_seq_len) {
+    // max_batch: tokens per forward, max_seqs: sequences decoding at once,
+    // kv_blocks: size of the kv cache pool, <= 0 gives every sequence room for max_seq_len positions,
+    // max_seq_len: caps the context below the one of the checkpoint, <= 0 keeps it
+    transformer->model = model;
+    transformer->backend = model->backend;
+    transformer->config = model->config;
+    if (max_seq_len > 0 && max_seq_len < transformer->config.max_seq_len) { transformer->config.max_seq_len = max_seq_len; }
+    transformer->profiler = NULL;
+    transformer->pipeline = NULL;
+    transformer->tp = NULL;
+    if (kv_blocks <= 0) {
+        kv_blocks = max_seqs * ((transformer->config.max_seq_len + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE);
+    }
     // allocate the RunState buffers
-    alloc_run_state(&transformer->state, transformer->config, device);
+    alloc_run_state(&transformer->state, transformer->config, max_batch, max_seqs, kv_blocks, transformer->backend);
+    // and compile the forward pass over them
+    build_plan(transformer);
 }
 
 void free_transformer(Transformer* t) {
-    // close the memory mapping
-    checkCudaErrors(cudaFree(t->data));
-    // free the RunState buffers
-    free_run_state(&t->state);
+    // free the RunState buffers, the model stays
+    free_run_state(&t->state, t->backend);
+    free(t->plan.ops);
+}
+
+// ----------------------------------------------------------------------------
+// profiler: per op timings of the forward pass and of the sampling, off unless
+// --profile is given. every op ends with a mark that charges it the time since the
+// previous mark, so an enabled profiler costs one clock read per op and a disabled
+// one a branch. the timings are kept per op and per layer along with the bytes and
+// flops each op touches, for the GB/s and GFLOP/s it achieves, and dumped at exit
+// as a summary on stderr and a folded stack file, e.g.
+//   ./main -m model.bin -i "Once upon a time" --profile prof.folded
+//   ./flamegraph.pl prof.folded > prof.svg
+
+typedef enum { OP_EMBED, OP_RMSNORM, OP_QKV, OP_ROPE, OP_ATTENTION, OP_WO, OP_RESIDUAL, OP_FFN_UP, OP_SWIGLU, OP_FFN_DOWN,
+               OP_CLASSIFIER, OP_LOGPROB, OP_SCHEDULE, OP_SAMPLE, N_PROF_OPS } ProfOp;
+
+static const char *prof_op_names[N_PROF_OPS] = { "embed", "rmsnorm", "qkv", "rope_kv", "attention", "wo", "residual",
+    "ffn_up", "swiglu", "ffn_down", "classifier", "logprob", "schedule", "sample" };
+
+typedef struct {
+    long ns;
+    long calls;
+    double bytes;   // weights and kv cache read, activations for the elementwise ops
+    double flops;
+} ProfStat;
+
+struct Profiler {
+    int n_layers;
+    ProfStat *stats;    // (n_layers + 1, N_PROF_OPS), the last row holds the ops outside the layers
+    long steps;
+    char *folded_path;  // where the folded stacks go
+};
+
+// a function marking ops opens with PROF_START, then every op ends with a PROF_OP
+#define PROF_START(prof) long prof_t0 = (prof) != NULL ? time_in_ns() : 0
+#define PROF_RESTART(prof) do { if ((prof) != NULL) { prof_t0 = time_in_ns(); } } while (0)
+#define PROF_OP(prof, layer, op, bytes, flops) \
+    do { if ((prof) != NULL) { prof_t0 = prof_mark((prof), (layer), (op), prof_t0, (bytes), (flops)); } } while (0)
+
+void build_profiler(Profiler *p, int n_layers, char *folded_path) {
+    p->n_layers = n_layers;
+    p->stats = (ProfStat *)calloc((size_t)(n_layers + 1) * N_PROF_OPS, sizeof(ProfStat));
+    p->steps = 0;
+    p->folded_path = folded_path;
+    if (!p->stats) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void free_profiler(Profiler *p) {
+    free(p->stats);
+}
+
+long prof_mark(Profiler *p, int layer, ProfOp op, long t0, double bytes, double flops) {
+    // charges op the time since t0 and returns the time of the mark, the start of the next op
+    long now = time_in_ns();
+    ProfStat *st = p->stats + (size_t)layer * N_PROF_OPS + op;
+    st->ns += now - t0;
+    st->calls++;
+    st->bytes += bytes;
+    st->flops += flops;
+    return now;
+}
+
+void profiler_report(Profiler *p) {
+    ProfStat total[N_PROF_OPS];
+    memset(total, 0, sizeof(total));
+    long all_ns = 0;
+    for (int l = 0; l <= p->n_layers; l++) {
+        for (int op = 0; op < N_PROF_OPS; op++) {
+            ProfStat *st = p->stats + (size_t)l * N_PROF_OPS + op;
+            total[op].ns += st->ns;
+            total[op].calls += st->calls;
+            total[op].bytes += st->bytes;
+            total[op].flops += st->flops;
+            all_ns += st->ns;
+        }
+    }
+    // per op type, bytes per ns is GB/s and flops per ns GFLOP/s
+    fprintf(stderr, "profile: %ld steps, %.3f ms\n", p->steps, all_ns / 1e6);
+    fprintf(stderr, "%-12s %12s %7s %10s %10s %9s %9s\n", "op", "ms", "%", "calls", "us/call", "GB/s", "GFLOP/s");
+    for (int op = 0; op < N_PROF_OPS; op++) {
+        ProfStat *st = &total[op];
+        if (st->calls == 0) { continue; }
+        double ns = st->ns > 0 ? (double)st->ns : 1.0;
+        fprintf(stderr, "%-12s %12.3f %6.2f%% %10ld %10.2f %9.2f %9.2f\n", prof_op_names[op], st->ns / 1e6,
+                all_ns > 0 ? 100.0 * st->ns / all_ns : 0.0, st->calls, st->ns / 1e3 / st->calls, st->bytes / ns, st->flops / ns);
+    }
+    // per layer, in ms, to spot the layers that stand out
+    fprintf(stderr, "%-6s", "layer");
+    for (int op = OP_RMSNORM; op <= OP_FFN_DOWN; op++) { fprintf(stderr, " %10s", prof_op_names[op]); }
+    fprintf(stderr, " %10s\n", "total");
+    for (int l = 0; l < p->n_layers; l++) {
+        ProfStat *row = p->stats + (size_t)l * N_PROF_OPS;
+        long layer_ns = 0;
+        fprintf(stderr, "%-6d", l);
+        for (int op = OP_RMSNORM; op <= OP_FFN_DOWN; op++) {
+            fprintf(stderr, " %10.3f", row[op].ns / 1e6);
+            layer_ns += row[op].ns;
+        }
+        fprintf(stderr, " %10.3f\n", layer_ns / 1e6);
+    }
+    // folded stacks, one line per frame path with its time in ns as the sample count
+    FILE *file = fopen(p->folded_path, "w");
+    if (!file) {
+        fprintf(stderr, "couldn't open %s\n", p->folded_path);
+        return;
+    }
+    for (int l = 0; l <= p->n_layers; l++) {
+        for (int op = 0; op < N_PROF_OPS; op++) {
+            ProfStat *st = p->stats + (size_t)l * N_PROF_OPS + op;
+            if (st->ns <= 0) { continue; }
+            if (op == OP_SCHEDULE || op == OP_SAMPLE) { fprintf(file, "step;%s %ld\n", prof_op_names[op], st->ns); }
+            else if (l == p->n_layers) { fprintf(file, "step;forward;%s %ld\n", prof_op_names[op], st->ns); }
+            else { fprintf(file, "step;forward;layer_%d;%s %ld\n", l, prof_op_names[op], st->ns); }
+        }
+    }
+    fclose(file);
+    fprintf(stderr, "profile: folded stacks written to %s\n", p->folded_path);
 }
 
 // ----------------------------------------------------------------------------
 // neural net blocks; the dynamics of the Transformer
 
-__global__ void reduce(float *partial_o, float *x) {
+__global__ void reduce(float *partial_o, float *x, int size) {
     // for simplicity, we use the First Add During Load from https://developer.download.nvidia.com/assets/cuda/files/reduction.pdf
     extern volatile __shared__ float sdata[];
 
     // each thread loads one element from global to shared mem
     unsigned int tid = threadIdx.x;
     unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
-    sdata[tid] = x[i];
+    sdata[tid] = i < size ? x[i] : 0.0f;
     __syncthreads();
 
     // do reduction in shared mem
@@ -461,6 +1337,7 @@ __global__ void reduce(float *partial_o, float *x) {
         if (tid % (2*s) == 0) {
             sdata[tid] += sdata[tid + s];
         }
+        __syncthreads();
     }
 
     // write to partial output
@@ -469,15 +1346,14 @@ __global__ void reduce(float *partial_o, float *x) {
     }
 }
 
-__global__ void rmsnorm_kernel(float *o, float *partial_sum, float *x, float *weight, int size) {
-    // for simplicity, we use the First Add During Load from https://developer.download.nvidia.com/assets/cuda/files/reduction.pdf
+__global__ void rmsnorm_kernel(float *partial_sum, float *x, int size) {
+    // first stage of the rmsnorm: per-block sum of squares, same scheme as reduce()
     extern volatile __shared__ float sdata[];
 
     // each thread loads one element from global to shared mem
     unsigned int tid = threadIdx.x;
     unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
-    sdata[tid] = x[i];
-    // __syncthreads();
+    sdata[tid] = i < size ? x[i] * x[i] : 0.0f;
     this_thread_block().sync();
 
     // do reduction in shared mem
@@ -485,164 +1361,5242 @@ __global__ void rmsnorm_kernel(float *o, float *partial_sum, float *x, float *we
         if (tid % (2*s) == 0) {
             sdata[tid] += sdata[tid + s];
         }
+        this_thread_block().sync();
     }
 
     // write to partial output
     if (tid == 0) {
         partial_sum[blockIdx.x] = sdata[0];
     }
+}
 
-    // wait for all thread blocks to finish
-    grid_group grid = this_grid();
-    grid.sync();
-    
-    // only let a single thread launch the final reduction of partial sums
-    float ss = 0.0f;
-    if (tid == 0 && blockIdx.x == 0) {
-        reduce<<< 1, BLOCKSIZE, BLOCKSIZE>>>(partial_sum, partial_sum);
-        partial_sum[0] = 1.0f / sqrtf(partial_sum[0] / size + 1e-5f);
-        // ss /= size;
-        // ss += 1e-5f;
-        // ss = 1.0f / sqrtf(ss);
-    }
-
-    // wait for all thread blocks to finish
-    grid.sync();
-
-    ss = partial_sum[0];
-
+__global__ void rmsnorm_scale_kernel(float *o, float *x, float *weight, float *partial_sum, int size) {
+    // partial_sum[0] holds the total sum of squares once the second reduce() has run
+    unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= size) { return; }
+    float ss = 1.0f / sqrtf(partial_sum[0] / size + 1e-5f);
     o[i] = weight[i] * (ss * x[i]);
 }
 
-void rmsnorm(float *o, float *x, float *partial_o, float *weight, int size, int device) {
-    if (device == cudaCpuDeviceId) {
-        // calculate sum of squares
-        float ss = 0.0f;
-        for (int j = 0; j < size; j++) {
-            ss += x[j] * x[j];
+__global__ void matmul_kernel(float *xout, float *x, float *w, int n, int d) {
+    // one thread per output row, blockIdx.y selects the token of the batch
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= d) { return; }
+    x += (size_t)blockIdx.y * n;
+    xout += (size_t)blockIdx.y * d;
+    float val = 0.0f;
+    for (int j = 0; j < n; j++) {
+        val += w[(size_t)i * n + j] * x[j];
+    }
+    xout[i] = val;
+}
+
+__global__ void logprob_kernel(float *out, float *partial, float *x, float *w, int *target, int n, int d) {
+    // one block per (vocab slice, row): every thread keeps a running max and sum of exponentials
+    // over its logits, then the block folds them in shared memory
+    extern __shared__ float smem[];
+    float *smax = smem;
+    float *ssum = smem + blockDim.x;
+    unsigned int tid = threadIdx.x;
+    int slice = blockIdx.x;
+    int b = blockIdx.y;
+    int start = (int)((size_t)d * slice / gridDim.x);
+    int end = (int)((size_t)d * (slice + 1) / gridDim.x);
+    x += (size_t)b * n;
+    float m = -INFINITY;
+    float sum = 0.0f;
+    for (int i = start + tid; i < end; i += blockDim.x) {
+        float val = 0.0f;
+        for (int j = 0; j < n; j++) {
+            val += w[(size_t)i * n + j] * x[j];
         }
-        ss /= size;
-        ss += 1e-5f;
-        ss = 1.0f / sqrtf(ss);
-        // normalize and scale
-        for (int j = 0; j < size; j++) {
-            o[j] = weight[j] * (ss * x[j]);
+        if (i == target[b]) { out[b] = val; }
+        if (val > m) { sum = sum * expf(m - val) + 1.0f; m = val; }
+        else { sum += expf(val - m); }
+    }
+    smax[tid] = m;
+    ssum[tid] = sum;
+    __syncthreads();
+    for (unsigned int s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (tid < s && smax[tid + s] != -INFINITY) {
+            float m2 = fmaxf(smax[tid], smax[tid + s]);
+            ssum[tid] = ssum[tid] * expf(smax[tid] - m2) + ssum[tid + s] * expf(smax[tid + s] - m2);
+            smax[tid] = m2;
         }
-    } else {
-        float ss = 0.0f;
-        const int GRIDSIZE = (int)ceil(size / BLOCKSIZE);
-        rmsnorm_kernel();
+        __syncthreads();
+    }
+    if (tid == 0) {
+        partial[((size_t)b * gridDim.x + slice) * 2] = smax[0];
+        partial[((size_t)b * gridDim.x + slice) * 2 + 1] = ssum[0];
+    }
+}
 
-        reduce<<< GRIDSIZE, BLOCKSIZE, BLOCKSIZE >>>(partial_o, x);
-        reduce<<< 1, BLOCKSIZE, BLOCKSIZE >>>(partial_o, partial_o);
-        ss = partial_o[0];  // demand paging
-        ss /= size;
-        ss += 1e-5f;
-        ss = 1.0f / sqrtf(ss);
-        // normalize and scale
+__global__ void residual_kernel(float *x, float *y, size_t n) {
+    size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < n) { x[i] += y[i]; }
+}
 
+__global__ void swiglu_kernel(float *hb, float *hb2, size_t n) {
+    size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < n) {
+        float val = hb[i];
+        hb[i] = val * (1.0f / (1.0f + expf(-val))) * hb2[i];
     }
 }
 
+// knobs of the CPU kernels, picked per host and model shape by autotune(). none of them
+// changes the order of any sum, the results are the same whatever they are set to (the
+// scalar panels up to where the compiler fuses multiply-adds, see matmul_panels)
+typedef struct {
+    int threads_decode;     // OpenMP threads for a single token, bandwidth bound. 0 = all
+    int threads_prefill;    // and for a batch of tokens, compute bound. 0 = all
+    int row_tile;           // rows of W per task of the matmul
+    int batch_tile;         // tokens of x per pass over a row tile, 0 = the whole batch
+    int generic;            // the generic matmul over the one for the model's sizes
+    int row_major;          // the row major matrices over their panels
+} KernelTuning;
 
-// ----------------------------------------------------------------------------
-// utilities: time
+// process wide, like the OpenMP thread pool it sizes
+static KernelTuning tuning = {0, 0, 1, 0, 0, 0};
 
-long time_in_ms() {
-    // return time in milliseconds, for benchmarking the model speed
-    struct timespec time;
-    clock_gettime(CLOCK_REALTIME, &time);
-    return time.tv_sec * 1000 + time.tv_nsec / 1000000;
+int max_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
 }
 
-float* forward(Transformer *transformer, int token, int pos, int device) {
-    // a few convenience variables
-    Config* p = &transformer->config;
-    TransformerWeights* w = &transformer->weights;
-    RunState* s = &transformer->state;
-    float *x = s->x;
-    int dim = p->dim;
-    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
-    int hidden_dim =  p->hidden_dim;
-    int head_size = dim / p->n_heads;
+int tuned_threads(int batch) {
+    // capped by the threads of the caller, a pipeline stage only has its share
+    int threads = batch == 1 ? tuning.threads_decode : tuning.threads_prefill;
+    return threads > 0 && threads < max_threads() ? threads : max_threads();
+}
 
-    // copy the token embedding into x
-    float* content_row = w->token_embedding_table + token * dim;
-    checkCudaErrors(cudaMemcpyAsync(x, content_row, dim*sizeof(*x), cudaMemcpyDefault));
-    
+// the CPU kernels are templates over two things known at compile time:
+// - SIMD picks the dot product. the scalar one sums in order, the reference every other
+//   backend is checked against, the SIMD one sums over vector lanes
+// - N, the length of the vectors they run over (dim, hidden_dim or head_size). for the model
+//   shapes we run, the loops get constant bounds the compiler fully unrolls, with the
+//   accumulators kept in registers. N = 0 is the generic kernel, which takes the length at run time
+// the order of the sums depends on SIMD alone, a shape kernel gives the same bits as the generic one
 
-     // forward all the layers
-    for(unsigned long long l = 0; l < p->n_layers; l++) {
-        // attention rmsnorm
-        rmsnorm(s->xb, x, s->partial_sum, w->rms_att_weight + l*dim, dim, device);
+template <int N> static inline float dot_scalar(const float *a, const float *b, int n) {
+    if (N > 0) { n = N; }
+    float val = 0.0f;
+    for (int j = 0; j < n; j++) {
+        val += a[j] * b[j];
     }
+    return val;
 }
 
-// ----------------------------------------------------------------------------
-// generation loop
-// ----------------------------------------------------------------------------
+template <int N> static inline float dot_simd(const float *a, const float *b, int n) {
+    if (N > 0) { n = N; }
+    int j = 0;
+    float val;
+#if defined(__AVX2__) && defined(__FMA__)
+    // two independent accumulators of 8 lanes, enough to keep the FMA units busy
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; j + 16 <= n; j += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + j), _mm256_loadu_ps(b + j), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + j + 8), _mm256_loadu_ps(b + j + 8), acc1);
+    }
+    for (; j + 8 <= n; j += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + j), _mm256_loadu_ps(b + j), acc0);
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    val = _mm_cvtss_f32(s);
+#else
+    // eight independent sums, which the compiler maps onto whatever vector lanes it has
+    float acc[8] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    for (; j + 8 <= n; j += 8) {
+        for (int k = 0; k < 8; k++) { acc[k] += a[j + k] * b[j + k]; }
+    }
+    val = ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+#endif
+    for (; j < n; j++) {
+        val += a[j] * b[j];
+    }
+    return val;
+}
 
-void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, int device) {
-    char *empty_prompt = (char *)"";
-    if (prompt == NULL) {prompt = empty_prompt;}
+template <int N, bool SIMD> static inline float dot(const float *a, const float *b, int n) {
+    return SIMD ? dot_simd<N>(a, b, n) : dot_scalar<N>(a, b, n);
+}
 
-    // encode the (string) prompt into tokens sequence
-    int num_prompt_tokens = 0;
-    int *prompt_tokens = NULL;
-    checkCudaErrors(cudaMallocManaged((void **)&prompt_tokens, sizeof(int) * strlen(prompt)+3)); // +3 for '\0', ?BOS, ?EOS
-    encode(tokenizer, prompt, 1, 0, prompt_tokens, &num_prompt_tokens);
-    if (num_prompt_tokens < 1) {
-        fprintf(stderr, "something is wrong, expected at least 1 prompt token\n");
-        exit(EXIT_FAILURE);
+template <int N, bool SIMD> void rmsnorm_cpu(float *o, float *x, float *partial_o, float *weight, int size) {
+    if (N > 0) { size = N; }
+    // calculate sum of squares
+    float ss = dot<N, SIMD>(x, x, size);
+    ss /= size;
+    ss += 1e-5f;
+    ss = 1.0f / sqrtf(ss);
+    // normalize and scale
+    for (int j = 0; j < size; j++) {
+        o[j] = weight[j] * (ss * x[j]);
     }
+}
 
-    // start the main loop
-    // start the main loop
-    long start = 0;  // used to time our code, only initialized after first iteration
-    int next;        // will store the next token in the sequence
-    int token = prompt_tokens[0]; // kick off with the first token in the prompt
-    int pos = 0;     // position in the sequence
-    while (pos < steps) {
+void rmsnorm_gpu(float *o, float *x, float *partial_o, float *weight, int size) {
+    // two stage reduction: GRIDSIZE partial sums, then a single block folds them
+    // (partial_o holds dim floats, so GRIDSIZE <= BLOCKSIZE for any dim up to 65536)
+    const int GRIDSIZE = (size + BLOCKSIZE - 1) / BLOCKSIZE;
+    rmsnorm_kernel<<< GRIDSIZE, BLOCKSIZE, BLOCKSIZE * sizeof(float) >>>(partial_o, x, size);
+    reduce<<< 1, BLOCKSIZE, BLOCKSIZE * sizeof(float) >>>(partial_o, partial_o, GRIDSIZE);
+    rmsnorm_scale_kernel<<< GRIDSIZE, BLOCKSIZE >>>(o, x, weight, partial_o, size);
+    checkCudaErrors(cudaDeviceSynchronize());
+}
+
+template <int N, bool SIMD> void matmul_cpu(float *xout, float *x, float *w, int n, int d, int batch) {
+    // W (d,n) @ x (batch,n) -> xout (batch,d)
+    if (N > 0) { n = N; }
+    // by far the most amount of time is spent inside this little function
+    // every row of W is loaded once and reused for the tokens of a batch tile, and every
+    // batch tile of x is reused for the rows of a row tile
+    int row_tile = tuning.row_tile;
+    int batch_tile = tuning.batch_tile > 0 && tuning.batch_tile < batch ? tuning.batch_tile : batch;
+    int n_tiles = (d + row_tile - 1) / row_tile;
+    int t;
+    #pragma omp parallel for private(t) num_threads(tuned_threads(batch))
+    for (t = 0; t < n_tiles; t++) {
+        int i_end = (t + 1) * row_tile < d ? (t + 1) * row_tile : d;
+        for (int b0 = 0; b0 < batch; b0 += batch_tile) {
+            int b_end = b0 + batch_tile < batch ? b0 + batch_tile : batch;
+            for (int i = t * row_tile; i < i_end; i++) {
+                const float *wi = w + (size_t)i * n;
+                for (int b = b0; b < b_end; b++) {
+                    xout[(size_t)b * d + i] = dot<N, SIMD>(wi, x + (size_t)b * n, n);
+                }
+            }
+        }
+    }
+}
+
+// the same matmul over W packed into panels by pack_panels(): PANEL_ROWS rows interleaved in
+// blocks of PANEL_COLS columns, so a pass over the weights reads one panel front to back for
+// PANEL_ROWS rows at once, each x block loaded once for all of them, and with AVX2 a batch
+// goes two tokens at a time, each weight load feeding both. PANEL_COLS is the 2 x 8 lanes of
+// dot_simd and every row sums in the order of dot<N, SIMD>, whatever the batch: the simd bits
+// are those of matmul_cpu, the scalar ones up to where the compiler fuses the multiply-adds
+
+#define PANEL_ROWS 4
+#define PANEL_COLS 16
+
+#if defined(__AVX2__) && defined(__FMA__)
+static inline float panel_sum(__m256 acc0, __m256 acc1, const float *w, const float *x, int j, int n) {
+    // the lanes of a row folded as in dot_simd, plus its columns j..n left over. the fused
+    // multiply-add is spelled out, for the same bits on every path
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    float val = _mm_cvtss_f32(s);
+    for (; j < n; j++) { val = fmaf(w[j], x[j], val); }
+    return val;
+}
+
+template <int N> static inline void panel_dot_pair(float *out_a, float *out_b, const float *panel, const float *xa, const float *xb, int n) {
+    // the rows of a panel against two tokens, two rows at a time to keep the 2 x 2 x 2
+    // accumulators in registers
+    if (N > 0) { n = N; }
+    const int nb = n / PANEL_COLS;
+    const int tn = n - nb * PANEL_COLS;
+    const float *tail = panel + (size_t)nb * PANEL_COLS * PANEL_ROWS;
+    for (int r0 = 0; r0 < PANEL_ROWS; r0 += 2) {
+        __m256 a0[2], a1[2], b0[2], b1[2];
+        for (int r = 0; r < 2; r++) { a0[r] = a1[r] = b0[r] = b1[r] = _mm256_setzero_ps(); }
+        for (int blk = 0; blk < nb; blk++) {
+            const float *p = panel + ((size_t)blk * PANEL_ROWS + r0) * PANEL_COLS;
+            __m256 xa0 = _mm256_loadu_ps(xa + blk * PANEL_COLS), xa1 = _mm256_loadu_ps(xa + blk * PANEL_COLS + 8);
+            __m256 xb0 = _mm256_loadu_ps(xb + blk * PANEL_COLS), xb1 = _mm256_loadu_ps(xb + blk * PANEL_COLS + 8);
+            for (int r = 0; r < 2; r++) {
+                __m256 w0 = _mm256_loadu_ps(p + r * PANEL_COLS), w1 = _mm256_loadu_ps(p + r * PANEL_COLS + 8);
+                a0[r] = _mm256_fmadd_ps(w0, xa0, a0[r]);
+                a1[r] = _mm256_fmadd_ps(w1, xa1, a1[r]);
+                b0[r] = _mm256_fmadd_ps(w0, xb0, b0[r]);
+                b1[r] = _mm256_fmadd_ps(w1, xb1, b1[r]);
+            }
+        }
+        int j = 0;
+        if (tn >= 8) {
+            __m256 xta = _mm256_loadu_ps(xa + nb * PANEL_COLS), xtb = _mm256_loadu_ps(xb + nb * PANEL_COLS);
+            for (int r = 0; r < 2; r++) {
+                __m256 w0 = _mm256_loadu_ps(tail + (r0 + r) * tn);
+                a0[r] = _mm256_fmadd_ps(w0, xta, a0[r]);
+                b0[r] = _mm256_fmadd_ps(w0, xtb, b0[r]);
+            }
+            j = 8;
+        }
+        for (int r = 0; r < 2; r++) {
+            const float *t = tail + (r0 + r) * tn;
+            out_a[r0 + r] = panel_sum(a0[r], a1[r], t, xa + nb * PANEL_COLS, j, tn);
+            out_b[r0 + r] = panel_sum(b0[r], b1[r], t, xb + nb * PANEL_COLS, j, tn);
+        }
+    }
+}
+#endif
+
+template <int N, bool SIMD> static inline void panel_dot(float *out, const float *panel, const float *x, int n) {
+    // the PANEL_ROWS rows of a panel against x, into out
+    if (N > 0) { n = N; }
+    const int nb = n / PANEL_COLS;
+    const int tn = n - nb * PANEL_COLS; // the columns after the last block, row after row
+    const float *tail = panel + (size_t)nb * PANEL_COLS * PANEL_ROWS;
+    const float *xt = x + nb * PANEL_COLS;
+    if (!SIMD) {
+        // one sum per row in column order, the rows of a block one after the other. their
+        // sums are independent, the core overlaps them
+        float val[PANEL_ROWS] = {0.0f};
+        for (int blk = 0; blk < nb; blk++) {
+            const float *p = panel + (size_t)blk * PANEL_COLS * PANEL_ROWS;
+            const float *xb = x + blk * PANEL_COLS;
+            for (int r = 0; r < PANEL_ROWS; r++) {
+                for (int k = 0; k < PANEL_COLS; k++) { val[r] += p[r * PANEL_COLS + k] * xb[k]; }
+            }
+        }
+        for (int r = 0; r < PANEL_ROWS; r++) {
+            for (int k = 0; k < tn; k++) { val[r] += tail[r * tn + k] * xt[k]; }
+            out[r] = val[r];
+        }
+        return;
+    }
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc0[PANEL_ROWS], acc1[PANEL_ROWS];
+    for (int r = 0; r < PANEL_ROWS; r++) { acc0[r] = _mm256_setzero_ps(); acc1[r] = _mm256_setzero_ps(); }
+    for (int blk = 0; blk < nb; blk++) {
+        const float *p = panel + (size_t)blk * PANEL_COLS * PANEL_ROWS;
+        __m256 x0 = _mm256_loadu_ps(x + blk * PANEL_COLS);
+        __m256 x1 = _mm256_loadu_ps(x + blk * PANEL_COLS + 8);
+        for (int r = 0; r < PANEL_ROWS; r++) {
+            acc0[r] = _mm256_fmadd_ps(_mm256_loadu_ps(p + r * PANEL_COLS), x0, acc0[r]);
+            acc1[r] = _mm256_fmadd_ps(_mm256_loadu_ps(p + r * PANEL_COLS + 8), x1, acc1[r]);
+        }
+    }
+    int j = 0; // into the tail, past what went into the lanes
+    if (tn >= 8) {
+        __m256 xv = _mm256_loadu_ps(xt);
+        for (int r = 0; r < PANEL_ROWS; r++) { acc0[r] = _mm256_fmadd_ps(_mm256_loadu_ps(tail + r * tn), xv, acc0[r]); }
+        j = 8;
+    }
+    for (int r = 0; r < PANEL_ROWS; r++) { out[r] = panel_sum(acc0[r], acc1[r], tail + r * tn, xt, j, tn); }
+#else
+    float acc[PANEL_ROWS][8] = {{0.0f}};
+    for (int blk = 0; blk < nb; blk++) {
+        const float *p = panel + (size_t)blk * PANEL_COLS * PANEL_ROWS;
+        const float *xb = x + blk * PANEL_COLS;
+        for (int r = 0; r < PANEL_ROWS; r++) {
+            for (int k = 0; k < 8; k++) { acc[r][k] += p[r * PANEL_COLS + k] * xb[k]; }
+            for (int k = 0; k < 8; k++) { acc[r][k] += p[r * PANEL_COLS + 8 + k] * xb[8 + k]; }
+        }
+    }
+    int j = 0;
+    if (tn >= 8) {
+        for (int r = 0; r < PANEL_ROWS; r++) {
+            for (int k = 0; k < 8; k++) { acc[r][k] += tail[r * tn + k] * xt[k]; }
+        }
+        j = 8;
+    }
+    for (int r = 0; r < PANEL_ROWS; r++) {
+        const float *a = acc[r];
+        float val = ((a[0] + a[1]) + (a[2] + a[3])) + ((a[4] + a[5]) + (a[6] + a[7]));
+        for (int k = j; k < tn; k++) { val += tail[r * tn + k] * xt[k]; }
+        out[r] = val;
+    }
+#endif
+}
+
+template <int N, bool SIMD> void matmul_panels(float *xout, float *x, float *w, int n, int d, int batch) {
+    // W (d,n) in panels @ x (batch,n) -> xout (batch,d), tiled like matmul_cpu with the row
+    // tile rounded to whole panels
+    if (N > 0) { n = N; }
+    int panel_tile = tuning.row_tile > PANEL_ROWS ? tuning.row_tile / PANEL_ROWS : 1;
+    int batch_tile = tuning.batch_tile > 0 && tuning.batch_tile < batch ? tuning.batch_tile : batch;
+    int n_panels = (d + PANEL_ROWS - 1) / PANEL_ROWS;
+    int n_tiles = (n_panels + panel_tile - 1) / panel_tile;
+    int t;
+    #pragma omp parallel for private(t) num_threads(tuned_threads(batch))
+    for (t = 0; t < n_tiles; t++) {
+        int p_end = (t + 1) * panel_tile < n_panels ? (t + 1) * panel_tile : n_panels;
+        for (int b0 = 0; b0 < batch; b0 += batch_tile) {
+            int b_end = b0 + batch_tile < batch ? b0 + batch_tile : batch;
+            for (int p = t * panel_tile; p < p_end; p++) {
+                const float *wp = w + (size_t)p * PANEL_ROWS * n;
+                int rows = d - p * PANEL_ROWS < PANEL_ROWS ? d - p * PANEL_ROWS : PANEL_ROWS;
+                float out[2][PANEL_ROWS];
+                int b = b0;
+#if defined(__AVX2__) && defined(__FMA__)
+                for (; SIMD && b + 2 <= b_end; b += 2) {
+                    panel_dot_pair<N>(out[0], out[1], wp, x + (size_t)b * n, x + (size_t)(b + 1) * n, n);
+                    for (int r = 0; r < rows; r++) {
+                        xout[(size_t)b * d + p * PANEL_ROWS + r] = out[0][r];
+                        xout[(size_t)(b + 1) * d + p * PANEL_ROWS + r] = out[1][r];
+                    }
+                }
+#endif
+                for (; b < b_end; b++) {
+                    panel_dot<N, SIMD>(out[0], wp, x + (size_t)b * n, n);
+                    for (int r = 0; r < rows; r++) { xout[(size_t)b * d + p * PANEL_ROWS + r] = out[0][r]; }
+                }
+            }
+        }
+    }
+}
+
+size_t panel_floats(int n, int d, int rows) {
+    // floats of a (d,n) matrix in panels of rows rows, the last one padded. rows 0 is row major
+    return rows > 0 ? (size_t)((d + rows - 1) / rows) * rows * n : (size_t)d * n;
+}
+
+// W8A8: the matmuls over the int8 weights of quantize_weights(), their input quantized per
+// row (token) right before by quantize_rows(), to int8 over its absolute max. the products
+// are summed in int32, and the epilogue turns a sum back into a float with the scales of its
+// row of W and of its token. so a matmul streams a quarter of the bytes of fp32 weights, and
+// with VNNI (vpdpbusd: 4 multiply-adds of 8 bit numbers into every 32 bit lane) does 4 times
+// the work of an fp32 FMA per instruction, which is what a batch of prefill is bound by.
+// vpdpbusd multiplies unsigned bytes by signed ones: the activations are kept offset by 128,
+// and the epilogue takes 128 times the sum of the row of W back off. the int32 sums are exact
+// in any order, so the kernels below (VNNI on 512 or 256 bits, AVX2, scalar) give the same bits
+
+#define Q8_ROWS 4       // rows of W per block of the kernel
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+#define Q8_TOKENS 4     // and tokens, their accumulators fill 16 of the 32 registers
+#else
+#define Q8_TOKENS 2
+#endif
+
+void quantize_rows(uint8_t *xq, float *scale, const float *x, int n, int batch) {
+    // every row of x (batch,n) to int8 over its absolute max, into xq offset by 128
+    int b;
+    #pragma omp parallel for private(b) num_threads(tuned_threads(batch)) if (batch > 1)
+    for (b = 0; b < batch; b++) {
+        const float *xb = x + (size_t)b * n;
+        uint8_t *q = xq + (size_t)b * n;
+        float max_val = 0.0f;
+        int j = 0;
+#if defined(__AVX2__)
+        // the same max and the same rounding (to nearest even) as the loops below
+        __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+        __m256 m = _mm256_setzero_ps();
+        for (; j + 8 <= n; j += 8) { m = _mm256_max_ps(m, _mm256_and_ps(_mm256_loadu_ps(xb + j), abs_mask)); }
+        float lanes[8];
+        _mm256_storeu_ps(lanes, m);
+        for (int k = 0; k < 8; k++) { max_val = fmaxf(max_val, lanes[k]); }
+#endif
+        for (; j < n; j++) { max_val = fmaxf(max_val, fabsf(xb[j])); }
+        float inv = max_val > 0.0f ? 127.0f / max_val : 0.0f;
+        j = 0;
+#if defined(__AVX2__)
+        __m256 inv8 = _mm256_set1_ps(inv);
+        __m256i offset = _mm256_set1_epi32(128);
+        for (; j + 8 <= n; j += 8) {
+            __m256i v = _mm256_add_epi32(_mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(xb + j), inv8)), offset);
+            __m128i v16 = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+            _mm_storel_epi64((__m128i *)(q + j), _mm_packus_epi16(v16, v16));
+        }
+#endif
+        for (; j < n; j++) { q[j] = (uint8_t)(128 + (int)lrintf(xb[j] * inv)); }
+        scale[b] = max_val / 127.0f;
+    }
+}
+
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+static inline __m512i hsum16_epi32(const __m512i *v) {
+    // element i the sum of v[i]: pairs of them added at every step of a transpose, 45
+    // instructions for the 16 of them where a reduction each takes 8
+    __m512i s[8], u[4], t[2];
+    for (int i = 0; i < 8; i++) {
+        s[i] = _mm512_add_epi32(_mm512_unpacklo_epi32(v[2 * i], v[2 * i + 1]), _mm512_unpackhi_epi32(v[2 * i], v[2 * i + 1]));
+    }
+    for (int i = 0; i < 4; i++) {
+        u[i] = _mm512_add_epi32(_mm512_unpacklo_epi64(s[2 * i], s[2 * i + 1]), _mm512_unpackhi_epi64(s[2 * i], s[2 * i + 1]));
+    }
+    for (int i = 0; i < 2; i++) {
+        t[i] = _mm512_add_epi32(_mm512_shuffle_i32x4(u[2 * i], u[2 * i + 1], 0x44), _mm512_shuffle_i32x4(u[2 * i], u[2 * i + 1], 0xee));
+    }
+    return _mm512_add_epi32(_mm512_shuffle_i32x4(t[0], t[1], 0x88), _mm512_shuffle_i32x4(t[0], t[1], 0xdd));
+}
+
+static inline void q8_tile_512(float *xout, int d, const int8_t *const *w, const uint8_t *const *x, int n,
+                               const int *sum, const float *scale, const float *xscale) {
+    // a whole block of 4 rows and 4 tokens into xout (the first of them at xout), its epilogue
+    // in vectors too: the sums come out of hsum16_epi32 a token to a 128 bit lane
+    __m512i a[4][4];
+    for (int t = 0; t < 4; t++) {
+        for (int r = 0; r < 4; r++) { a[t][r] = _mm512_setzero_si512(); }
+    }
+    for (int j = 0; j < n; j += 64) {
+        __mmask64 m = n - j >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (n - j)) - 1;
+        __m512i wv[4];
+        for (int r = 0; r < 4; r++) { wv[r] = _mm512_maskz_loadu_epi8(m, w[r] + j); }
+        for (int t = 0; t < 4; t++) {
+            __m512i xv = _mm512_maskz_loadu_epi8(m, x[t] + j);
+            for (int r = 0; r < 4; r++) { a[t][r] = _mm512_dpbusd_epi32(a[t][r], xv, wv[r]); }
+        }
+    }
+    __m512i sums = hsum16_epi32(&a[0][0]);
+    __m512i row_sum = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)sum));
+    __m512 row_scale = _mm512_broadcast_f32x4(_mm_loadu_ps(scale));
+    __m512 token_scale = _mm512_permutexvar_ps(_mm512_set_epi32(3, 3, 3, 3, 2, 2, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0),
+                                               _mm512_castps128_ps512(_mm_loadu_ps(xscale)));
+    __m512 out = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(sums, _mm512_slli_epi32(row_sum, 7))),
+                               _mm512_mul_ps(row_scale, token_scale));
+    _mm_storeu_ps(xout, _mm512_castps512_ps128(out));
+    _mm_storeu_ps(xout + d, _mm512_extractf32x4_ps(out, 1));
+    _mm_storeu_ps(xout + 2 * (size_t)d, _mm512_extractf32x4_ps(out, 2));
+    _mm_storeu_ps(xout + 3 * (size_t)d, _mm512_extractf32x4_ps(out, 3));
+}
+#endif
+
+#if defined(__AVX2__) && !defined(__AVX512VNNI__)
+static inline int hsum_epi32(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+#endif
+
+template <bool SIMD, int T> static inline void q8_block(int acc[Q8_ROWS][Q8_TOKENS], const int8_t *const *w, const uint8_t *const *x, int n) {
+    // the Q8_ROWS rows w against the T rows x, every load feeding a whole row or column of acc
+    int j = 0;
+    for (int r = 0; r < Q8_ROWS; r++) {
+        for (int t = 0; t < T; t++) { acc[r][t] = 0; }
+    }
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    if (SIMD) {
+        __m512i a[Q8_ROWS][T];
+        for (int r = 0; r < Q8_ROWS; r++) {
+            for (int t = 0; t < T; t++) { a[r][t] = _mm512_setzero_si512(); }
+        }
+        // the last columns in a masked load, zeros past n add nothing
+        for (; j < n; j += 64) {
+            __mmask64 m = n - j >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (n - j)) - 1;
+            __m512i xv[T];
+            for (int t = 0; t < T; t++) { xv[t] = _mm512_maskz_loadu_epi8(m, x[t] + j); }
+            for (int r = 0; r < Q8_ROWS; r++) {
+                __m512i wv = _mm512_maskz_loadu_epi8(m, w[r] + j);
+                for (int t = 0; t < T; t++) { a[r][t] = _mm512_dpbusd_epi32(a[r][t], xv[t], wv); }
+            }
+        }
+        for (int r = 0; r < Q8_ROWS; r++) {
+            for (int t = 0; t < T; t++) { acc[r][t] = _mm512_reduce_add_epi32(a[r][t]); }
+        }
+    }
+#elif defined(__AVX2__)
+    if (SIMD) {
+        __m256i a[Q8_ROWS][T];
+        for (int r = 0; r < Q8_ROWS; r++) {
+            for (int t = 0; t < T; t++) { a[r][t] = _mm256_setzero_si256(); }
+        }
+#if defined(__AVXVNNI__)
+        for (; j + 32 <= n; j += 32) {
+            __m256i xv[T];
+            for (int t = 0; t < T; t++) { xv[t] = _mm256_loadu_si256((const __m256i *)(x[t] + j)); }
+            for (int r = 0; r < Q8_ROWS; r++) {
+                __m256i wv = _mm256_loadu_si256((const __m256i *)(w[r] + j));
+                for (int t = 0; t < T; t++) { a[r][t] = _mm256_dpbusd_avx_epi32(a[r][t], xv[t], wv); }
+            }
+        }
+#else
+        // no VNNI: both widened to 16 bits, then pairs multiplied and added into 32 bits
+        for (; j + 16 <= n; j += 16) {
+            __m256i xv[T];
+            for (int t = 0; t < T; t++) { xv[t] = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(x[t] + j))); }
+            for (int r = 0; r < Q8_ROWS; r++) {
+                __m256i wv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(w[r] + j)));
+                for (int t = 0; t < T; t++) { a[r][t] = _mm256_add_epi32(a[r][t], _mm256_madd_epi16(xv[t], wv)); }
+            }
+        }
+#endif
+        for (int r = 0; r < Q8_ROWS; r++) {
+            for (int t = 0; t < T; t++) { acc[r][t] = hsum_epi32(a[r][t]); }
+        }
+    }
+#endif
+    for (; j < n; j++) {
+        for (int r = 0; r < Q8_ROWS; r++) {
+            for (int t = 0; t < T; t++) { acc[r][t] += (int)x[t][j] * w[r][j]; }
+        }
+    }
+}
+
+template <bool SIMD> void matmul_q8(float *xout, const uint8_t *xq, const float *xscale, const QuantMatrix *w, int n, int d, int batch) {
+    // W (d,n) in int8 @ xq (batch,n) -> xout (batch,d), tiled like matmul_cpu with the row tile
+    // rounded to whole blocks. a block at the edge of a tile repeats its last row, the tokens
+    // short of a whole block go one at a time
+    int row_tile = (tuning.row_tile + Q8_ROWS - 1) / Q8_ROWS * Q8_ROWS;
+    int batch_tile = tuning.batch_tile > 0 && tuning.batch_tile < batch ? tuning.batch_tile : batch;
+    int n_tiles = (d + row_tile - 1) / row_tile;
+    int t;
+    #pragma omp parallel for private(t) num_threads(tuned_threads(batch))
+    for (t = 0; t < n_tiles; t++) {
+        int i_end = (t + 1) * row_tile < d ? (t + 1) * row_tile : d;
+        for (int b0 = 0; b0 < batch; b0 += batch_tile) {
+            int b_end = b0 + batch_tile < batch ? b0 + batch_tile : batch;
+            for (int i = t * row_tile; i < i_end; i += Q8_ROWS) {
+                const int8_t *wr[Q8_ROWS];
+                for (int r = 0; r < Q8_ROWS; r++) { wr[r] = w->w + (size_t)(i + r < i_end ? i + r : i_end - 1) * n; }
+                for (int b = b0; b < b_end;) {
+                    int tokens = b + Q8_TOKENS <= b_end ? Q8_TOKENS : 1;
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+                    if (SIMD && tokens == Q8_TOKENS && i + Q8_ROWS <= i_end) {
+                        const uint8_t *xr[Q8_TOKENS] = {xq + (size_t)b * n, xq + (size_t)(b + 1) * n, xq + (size_t)(b + 2) * n, xq + (size_t)(b + 3) * n};
+                        q8_tile_512(xout + (size_t)b * d + i, d, wr, xr, n, w->sum + i, w->scale + i, xscale + b);
+                        b += tokens;
+                        continue;
+                    }
+#endif
+                    const uint8_t *xr[Q8_TOKENS];
+                    for (int k = 0; k < tokens; k++) { xr[k] = xq + (size_t)(b + k) * n; }
+                    int acc[Q8_ROWS][Q8_TOKENS];
+                    if (tokens == Q8_TOKENS) { q8_block<SIMD, Q8_TOKENS>(acc, wr, xr, n); }
+                    else { q8_block<SIMD, 1>(acc, wr, xr, n); }
+                    // the epilogue: back to floats, with the offset of the activations taken off
+                    for (int r = 0; r < Q8_ROWS && i + r < i_end; r++) {
+                        for (int k = 0; k < tokens; k++) {
+                            int sum = acc[r][k] - 128 * w->sum[i + r];
+                            xout[(size_t)(b + k) * d + i + r] = (float)sum * (w->scale[i + r] * xscale[b + k]);
+                        }
+                    }
+                    b += tokens;
+                }
+            }
+        }
+    }
+}
+
+void matmul_gpu(float *xout, float *x, float *w, int n, int d, int batch) {
+    dim3 grid((d + BLOCKSIZE - 1) / BLOCKSIZE, batch);
+    matmul_kernel<<< grid, BLOCKSIZE >>>(xout, x, w, n, d);
+    checkCudaErrors(cudaDeviceSynchronize());
+}
+
+// log_softmax(W (d,n) @ x (batch,n)) at one target token per row, into out (batch,). the
+// classifier and the log-softmax are fused: the logits are never written, each vocab slice
+// keeps a running max and sum of exponentials per row and the slices are merged at the end
+
+void logprob_merge(float *out, float *partial, int batch) {
+    // merge the slices: log p(target) = logit - (max + log(sum of exp(logit - max)))
+    for (int b = 0; b < batch; b++) {
+        const float *p = partial + (size_t)b * LOGPROB_SLICES * 2;
+        float max_val = -INFINITY;
+        for (int i = 0; i < LOGPROB_SLICES; i++) { if (p[2 * i] > max_val) { max_val = p[2 * i]; } }
+        float sum = 0.0f;
+        for (int i = 0; i < LOGPROB_SLICES; i++) { if (p[2 * i] != -INFINITY) { sum += p[2 * i + 1] * expf(p[2 * i] - max_val); } }
+        out[b] -= max_val + logf(sum);
+    }
+}
+
+template <int N, bool SIMD> void logprob_cpu(float *out, float *partial, float *x, float *w, int *target, int n, int d, int batch) {
+    if (N > 0) { n = N; }
+    int slice;
+    #pragma omp parallel for private(slice) num_threads(tuned_threads(batch))
+    for (slice = 0; slice < LOGPROB_SLICES; slice++) {
+        int start = (int)((size_t)d * slice / LOGPROB_SLICES);
+        int end = (int)((size_t)d * (slice + 1) / LOGPROB_SLICES);
+        for (int b = 0; b < batch; b++) {
+            partial[((size_t)b * LOGPROB_SLICES + slice) * 2] = -INFINITY;
+            partial[((size_t)b * LOGPROB_SLICES + slice) * 2 + 1] = 0.0f;
+        }
+        // as in matmul, every row of W is loaded once for all the rows of the batch
+        for (int i = start; i < end; i++) {
+            const float *wi = w + (size_t)i * n;
+            for (int b = 0; b < batch; b++) {
+                float val = dot<N, SIMD>(wi, x + (size_t)b * n, n);
+                if (i == target[b]) { out[b] = val; }
+                float *p = partial + ((size_t)b * LOGPROB_SLICES + slice) * 2;
+                if (val > p[0]) { p[1] = p[1] * expf(p[0] - val) + 1.0f; p[0] = val; }
+                else { p[1] += expf(val - p[0]); }
+            }
+        }
+    }
+    logprob_merge(out, partial, batch);
+}
+
+void logprob_gpu(float *out, float *partial, float *x, float *w, int *target, int n, int d, int batch) {
+    dim3 grid(LOGPROB_SLICES, batch);
+    logprob_kernel<<< grid, BLOCKSIZE, 2 * BLOCKSIZE * sizeof(float) >>>(out, partial, x, w, target, n, d);
+    checkCudaErrors(cudaDeviceSynchronize());
+    logprob_merge(out, partial, batch);
+}
+
+void rope(float *q, float *k, int pos, int dim, int kv_dim, int head_size) {
+    // RoPE relative positional encoding: complex-valued rotate q and k in each head
+    for (int i = 0; i < dim; i+=2) {
+        int head_dim = i % head_size;
+        float freq = 1.0f / powf(10000.0f, head_dim / (float)head_size);
+        float val = pos * freq;
+        float fcr = cosf(val);
+        float fci = sinf(val);
+        int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
+        for (int v = 0; v < rotn; v++) {
+            float* vec = v == 0 ? q : k; // the vector to rotate (query or key)
+            float v0 = vec[i];
+            float v1 = vec[i+1];
+            vec[i]   = v0 * fcr - v1 * fci;
+            vec[i+1] = v0 * fci + v1 * fcr;
+        }
+    }
+}
+
+template <int N, bool SIMD> void attention_cpu(float *out, float *q_all, KVCache *kv, Batch *batch, size_t loff, int n_heads, int kv_mul, int head_size) {
+    // every token of the batch attends over the positions of its sequence up to its own,
+    // through the block table, at layer offset loff. q_all and out are (n_tokens, dim). N is the head_size
+    if (N > 0) { head_size = N; }
+    int dim = n_heads * head_size;
+    int kv_dim = kv->kv_dim; // of the cache, the heads here can be a slice of it
+    int bh;
+    #pragma omp parallel for private(bh) num_threads(tuned_threads(batch->n_tokens))
+    for (bh = 0; bh < batch->n_tokens * n_heads; bh++) {
+        int b = bh / n_heads;
+        int h = bh % n_heads;
+        int pos = batch->pos[b];
+        int *blocks = batch->blocks[b];
+        // get the query vector for this head
+        float* q = q_all + (size_t)b * dim + h * head_size;
+        size_t hoff = loff + (h / kv_mul) * head_size;
+        // weighted sum of the values, store back into out. the softmax is computed
+        // online (running max and normalizer) so no per-position score buffer is needed
+        float* xb = out + (size_t)b * dim + h * head_size;
+        memset(xb, 0, head_size * sizeof(float));
+        float max_score = -INFINITY;
+        float sum = 0.0f;
+        // iterate over all timesteps, including the current one
+        for (int t = 0; t <= pos; t++) {
+            size_t off = blocks[t / KV_BLOCK_SIZE] * kv->block_floats + hoff + (t % KV_BLOCK_SIZE) * kv_dim;
+            // calculate the attention score as the dot product of q and k
+            float score = dot<N, SIMD>(q, kv->key_pool + off, head_size);
+            score /= sqrtf(head_size);
+            if (score > max_score) {
+                // rescale what has been accumulated so far to the new max
+                float scale = expf(max_score - score);
+                sum *= scale;
+                for (int i = 0; i < head_size; i++) { xb[i] *= scale; }
+                max_score = score;
+            }
+            // accumulate the weighted value into xb
+            float a = expf(score - max_score);
+            sum += a;
+            float* v = kv->value_pool + off;
+            for (int i = 0; i < head_size; i++) {
+                xb[i] += a * v[i];
+            }
+        }
+        for (int i = 0; i < head_size; i++) { xb[i] /= sum; }
+    }
+}
+
+void residual_cpu(float *x, float *y, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        x[i] += y[i];
+    }
+}
+
+void residual_gpu(float *x, float *y, size_t n) {
+    residual_kernel<<< (n + BLOCKSIZE - 1) / BLOCKSIZE, BLOCKSIZE >>>(x, y, n);
+    checkCudaErrors(cudaDeviceSynchronize());
+}
+
+void swiglu_cpu(float *hb, float *hb2, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        float val = hb[i];
+        // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
+        val *= (1.0f / (1.0f + expf(-val)));
+        // elementwise multiply with w3(x)
+        val *= hb2[i];
+        hb[i] = val;
+    }
+}
+
+void swiglu_gpu(float *hb, float *hb2, size_t n) {
+    swiglu_kernel<<< (n + BLOCKSIZE - 1) / BLOCKSIZE, BLOCKSIZE >>>(hb, hb2, n);
+    checkCudaErrors(cudaDeviceSynchronize());
+}
+
+// ----------------------------------------------------------------------------
+// backends: one Backend per way of running the kernels, picked once in main with --backend.
+// cpu is the scalar reference, simd the same kernels over vector dot products (the sums
+// are reordered, so its results differ from cpu in the last bits), cuda the GPU kernels.
+// rope and attention of the cuda backend still run on the host over managed memory. the CPU
+// backends map the checkpoint and read the matrices in panels, the cuda one reads it into
+// managed memory as it is
+//   ./main -m model.bin -i "Once upon a time" --backend simd
+
+void *alloc_host(size_t bytes) {
+    // aligned for the vector loads of the simd backend
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, 64, bytes > 0 ? bytes : 64) != 0) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+void free_host(void *ptr) { free(ptr); }
+void copy_host(void *dst, const void *src, size_t bytes) { memcpy(dst, src, bytes); }
+void prefetch_host(const void *ptr, size_t bytes, int device) {}
+
+void *map_host(int fd, size_t bytes) {
+    // straight from the page cache: shared by every process on the model, nothing is read
+    // until it is touched and the pages nothing touches anymore can be dropped
+    void *ptr = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) { fprintf(stderr, "mmap failed!\n"); exit(EXIT_FAILURE); }
+    return ptr;
+}
+
+void unmap_host(void *ptr, size_t bytes) { munmap(ptr, bytes); }
+
+void *alloc_managed(size_t bytes) {
+    void *ptr;
+    checkCudaErrors(cudaMallocManaged(&ptr, bytes));
+    return ptr;
+}
+
+void free_managed(void *ptr) { checkCudaErrors(cudaFree(ptr)); }
+void copy_managed(void *dst, const void *src, size_t bytes) { checkCudaErrors(cudaMemcpy(dst, src, bytes, cudaMemcpyDefault)); }
+void prefetch_managed(const void *ptr, size_t bytes, int device) { checkCudaErrors(cudaMemPrefetchAsync(ptr, bytes, device)); }
+
+void *map_managed(int fd, size_t bytes) {
+    // pull the whole checkpoint into managed memory, read() may return short counts on big files
+    char *ptr = (char *)alloc_managed(bytes + 1);
+    size_t n_read = 0;
+    while (n_read < bytes) {
+        ssize_t r = pread(fd, ptr + n_read, bytes - n_read, n_read);
+        if (r <= 0) { fprintf(stderr, "Read weights from checkpoint failed\n"); exit(EXIT_FAILURE); }
+        n_read += r;
+    }
+    return ptr;
+}
+
+void unmap_managed(void *ptr, size_t bytes) { free_managed(ptr); }
+
+// the CPU kernels of the shapes we run: dim 288, 512, 768 and 4096 (the 15M, 42M, 110M and 7B
+// models), their hidden_dim 768, 1376, 2048 and 11008, and head_size 48, 64 and 128
+
+template <bool SIMD> MatmulFn matmul_for(int n) {
+    switch (n) {
+        case 288: return matmul_cpu<288, SIMD>;
+        case 512: return matmul_cpu<512, SIMD>;
+        case 768: return matmul_cpu<768, SIMD>;
+        case 1376: return matmul_cpu<1376, SIMD>;
+        case 2048: return matmul_cpu<2048, SIMD>;
+        case 4096: return matmul_cpu<4096, SIMD>;
+        case 11008: return matmul_cpu<11008, SIMD>;
+        default: return NULL;
+    }
+}
+
+template <bool SIMD> RmsnormFn rmsnorm_for(int size) {
+    switch (size) {
+        case 288: return rmsnorm_cpu<288, SIMD>;
+        case 512: return rmsnorm_cpu<512, SIMD>;
+        case 768: return rmsnorm_cpu<768, SIMD>;
+        case 4096: return rmsnorm_cpu<4096, SIMD>;
+        default: return NULL;
+    }
+}
+
+template <bool SIMD> AttentionFn attention_for(int head_size) {
+    switch (head_size) {
+        case 48: return attention_cpu<48, SIMD>;
+        case 64: return attention_cpu<64, SIMD>;
+        case 128: return attention_cpu<128, SIMD>;
+        default: return NULL;
+    }
+}
+
+template <bool SIMD> LogprobFn logprob_for(int n) {
+    switch (n) {
+        case 288: return logprob_cpu<288, SIMD>;
+        case 512: return logprob_cpu<512, SIMD>;
+        case 768: return logprob_cpu<768, SIMD>;
+        case 4096: return logprob_cpu<4096, SIMD>;
+        default: return NULL;
+    }
+}
+
+template <bool SIMD> MatmulFn matmul_panels_for(int n) {
+    switch (n) {
+        case 288: return matmul_panels<288, SIMD>;
+        case 512: return matmul_panels<512, SIMD>;
+        case 768: return matmul_panels<768, SIMD>;
+        case 1376: return matmul_panels<1376, SIMD>;
+        case 2048: return matmul_panels<2048, SIMD>;
+        case 4096: return matmul_panels<4096, SIMD>;
+        case 11008: return matmul_panels<11008, SIMD>;
+        default: return NULL;
+    }
+}
+
+static Backend backends[] = {
+    // name, device, alloc, free, copy, prefetch, map, unmap, matmul, rmsnorm, rope, attention, residual,
+    // swiglu, logprob, the kernels for one size, the panels of matmul, and the int8 matmul
+    {"cpu", cudaCpuDeviceId, alloc_host, free_host, copy_host, prefetch_host, map_host, unmap_host,
+     matmul_cpu<0, false>, rmsnorm_cpu<0, false>, rope, attention_cpu<0, false>, residual_cpu, swiglu_cpu, logprob_cpu<0, false>,
+     matmul_for<false>, rmsnorm_for<false>, attention_for<false>, logprob_for<false>,
+     PANEL_ROWS, matmul_panels<0, false>, matmul_panels_for<false>, matmul_q8<false>},
+    {"simd", cudaCpuDeviceId, alloc_host, free_host, copy_host, prefetch_host, map_host, unmap_host,
+     matmul_cpu<0, true>, rmsnorm_cpu<0, true>, rope, attention_cpu<0, true>, residual_cpu, swiglu_cpu, logprob_cpu<0, true>,
+     matmul_for<true>, rmsnorm_for<true>, attention_for<true>, logprob_for<true>,
+     PANEL_ROWS, matmul_panels<0, true>, matmul_panels_for<true>, matmul_q8<true>},
+    {"cuda", 0, alloc_managed, free_managed, copy_managed, prefetch_managed, map_managed, unmap_managed,
+     matmul_gpu, rmsnorm_gpu, rope, attention_cpu<0, false>, residual_gpu, swiglu_gpu, logprob_gpu,
+     NULL, NULL, NULL, NULL,
+     0, NULL, NULL, NULL},
+};
+
+Backend *select_backend(const char *name, int device) {
+    // NULL picks cuda when a device is given and cpu otherwise
+    if (name == NULL) { name = device >= 0 ? "cuda" : "cpu"; }
+    for (int i = 0; i < (int)(sizeof(backends) / sizeof(Backend)); i++) {
+        Backend *b = &backends[i];
+        if (strcmp(b->name, name) != 0) { continue; }
+        if (b->device != cudaCpuDeviceId) {
+            b->device = device >= 0 ? device : 0;
+            checkCudaErrors(cudaSetDevice(b->device));
+        }
+        return b;
+    }
+    fprintf(stderr, "unknown backend: %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+// the kernel of a backend for one size, its generic one if it has none for it
+
+MatmulFn backend_matmul(const Backend *b, int n) {
+    // the shape kernel, unless autotune() found the generic one faster
+    MatmulFn f = b->matmul_for != NULL && !tuning.generic ? b->matmul_for(n) : NULL;
+    return f != NULL ? f : b->matmul;
+}
+
+MatmulFn backend_matmul_panels(const Backend *b, int n) {
+    MatmulFn f = b->matmul_panels_for != NULL && !tuning.generic ? b->matmul_panels_for(n) : NULL;
+    return f != NULL ? f : b->matmul_panels;
+}
+
+RmsnormFn backend_rmsnorm(const Backend *b, int size) {
+    RmsnormFn f = b->rmsnorm_for != NULL ? b->rmsnorm_for(size) : NULL;
+    return f != NULL ? f : b->rmsnorm;
+}
+
+AttentionFn backend_attention(const Backend *b, int head_size) {
+    AttentionFn f = b->attention_for != NULL ? b->attention_for(head_size) : NULL;
+    return f != NULL ? f : b->attention;
+}
+
+LogprobFn backend_logprob(const Backend *b, int n) {
+    LogprobFn f = b->logprob_for != NULL ? b->logprob_for(n) : NULL;
+    return f != NULL ? f : b->logprob;
+}
+
+// ----------------------------------------------------------------------------
+// execution plan: the forward pass compiled once per model. each kernel below runs one op
+// of forward_batch() over the whole batch, with everything but the batch resolved in its PlanOp
+
+void op_embed(const PlanOp *op, RunState *s, Batch *batch) {
+    // copy the token embeddings into out
+    for (int b = 0; b < batch->n_tokens; b++) {
+        float* content_row = op->w + (size_t)batch->token[b] * op->d;
+        op->backend->copy(op->out + (size_t)b * op->d, content_row, op->d*sizeof(float));
+    }
+}
+
+void op_rmsnorm(const PlanOp *op, RunState *s, Batch *batch) {
+    for (int b = 0; b < batch->n_tokens; b++) {
+        op->rmsnorm(op->out + (size_t)b * op->d, op->in + (size_t)b * op->d, s->partial_sum, op->w, op->d);
+    }
+}
+
+void op_final_rmsnorm(const PlanOp *op, RunState *s, Batch *batch) {
+    // gathers the rows that need logits into xb and the scored ones into xb2
+    for (int b = 0; b < batch->n_tokens; b++) {
+        float *x = op->in + (size_t)b * op->d;
+        if (batch->logits_row[b] >= 0) { op->rmsnorm(s->xb + (size_t)batch->logits_row[b] * op->d, x, s->partial_sum, op->w, op->d); }
+        if (batch->score_row[b] >= 0) { op->rmsnorm(s->xb2 + (size_t)batch->score_row[b] * op->d, x, s->partial_sum, op->w, op->d); }
+    }
+}
+
+void op_matmul(const PlanOp *op, RunState *s, Batch *batch) {
+    op->matmul(op->out, op->in, op->w, op->n, op->d, batch->n_tokens);
+}
+
+void op_quantize(const PlanOp *op, RunState *s, Batch *batch) {
+    // the input of the int8 matmuls after it, per token into xq
+    quantize_rows(s->xq, s->xq_scale, op->in, op->n, batch->n_tokens);
+}
+
+void op_matmul_q8(const PlanOp *op, RunState *s, Batch *batch) {
+    op->matmul_q8(op->out, s->xq, s->xq_scale, &op->q8, op->n, op->d, batch->n_tokens);
+}
+
+void op_classifier(const PlanOp *op, RunState *s, Batch *batch) {
+    if (batch->n_logits > 0) { op->matmul(op->out, op->in, op->w, op->n, op->d, batch->n_logits); }
+}
+
+void op_logprob(const PlanOp *op, RunState *s, Batch *batch) {
+    if (batch->n_scored == 0) { return; }
+    memcpy(s->targets, batch->target, batch->n_scored * sizeof(int));
+    op->logprob(op->out, s->logprob_partial, op->in, op->w, s->targets, op->n, op->d, batch->n_scored);
+}
+
+void op_rope_kv(const PlanOp *op, RunState *s, Batch *batch) {
+    KVCache *kv = &s->kv;
+    int dim = op->d;
+    int kv_dim = op->n;
+    for (int b = 0; b < batch->n_tokens; b++) {
+        int pos = batch->pos[b];
+        float *q = s->q + (size_t)b * dim;
+        float *k = s->k + (size_t)b * kv_dim;
+        op->backend->rope(q, k, pos, dim, kv_dim, op->head_size);
+        // store key and value in the cache slot of this position, before any token
+        // of the batch attends, so later positions of the same sequence can see them
+        size_t slot = batch->blocks[b][pos / KV_BLOCK_SIZE] * kv->block_floats + op->loff + (pos % KV_BLOCK_SIZE) * kv->kv_dim;
+        op->backend->copy(kv->key_pool + slot, k, kv_dim * sizeof(float));
+        op->backend->copy(kv->value_pool + slot, s->v + (size_t)b * kv_dim, kv_dim * sizeof(float));
+    }
+}
+
+void op_attention(const PlanOp *op, RunState *s, Batch *batch) {
+    op->attention(op->out, op->in, &s->kv, batch, op->loff, op->n_heads, op->kv_mul, op->head_size);
+}
+
+void op_residual(const PlanOp *op, RunState *s, Batch *batch) {
+    // residual connection back into out
+    op->backend->residual(op->out, op->in, (size_t)batch->n_tokens * op->d);
+}
+
+void op_swiglu(const PlanOp *op, RunState *s, Batch *batch) {
+    // SwiGLU non-linearity of in (hb) and out (hb2), into in
+    op->backend->swiglu(op->in, op->out, (size_t)batch->n_tokens * op->d);
+}
+
+PlanOp *plan_op(ExecPlan *plan, PlanKernel run, int layer, int prof, float *w, float *in, float *out, int n, int d) {
+    // appends an op, the callers fill in what else it needs
+    PlanOp *op = plan->ops + plan->n_ops++;
+    memset(op, 0, sizeof(PlanOp));
+    op->run = run;
+    op->backend = plan->backend;
+    op->layer = layer;
+    op->prof = prof;
+    op->w = w;
+    op->in = in;
+    op->out = out;
+    op->n = n;
+    op->d = d;
+    return op;
+}
+
+PlanOp *plan_matmul(ExecPlan *plan, int layer, int prof, const QuantMatrix *q, size_t ql, float *w, float *in, float *out, int n, int d) {
+    // op_matmul over w, or op_matmul_q8 over layer ql of q when the layer is quantized
+    if (q == NULL) { return plan_op(plan, op_matmul, layer, prof, w, in, out, n, d); }
+    PlanOp *op = plan_op(plan, op_matmul_q8, layer, prof, NULL, in, out, n, d);
+    op->q8.w = q->w + ql * d * n;
+    op->q8.scale = q->scale + ql * d;
+    op->q8.sum = q->sum + ql * d;
+    return op;
+}
+
+void plan_cost(PlanOp *op, PlanRows rows, double bytes, double bytes_row, double flops_row) {
+    op->rows = rows;
+    op->bytes = bytes;
+    op->bytes_row = bytes_row;
+    op->flops_row = flops_row;
+}
+
+void build_plan(Transformer *t) {
+    // compiles the forward pass: the layer offsets of the weights, the buffers every op reads
+    // and writes and the backend running it are all settled here, once
+    Config* p = &t->config;
+    const TransformerWeights* w = &t->model->weights;
+    // the matrices, in panels or not. autotune() can also pick the row major ones over the panels
+    PackedWeights row_major = row_major_weights(t->model);
+    const PackedWeights* packed = tuning.row_major ? &row_major : &t->model->packed;
+    const QuantWeights* qw = &t->model->quant; // or in int8
+    RunState* s = &t->state;
+    ExecPlan *plan = &t->plan;
+    int q8 = qw->map != NULL && t->backend->matmul_q8 != NULL;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
+    int hidden_dim =  p->hidden_dim;
+    int head_size = dim / p->n_heads;
+    double f = sizeof(float);
+    plan->ops = (PlanOp *)malloc((18 * (size_t)p->n_layers + 4) * sizeof(PlanOp));
+    if (!plan->ops) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    plan->n_ops = 0;
+    plan->backend = t->backend;
+    PlanOp *op = plan_op(plan, op_embed, p->n_layers, OP_EMBED, w->token_embedding_table, NULL, s->x, 0, dim);
+    plan_cost(op, ROWS_TOKENS, 0, 2 * dim * f, 0);
+
+    for (unsigned long long l = 0; l < p->n_layers; l++) {
+        const PackedWeights *m = packed_layer(packed, l, p->n_layers) ? packed : &row_major;
+        size_t ml = l - m->l0; // the layer in m
+        int lq = q8 && (int)l >= qw->l0 && (int)l < qw->l1;
+        size_t ql = l - qw->l0; // and in qw
+        double wf = lq ? 1 : f; // bytes per weight of the layer matrices
+        // attention rmsnorm
+        op = plan_op(plan, op_rmsnorm, l, OP_RMSNORM, w->rms_att_weight + l*dim, s->x, s->xb, dim, dim);
+        plan_cost(op, ROWS_TOKENS, dim * f, 2 * dim * f, 4 * dim);
+        // qkv matmuls for the whole batch
+        if (lq) { plan_op(plan, op_quantize, l, -1, NULL, s->xb, NULL, dim, dim); }
+        plan_matmul(plan, l, -1, lq ? &qw->wq : NULL, ql, m->wq + ml*panel_floats(dim, dim, m->rows), s->xb, s->q, dim, dim);
+        plan_matmul(plan, l, -1, lq ? &qw->wk : NULL, ql, m->wk + ml*panel_floats(dim, kv_dim, m->rows), s->xb, s->k, dim, kv_dim);
+        op = plan_matmul(plan, l, OP_QKV, lq ? &qw->wv : NULL, ql, m->wv + ml*panel_floats(dim, kv_dim, m->rows), s->xb, s->v, dim, kv_dim);
+        plan_cost(op, ROWS_TOKENS, (double)dim * (dim + 2 * kv_dim) * wf, 0, 2.0 * dim * (dim + 2 * kv_dim));
+        // RoPE, then the keys and values into the kv cache
+        size_t loff = l * KV_BLOCK_SIZE * kv_dim; // layer offset inside a kv block
+        op = plan_op(plan, op_rope_kv, l, OP_ROPE, NULL, NULL, NULL, kv_dim, dim);
+        op->head_size = head_size;
+        op->loff = loff;
+        plan_cost(op, ROWS_TOKENS, 0, 4 * (dim + kv_dim) * f, 3 * (dim + kv_dim));
+        // multihead attention of all the tokens, into xb. the kv heads shared by several
+        // query heads are counted once, the repeats hit the cache
+        op = plan_op(plan, op_attention, l, OP_ATTENTION, NULL, s->q, s->xb, 0, dim);
+        op->n_heads = p->n_heads;
+        op->kv_mul = kv_mul;
+        op->head_size = head_size;
+        op->loff = loff;
+        plan_cost(op, ROWS_ATTENDED, 0, 2 * kv_dim * f, 4 * dim);
+        // final matmul to get the output of the attention, and the residual connection
+        if (lq) { plan_op(plan, op_quantize, l, -1, NULL, s->xb, NULL, dim, dim); }
+        op = plan_matmul(plan, l, OP_WO, lq ? &qw->wo : NULL, ql, m->wo + ml*panel_floats(dim, dim, m->rows), s->xb, s->xb2, dim, dim);
+        plan_cost(op, ROWS_TOKENS, (double)dim * dim * wf, 0, 2.0 * dim * dim);
+        op = plan_op(plan, op_residual, l, OP_RESIDUAL, NULL, s->xb2, s->x, 0, dim);
+        plan_cost(op, ROWS_TOKENS, 0, 3 * dim * f, dim);
+        // ffn rmsnorm
+        op = plan_op(plan, op_rmsnorm, l, OP_RMSNORM, w->rms_ffn_weight + l*dim, s->x, s->xb, dim, dim);
+        plan_cost(op, ROWS_TOKENS, dim * f, 2 * dim * f, 4 * dim);
+        // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
+        if (lq) { plan_op(plan, op_quantize, l, -1, NULL, s->xb, NULL, dim, dim); }
+        plan_matmul(plan, l, -1, lq ? &qw->w1 : NULL, ql, m->w1 + ml*panel_floats(dim, hidden_dim, m->rows), s->xb, s->hb, dim, hidden_dim);
+        op = plan_matmul(plan, l, OP_FFN_UP, lq ? &qw->w3 : NULL, ql, m->w3 + ml*panel_floats(dim, hidden_dim, m->rows), s->xb, s->hb2, dim, hidden_dim);
+        plan_cost(op, ROWS_TOKENS, 2.0 * dim * hidden_dim * wf, 0, 4.0 * dim * hidden_dim);
+        op = plan_op(plan, op_swiglu, l, OP_SWIGLU, NULL, s->hb, s->hb2, 0, hidden_dim);
+        plan_cost(op, ROWS_TOKENS, 0, 3 * hidden_dim * f, 5 * hidden_dim);
+        // final matmul to get the output of the ffn, and the residual connection
+        if (lq) { plan_op(plan, op_quantize, l, -1, NULL, s->hb, NULL, hidden_dim, hidden_dim); }
+        op = plan_matmul(plan, l, OP_FFN_DOWN, lq ? &qw->w2 : NULL, ql, m->w2 + ml*panel_floats(hidden_dim, dim, m->rows), s->hb, s->xb, hidden_dim, dim);
+        plan_cost(op, ROWS_TOKENS, (double)dim * hidden_dim * wf, 0, 2.0 * dim * hidden_dim);
+        op = plan_op(plan, op_residual, l, OP_RESIDUAL, NULL, s->xb, s->x, 0, dim);
+        plan_cost(op, ROWS_TOKENS, 0, 3 * dim * f, dim);
+    }
+
+    // final rmsnorm of the rows that need logits or are scored, then the classifier into
+    // logits and the fused classifier and log-softmax into logprobs
+    op = plan_op(plan, op_final_rmsnorm, p->n_layers, OP_RMSNORM, w->rms_final_weight, s->x, NULL, dim, dim);
+    plan_cost(op, ROWS_OUTPUT, dim * f, 2 * dim * f, 4 * dim);
+    float *wcls = packed_layer(packed, p->n_layers, p->n_layers) ? packed->wcls : w->wcls;
+    op = plan_op(plan, op_classifier, p->n_layers, OP_CLASSIFIER, wcls, s->xb, s->logits, dim, p->vocab_size);
+    plan_cost(op, ROWS_LOGITS, (double)dim * p->vocab_size * f, 0, 2.0 * dim * p->vocab_size);
+    op = plan_op(plan, op_logprob, p->n_layers, OP_LOGPROB, w->wcls, s->xb2, s->logprobs, dim, p->vocab_size);
+    plan_cost(op, ROWS_SCORED, (double)dim * p->vocab_size * f, 0, 2.0 * dim * p->vocab_size);
+
+    // the kernels for the sizes of every op
+    for (int i = 0; i < plan->n_ops; i++) {
+        op = plan->ops + i;
+        if (op->run == op_matmul || op->run == op_classifier) {
+            op->matmul = packed_layer(packed, op->layer, p->n_layers) ? backend_matmul_panels(op->backend, op->n) : backend_matmul(op->backend, op->n);
+        }
+        else if (op->run == op_matmul_q8) { op->matmul_q8 = op->backend->matmul_q8; }
+        else if (op->run == op_rmsnorm || op->run == op_final_rmsnorm) { op->rmsnorm = backend_rmsnorm(op->backend, op->d); }
+        else if (op->run == op_attention) { op->attention = backend_attention(op->backend, op->head_size); }
+        else if (op->run == op_logprob) { op->logprob = backend_logprob(op->backend, op->n); }
+    }
+}
+
+int first_op_of(const ExecPlan *plan, int layer) {
+    // the first op of layer past the embedding, n_layers gives the final rmsnorm
+    for (int i = 1; i < plan->n_ops; i++) {
+        if (plan->ops[i].layer >= layer) { return i; }
+    }
+    return plan->n_ops;
+}
+
+void pipeline_forward(Transformer *t, Batch *batch); // the same over the stages of t->pipeline
+void tp_forward(Transformer *t, Batch *batch); // and over the ranks of t->tp
+
+void forward_batch(Transformer *transformer, Batch *batch) {
+    // forwards every token of the batch at its own position, reading and writing the
+    // kv cache through the block table of its sequence. logits are only produced for the
+    // tokens with a logits_row, into RunState.logits (n_logits, vocab_size), and only the
+    // log-probability of the target token for the tokens with a score_row, into RunState.logprobs.
+    // all of it is a replay of the plan built with the transformer
+    ExecPlan *plan = &transformer->plan;
+    RunState *s = &transformer->state;
+    Profiler *prof = transformer->profiler;
+    if (prof == NULL && transformer->pipeline != NULL) {
+        pipeline_forward(transformer, batch);
+        return;
+    }
+    if (prof == NULL && transformer->tp != NULL) {
+        tp_forward(transformer, batch);
+        return;
+    }
+    if (prof == NULL) {
+        for (int i = 0; i < plan->n_ops; i++) { plan->ops[i].run(plan->ops + i, s, batch); }
+        return;
+    }
+    // rows each kind of op runs over, for the bytes and flops of the profiler
+    double rows[ROWS_SCORED + 1];
+    rows[ROWS_TOKENS] = batch->n_tokens;
+    rows[ROWS_ATTENDED] = 0;
+    for (int b = 0; b < batch->n_tokens; b++) { rows[ROWS_ATTENDED] += batch->pos[b] + 1; }
+    rows[ROWS_OUTPUT] = batch->n_logits + batch->n_scored;
+    rows[ROWS_LOGITS] = batch->n_logits;
+    rows[ROWS_SCORED] = batch->n_scored;
+    PROF_START(prof);
+    for (int i = 0; i < plan->n_ops; i++) {
+        const PlanOp *op = plan->ops + i;
+        op->run(op, s, batch);
+        double n = rows[op->rows];
+        // an op with nothing to run over leaves its time to the next one
+        if (op->prof < 0 || n == 0) { continue; }
+        PROF_OP(prof, op->layer, (ProfOp)op->prof, op->bytes + n * op->bytes_row, n * op->flops_row);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// autotune: the KernelTuning of this host for the loaded model shape. the first time
+// a shape runs, the matmuls of its first layer are timed with every kernel variant (the
+// shape or the generic kernel, the panels or the row major matrices), then with every
+// candidate thread count for a single token (decode) and for a batch (prefill), and the
+// batch with every candidate tile. the winners go into a cache file keyed by the CPU
+// model, its thread count, the Config and the kernels (backend and panels), later runs
+// read them back. CPU only, e.g.
+//   ./main -m model.bin -i "Once upon a time"              (tunes once, then from the cache)
+//   ./main -m model.bin -i "Once upon a time" --tune force (tunes again)
+
+#define TUNE_PREFILL_BATCH 16
+
+void cpu_model(char *out, size_t size) {
+    // the model name of /proc/cpuinfo, without the tabs that separate the cache fields
+    snprintf(out, size, "unknown");
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (!file) { return; }
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) != 0 || colon == NULL) { continue; }
+        colon += strspn(colon + 1, " ") + 1;
+        colon[strcspn(colon, "\n")] = '\0';
+        for (char *c = colon; *c != '\0'; c++) { if (*c == '\t') { *c = ' '; } }
+        snprintf(out, size, "%s", colon);
+        break;
+    }
+    fclose(file);
+}
+
+void cache_dir(char *out, size_t size) {
+    // $XDG_CACHE_HOME/llama2.cu, or ~/.cache/llama2.cu, created if needed. empty without a home
+    char *cache = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    char dir[1024];
+    if (cache != NULL && cache[0] != '\0') { snprintf(dir, sizeof(dir), "%s", cache); }
+    else if (home != NULL && home[0] != '\0') { snprintf(dir, sizeof(dir), "%s/.cache", home); }
+    else { out[0] = '\0'; return; }
+    mkdir(dir, 0755);
+    snprintf(out, size, "%s/llama2.cu", dir);
+    mkdir(out, 0755);
+}
+
+void default_tune_cache(char *out, size_t size) {
+    // autotune.tsv in the cache_dir()
+    char dir[1024];
+    cache_dir(dir, sizeof(dir));
+    if (dir[0] == '\0') { out[0] = '\0'; return; }
+    snprintf(out, size, "%s/autotune.tsv", dir);
+}
+
+int tune_lookup(const char *path, const char *key, KernelTuning *out) {
+    // the last line of the cache with this key wins, returns 1 if there is one
+    FILE *file = fopen(path, "r");
+    if (!file) { return 0; }
+    char line[1024];
+    size_t key_len = strlen(key);
+    int found = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, key, key_len) != 0 || line[key_len] != '\t') { continue; }
+        KernelTuning t;
+        if (sscanf(line + key_len + 1, "%d %d %d %d %d %d", &t.threads_decode, &t.threads_prefill, &t.row_tile, &t.batch_tile,
+                   &t.generic, &t.row_major) == 6 && t.row_tile > 0) {
+            *out = t;
+            found = 1;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+long time_op(const PlanOp *op, RunState *s, int batch) {
+    // median of three runs of a matmul of the plan over batch tokens, after a warmup
+    Batch b;
+    memset(&b, 0, sizeof(Batch));
+    b.n_tokens = batch;
+    op->run(op, s, &b);
+    long t[3];
+    for (int r = 0; r < 3; r++) {
+        long start = time_in_ns();
+        op->run(op, s, &b);
+        t[r] = time_in_ns() - start;
+    }
+    long lo = t[0] < t[1] ? t[0] : t[1], hi = t[0] < t[1] ? t[1] : t[0];
+    return t[2] < lo ? lo : (t[2] > hi ? hi : t[2]);
+}
+
+void tune_ops(Transformer *transformer, int layer, int batch, const PlanOp **up, const PlanOp **wq) {
+    // the matmuls of layer that get timed, with the kernels and weights the plan runs them with.
+    // the int8 ones read xb as quantized by the op_quantize before them
+    RunState *s = &transformer->state;
+    *up = NULL;
+    *wq = NULL;
+    for (int i = first_op_of(&transformer->plan, layer); i < first_op_of(&transformer->plan, layer + 1); i++) {
+        const PlanOp *op = transformer->plan.ops + i;
+        if (op->run == op_matmul_q8 && op->in == s->xb) { quantize_rows(s->xq, s->xq_scale, s->xb, op->n, batch); }
+        if (op->run != op_matmul && op->run != op_matmul_q8) { continue; }
+        if (*up == NULL && op->out == s->hb) { *up = op; }
+        if (*wq == NULL && op->out == s->q) { *wq = op; }
+    }
+}
+
+void autotune_plan(Transformer *transformer) {
+    // the plan again, with the kernels and matrices of the variant in tuning
+    free(transformer->plan.ops);
+    build_plan(transformer);
+}
+
+void autotune(Transformer *transformer, int layer, int force, const char *cache_path) {
+    // times the matmuls of layer, one this process runs
+    Config *p = &transformer->config;
+    RunState *s = &transformer->state;
+    char cpu[256], key[512];
+    cpu_model(cpu, sizeof(cpu));
+    snprintf(key, sizeof(key), "%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%s%s\t%d", cpu, max_threads(), p->dim, p->hidden_dim,
+             p->n_layers, p->n_heads, p->n_kv_heads, p->vocab_size, p->max_seq_len, transformer->backend->name,
+             transformer->model->quant.map != NULL ? "+w8a8" : "", transformer->model->packed.rows);
+    // the kernels of tensor parallel ranks are settled before the tune, they keep the defaults
+    const Backend *backend = transformer->backend;
+    int variants = transformer->tp == NULL && transformer->model->quant.map == NULL;
+    if (!force && cache_path[0] != '\0' && tune_lookup(cache_path, key, &tuning)) {
+        if (!variants) { tuning.generic = tuning.row_major = 0; }
+        fprintf(stderr, "autotune: decode %d threads, prefill %d threads, row tile %d, batch tile %d, %s kernels%s (from %s)\n",
+                tuning.threads_decode, tuning.threads_prefill, tuning.row_tile, tuning.batch_tile,
+                tuning.generic ? "generic" : "shape", tuning.row_major ? ", row major" : "", cache_path);
+        if (tuning.generic || tuning.row_major) { autotune_plan(transformer); }
+        return;
+    }
+    long start = time_in_ms();
+    int batch = s->max_batch < TUNE_PREFILL_BATCH ? s->max_batch : TUNE_PREFILL_BATCH;
+    for (size_t i = 0; i < (size_t)batch * p->dim; i++) { s->xb[i] = 0.01f * (i % 97); }
+    const PlanOp *up, *wq;
+    KernelTuning best = {0, 0, 1, 0, 0, 0};
+    tuning = best;
+    long best_ns = -1;
+
+    // the variants with all the threads, by the time of a decoded token plus a prefilled one
+    int n_generic = variants && (backend->matmul_for != NULL || backend->matmul_panels_for != NULL) ? 2 : 1;
+    int n_layouts = variants && transformer->model->packed.rows > 0 ? 2 : 1;
+    for (int g = 0; g < n_generic; g++) {
+        for (int r = 0; r < n_layouts; r++) {
+            tuning.generic = g;
+            tuning.row_major = r;
+            autotune_plan(transformer);
+            tune_ops(transformer, layer, batch, &up, &wq);
+            long ns = time_op(up, s, 1) + time_op(wq, s, batch) / batch;
+            if (best_ns < 0 || ns < best_ns) { best_ns = ns; best.generic = g; best.row_major = r; }
+        }
+    }
+    tuning = best;
+    if (n_generic * n_layouts > 1) { autotune_plan(transformer); }
+    tune_ops(transformer, layer, batch, &up, &wq);
+
+    // thread counts: the powers of two below the cores, and all of them
+    int threads[32];
+    int n_threads = 0;
+    for (int c = 1; c < max_threads() && n_threads < 31; c *= 2) { threads[n_threads++] = c; }
+    threads[n_threads++] = max_threads();
+
+    // decode on w1, the largest matrix of a layer: it only streams the weights
+    best_ns = -1;
+    for (int i = 0; i < n_threads; i++) {
+        tuning.threads_decode = threads[i];
+        long ns = time_op(up, s, 1);
+        if (best_ns < 0 || ns < best_ns) { best_ns = ns; best.threads_decode = threads[i]; }
+    }
+    // prefill on wq, a batch does real compute: the tiles with all the threads, then the
+    // threads with the best tiles
+    int row_tiles[] = {1, 4, 16, 64};
+    int batch_tiles[] = {0, 4, 8};
+    tuning.threads_prefill = max_threads();
+    best_ns = -1;
+    for (int r = 0; r < (int)(sizeof(row_tiles) / sizeof(int)); r++) {
+        for (int b = 0; b < (int)(sizeof(batch_tiles) / sizeof(int)); b++) {
+            if (batch_tiles[b] >= batch) { continue; }
+            tuning.row_tile = row_tiles[r];
+            tuning.batch_tile = batch_tiles[b];
+            long ns = time_op(wq, s, batch);
+            if (best_ns < 0 || ns < best_ns) { best_ns = ns; best.row_tile = row_tiles[r]; best.batch_tile = batch_tiles[b]; }
+        }
+    }
+    tuning.row_tile = best.row_tile;
+    tuning.batch_tile = best.batch_tile;
+    best_ns = -1;
+    for (int i = 0; i < n_threads; i++) {
+        tuning.threads_prefill = threads[i];
+        long ns = time_op(wq, s, batch);
+        if (best_ns < 0 || ns < best_ns) { best_ns = ns; best.threads_prefill = threads[i]; }
+    }
+    tuning = best;
+    fprintf(stderr, "autotune: decode %d threads, prefill %d threads, row tile %d, batch tile %d, %s kernels%s (tuned in %ld ms)\n",
+            tuning.threads_decode, tuning.threads_prefill, tuning.row_tile, tuning.batch_tile,
+            tuning.generic ? "generic" : "shape", tuning.row_major ? ", row major" : "", time_in_ms() - start);
+    if (cache_path[0] == '\0') { return; }
+    FILE *file = fopen(cache_path, "a");
+    if (!file) {
+        fprintf(stderr, "autotune: couldn't write %s\n", cache_path);
+        return;
+    }
+    fprintf(file, "%s\t%d %d %d %d %d %d\n", key, tuning.threads_decode, tuning.threads_prefill, tuning.row_tile, tuning.batch_tile,
+            tuning.generic, tuning.row_major);
+    fclose(file);
+}
+
+// ----------------------------------------------------------------------------
+// weight panels: the matrices repacked at load into the panels matmul_panels reads. the
+// packed image is written once to a sidecar file in the cache dir, named by a hash of the
+// checkpoint, and later starts map it straight from the page cache. a process running
+// only some of the layers, as the stages of a pipeline do, packs just those: the image of
+// a range of layers is a sidecar of its own. backends that have a panel kernel use it
+// unless --pack off, e.g.
+//   ./main -m model.bin -i "Once upon a time"              (packs once, then maps the sidecar)
+//   ./main -m model.bin -i "Once upon a time" --pack force (packs again)
+
+#define PANEL_MAGIC 0x736c656e61702e32ULL   // "2.panels"
+#define PANEL_VERSION 2
+#define PANEL_HEADER 4096                   // the header page, the matrices follow
+
+typedef struct {
+    uint64_t magic;
+    uint64_t hash;      // checkpoint_hash() of the checkpoint they were packed from
+    uint64_t bytes;     // of the whole file
+    int version;
+    int rows, cols;     // PANEL_ROWS, PANEL_COLS
+    int l0, l1;         // the layers in the file
+} PanelHeader;
+
+#define PANEL_MATS 8                        // wq, wk, wv, wo, w1, w2, w3 of every layer, then wcls
+
+size_t panel_layout(const Config *p, int l0, int l1, int *ns, int *ds, size_t *offset) {
+    // the (d, n) of every matrix and its offset in the packed image of layers l0..l1, returns
+    // the image size. wcls goes with layer 0: whoever runs it runs the classifier too
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int hidden_dim = p->hidden_dim;
+    int n[PANEL_MATS] = {dim, dim, dim, dim, dim, hidden_dim, dim, dim};
+    int d[PANEL_MATS] = {dim, kv_dim, kv_dim, dim, hidden_dim, dim, hidden_dim, p->vocab_size};
+    size_t bytes = PANEL_HEADER;
+    for (int i = 0; i < PANEL_MATS; i++) {
+        int layers = i < PANEL_MATS - 1 ? l1 - l0 : l0 == 0;
+        ns[i] = n[i];
+        ds[i] = d[i];
+        offset[i] = bytes;
+        bytes += (layers * panel_floats(n[i], d[i], PANEL_ROWS) * sizeof(float) + 63) & ~(size_t)63;
+    }
+    return bytes;
+}
+
+uint64_t checkpoint_hash(const unsigned char *data, uint64_t size, const uint64_t *file_id) {
+    // FNV-1a over the file (device, inode, mtime), the size and 64 samples of 4 KB spread over
+    // the file, the first one with the Config. a start reads 256 KB of the checkpoint rather
+    // than all of it, so the samples alone miss an edit to a few tensors: the mtime changes
+    // with any write to the file, and a checkpoint replaced by another one gets a new inode
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int k = 0; k < 4; k++) {
+        for (int i = 0; i < 8; i++) { h = (h ^ ((file_id[k] >> (8 * i)) & 0xff)) * 0x100000001b3ULL; }
+    }
+    for (int i = 0; i < 8; i++) { h = (h ^ ((size >> (8 * i)) & 0xff)) * 0x100000001b3ULL; }
+    uint64_t len = size < 4096 ? size : 4096;
+    for (int i = 0; i < 64; i++) {
+        const unsigned char *sample = data + (size - len) / 63 * i;
+        for (uint64_t j = 0; j < len; j++) { h = (h ^ sample[j]) * 0x100000001b3ULL; }
+    }
+    return h;
+}
+
+void pack_panels(float *dst, const float *w, int n, int d) {
+    // W (d,n) row major into panels of PANEL_ROWS rows: the blocks of PANEL_COLS columns, each
+    // holding its columns of every row in turn, then the columns left of every row in turn. the
+    // rows of the last panel past d are zeros
+    int n_panels = (d + PANEL_ROWS - 1) / PANEL_ROWS;
+    int nb = n / PANEL_COLS;
+    int tn = n - nb * PANEL_COLS;
+    int p;
+    #pragma omp parallel for private(p)
+    for (p = 0; p < n_panels; p++) {
+        float *panel = dst + (size_t)p * PANEL_ROWS * n;
+        float *tail = panel + (size_t)nb * PANEL_COLS * PANEL_ROWS;
+        for (int r = 0; r < PANEL_ROWS; r++) {
+            int i = p * PANEL_ROWS + r;
+            const float *row = w + (size_t)i * n;
+            for (int blk = 0; blk < nb; blk++) {
+                float *out = panel + ((size_t)blk * PANEL_ROWS + r) * PANEL_COLS;
+                for (int k = 0; k < PANEL_COLS; k++) { out[k] = i < d ? row[blk * PANEL_COLS + k] : 0.0f; }
+            }
+            for (int k = 0; k < tn; k++) { tail[r * tn + k] = i < d ? row[nb * PANEL_COLS + k] : 0.0f; }
+        }
+    }
+}
+
+char *map_panels(const char *path, uint64_t hash, int l0, int l1, size_t bytes) {
+    // the sidecar at path, read only, if it holds the panels of these layers of this checkpoint.
+    // NULL if not
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { return NULL; }
+    PanelHeader h;
+    struct stat st;
+    char *map = NULL;
+    if (pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && fstat(fd, &st) == 0 && h.magic == PANEL_MAGIC &&
+        h.version == PANEL_VERSION && h.hash == hash && h.rows == PANEL_ROWS && h.cols == PANEL_COLS &&
+        h.l0 == l0 && h.l1 == l1 && h.bytes == bytes && (size_t)st.st_size == bytes) {
+        map = (char *)mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) { map = NULL; }
+    }
+    close(fd);
+    return map;
+}
+
+void pack_weights(Model *t, int l0, int l1, int force, const char *dir) {
+    // repacks the matrices of layers l0..l1 (and wcls with layer 0) into panels, read by the
+    // Transformers built over t from then on, in place of any packed before. they are mapped from
+    // the sidecar in dir when it has them, packed and written there otherwise (in a temporary file
+    // renamed once complete, so a crash or another process never sees half of it). dir "" packs
+    // into memory only. force packs again
+    if (t->backend->panel_rows != PANEL_ROWS) { return; }
+    Config *p = &t->config;
+    TransformerWeights *w = &t->weights;
+    if (l0 < 0 || l0 >= l1 || l1 > p->n_layers) {
+        fprintf(stderr, "panels: no layers %d-%d in a model of %d\n", l0, l1 - 1, p->n_layers);
+        exit(EXIT_FAILURE);
+    }
+    if (t->packed.map != NULL) { munmap(t->packed.map, t->packed.map_bytes); }
+    t->packed = row_major_weights(t);
+    float *src[PANEL_MATS] = {w->wq, w->wk, w->wv, w->wo, w->w1, w->w2, w->w3, w->wcls};
+    int ns[PANEL_MATS], ds[PANEL_MATS];
+    size_t offset[PANEL_MATS];
+    size_t bytes = panel_layout(p, l0, l1, ns, ds, offset);
+    uint64_t hash = checkpoint_hash((const unsigned char *)t->data, t->file_size, t->file_id);
+    char path[1100], tmp[1200];
+    path[0] = '\0';
+    if (dir[0] != '\0' && l0 == 0 && l1 == p->n_layers) { snprintf(path, sizeof(path), "%s/%016llx.panels", dir, (unsigned long long)hash); }
+    else if (dir[0] != '\0') { snprintf(path, sizeof(path), "%s/%016llx.layers%d-%d.panels", dir, (unsigned long long)hash, l0, l1 - 1); }
+
+    long start = time_in_ms();
+    char *map = !force && path[0] != '\0' ? map_panels(path, hash, l0, l1, bytes) : NULL;
+    if (map != NULL) {
+        fprintf(stderr, "panels: %.0f MB mapped from %s\n", bytes / 1e6, path);
+    } else {
+        int fd = -1;
+        map = (char *)MAP_FAILED;
+        if (path[0] != '\0') {
+            snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+            fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
+        if (fd != -1 && ftruncate(fd, bytes) == 0) { map = (char *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0); }
+        if (map == MAP_FAILED && path[0] != '\0') {
+            fprintf(stderr, "panels: couldn't write %s\n", tmp);
+            if (fd != -1) { close(fd); unlink(tmp); }
+            fd = -1;
+        }
+        if (map == MAP_FAILED) { map = (char *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); }
+        if (map == MAP_FAILED) { fprintf(stderr, "mmap failed!\n"); exit(EXIT_FAILURE); }
+        for (int i = 0; i < PANEL_MATS; i++) {
+            int first = i < PANEL_MATS - 1 ? l0 : 0, last = i < PANEL_MATS - 1 ? l1 : l0 == 0;
+            for (int l = first; l < last; l++) {
+                pack_panels((float *)(map + offset[i]) + (l - first) * panel_floats(ns[i], ds[i], PANEL_ROWS),
+                            src[i] + (size_t)l * ds[i] * ns[i], ns[i], ds[i]);
+            }
+        }
+        PanelHeader h = {PANEL_MAGIC, hash, bytes, PANEL_VERSION, PANEL_ROWS, PANEL_COLS, l0, l1};
+        memcpy(map, &h, sizeof(h));
+        mprotect(map, bytes, PROT_READ);
+        if (fd != -1) {
+            if (rename(tmp, path) != 0) { unlink(tmp); path[0] = '\0'; }
+            close(fd);
+        }
+        fprintf(stderr, "panels: %.0f MB packed in %ld ms%s%s\n", bytes / 1e6, time_in_ms() - start,
+                fd != -1 && path[0] != '\0' ? ", cached in " : "", fd != -1 ? path : "");
+    }
+    PackedWeights *m = &t->packed;
+    m->rows = PANEL_ROWS;
+    m->l0 = l0;
+    m->l1 = l1;
+    m->wq = (float *)(map + offset[0]);
+    m->wk = (float *)(map + offset[1]);
+    m->wv = (float *)(map + offset[2]);
+    m->wo = (float *)(map + offset[3]);
+    m->w1 = (float *)(map + offset[4]);
+    m->w2 = (float *)(map + offset[5]);
+    m->w3 = (float *)(map + offset[6]);
+    m->wcls = l0 == 0 ? (float *)(map + offset[7]) : NULL;
+    m->map = map;
+    m->map_bytes = bytes;
+}
+
+// ----------------------------------------------------------------------------
+// w8a8: the layer matrices quantized to int8 at load, a scale per row, and read by the int8
+// matmuls of the backend instead of the fp32 ones. the input of every such matmul is
+// quantized per token right before it (op_quantize), so prefill runs on int8 products with a
+// quarter of the weight bytes. the embedding, rmsnorms, attention, kv cache and classifier
+// stay fp32. like the panels, a process quantizes only the layers it runs. opt in with
+// --quant int8 on the cpu and simd backends, e.g.
+//   ./main -m model.bin -M bench --quant int8
+//   ./main -m model.bin -M ppl --input text.txt --quant int8   (what it costs in perplexity)
+
+#define QUANT_MATS 7                        // wq, wk, wv, wo, w1, w2, w3 of every layer
+
+size_t quant_bytes(const Config *p, int l0, int l1) {
+    // of the int8 matrices of layers l0..l1, their scales and their row sums, each 64 byte aligned
+    int ns[PANEL_MATS], ds[PANEL_MATS];
+    size_t offset[PANEL_MATS];
+    panel_layout(p, l0, l1, ns, ds, offset);
+    size_t layers = l1 - l0;
+    size_t bytes = 0;
+    for (int i = 0; i < QUANT_MATS; i++) {
+        bytes += (layers * ds[i] * ns[i] + 63) & ~(size_t)63;
+        bytes += 2 * ((layers * ds[i] * sizeof(float) + 63) & ~(size_t)63);
+    }
+    return bytes;
+}
+
+void quantize_matrix(int8_t *q, float *scale, int *sum, const float *w, int n, int d) {
+    // W (d,n) to int8 over the absolute max of every row, rows of zeros to a scale of 0
+    int i;
+    #pragma omp parallel for private(i)
+    for (i = 0; i < d; i++) {
+        const float *row = w + (size_t)i * n;
+        int8_t *qr = q + (size_t)i * n;
+        float max_val = 0.0f;
+        for (int j = 0; j < n; j++) { max_val = fmaxf(max_val, fabsf(row[j])); }
+        float inv = max_val > 0.0f ? 127.0f / max_val : 0.0f;
+        int s = 0;
+        for (int j = 0; j < n; j++) {
+            qr[j] = (int8_t)lrintf(row[j] * inv);
+            s += qr[j];
+        }
+        scale[i] = max_val / 127.0f;
+        sum[i] = s;
+    }
+}
+
+void quantize_weights(Model *t, int l0, int l1) {
+    // the int8 copies of the matrices of layers l0..l1, in one anonymous mapping read by the
+    // Transformers built over t from then on, in place of any quantized before. a backend
+    // without an int8 matmul keeps the fp32 ones
+    if (t->backend->matmul_q8 == NULL) { return; }
+    Config *p = &t->config;
+    TransformerWeights *w = &t->weights;
+    if (l0 < 0 || l0 >= l1 || l1 > p->n_layers) {
+        fprintf(stderr, "w8a8: no layers %d-%d in a model of %d\n", l0, l1 - 1, p->n_layers);
+        exit(EXIT_FAILURE);
+    }
+    if (t->quant.map != NULL) { munmap(t->quant.map, t->quant.map_bytes); }
+    memset(&t->quant, 0, sizeof(QuantWeights));
+    float *src[QUANT_MATS] = {w->wq, w->wk, w->wv, w->wo, w->w1, w->w2, w->w3};
+    QuantMatrix *dst[QUANT_MATS] = {&t->quant.wq, &t->quant.wk, &t->quant.wv, &t->quant.wo,
+                                    &t->quant.w1, &t->quant.w2, &t->quant.w3};
+    int ns[PANEL_MATS], ds[PANEL_MATS];
+    size_t offset[PANEL_MATS];
+    panel_layout(p, l0, l1, ns, ds, offset);
+    size_t layers = l1 - l0;
+    size_t bytes = quant_bytes(p, l0, l1);
+
+    long start = time_in_ms();
+    char *map = (char *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) { fprintf(stderr, "mmap failed!\n"); exit(EXIT_FAILURE); }
+    char *at = map;
+    for (int i = 0; i < QUANT_MATS; i++) {
+        QuantMatrix *q = dst[i];
+        q->w = (int8_t *)at;
+        at += (layers * ds[i] * ns[i] + 63) & ~(size_t)63;
+        q->scale = (float *)at;
+        at += (layers * ds[i] * sizeof(float) + 63) & ~(size_t)63;
+        q->sum = (int *)at;
+        at += (layers * ds[i] * sizeof(int) + 63) & ~(size_t)63;
+        for (size_t l = 0; l < layers; l++) {
+            quantize_matrix(q->w + l * ds[i] * ns[i], q->scale + l * ds[i], q->sum + l * ds[i],
+                            src[i] + (l0 + l) * ds[i] * ns[i], ns[i], ds[i]);
+        }
+    }
+    mprotect(map, bytes, PROT_READ);
+    t->quant.l0 = l0;
+    t->quant.l1 = l1;
+    t->quant.map = map;
+    t->quant.map_bytes = bytes;
+    fprintf(stderr, "w8a8: %.0f MB quantized in %ld ms\n", bytes / 1e6, time_in_ms() - start);
+}
+
+// ----------------------------------------------------------------------------
+// pipeline: the layers split into stages, each a thread with its own activations,
+// and the batch split into micro-batches that go through the stages in order. while
+// one stage runs its layers over a micro-batch, the stage before it already runs
+// its own layers over the next one. a micro-batch hands its rows of the residual
+// stream on through RunState.x of the transformer. the kv cache is shared, and each
+// stage writes only the layers it owns. on a host with several NUMA nodes the stages
+// are spread over the nodes and pinned to their CPUs, and each stage's slice of the
+// weights is moved to its node, so every stage streams its layers from local memory.
+// the final rmsnorm and the classifier run on the caller, over the whole batch. the
+// results are the same bits as with one stage. a profiled forward runs on one stage,
+// so its per op timings stay meaningful, and --profile refuses the stages that aren't
+// threads here. a stage after the first can also be a process on another host (see
+// stage mode), reached over TCP: its thread here sends it every micro-batch as soon
+// as the stage before is done with it, and a second thread takes the rows it sends
+// back, so the next micro-batch is on the wire while the stage runs the one before, e.g.
+//   ./main -m model.bin -M ppl --ngl 16              # layers 0..15, then the rest
+//   ./main -m model.bin -M batch --ngl 8,8,8 --micro-batch 32
+//   ./main -m model.bin -M server --ngl 16 --stages host2:9000
+
+#define PIPE_MAX_STAGES 16
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1        // mbind() modes, from <numaif.h>
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+#define STAGE_MAGIC 0x6c327073 // "l2ps", first of the hello of a head to a remote stage
+
+// what a head sends a remote stage once, native byte order: the hosts are alike
+typedef struct {
+    int magic;
+    Config config;      // of the head, the stage checks its checkpoint against it
+    int l0, l1;         // layers of the stage
+    int micro_batch;    // tokens of a micro-batch at most
+    int kv_blocks;      // of the kv cache of the head, mirrored for the layers of the stage
+    int swap_blocks;
+    int quant;          // the head runs int8 layer matrices, so must the stage
+} StageHello;
+
+// and then for every micro-batch, followed by n_log kv cache copies to replay first (see
+// kv_log()), n_meta ints of block tables and positions (see send_micro_batch()), and the
+// rows of the residual stream. the stage answers with n_tokens and the rows. 0 tokens stop it
+typedef struct {
+    int n_tokens;
+    int n_tables;
+    int n_log;
+    int n_meta;
+} StageHeader;
+
+typedef struct {
+    Pipeline *pipe;
+    int l0, l1;         // layers [l0, l1) of the model
+    int op0, op1;       // their ops in the plan, stage 0 also embeds the tokens
+    Transformer t;      // the plan of the stage, over activations for one micro-batch and the kv cache of the pipeline
+    int node;           // NUMA node it runs on, -1 for any
+    int threads;        // OpenMP threads of its kernels
+    int done;           // micro-batches of the batch in flight it has finished
+    pthread_t thread;
+    // a remote stage: the socket to it, the thread that reads its answers, and the block
+    // tables and positions of a micro-batch as they are sent
+    int fd;             // -1 for a stage run by thread here
+    pthread_t reader;
+    int *meta;
+    int max_meta;
+} PipeStage;
+
+struct Pipeline {
+    Transformer *transformer;   // whose batches go through the stages
+    PipeStage stages[PIPE_MAX_STAGES];
+    int n_stages;
+    int micro_batch;    // tokens per micro-batch
+    int final_op;       // the ops from here on run on the caller, over the whole batch
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // broadcast on every change of what follows
+    Batch *batch;       // in flight
+    long generation;    // batches started
+    int stop;
+};
+
+int pipeline_micro_batch(int max_batch, int n_stages, int micro_batch) {
+    // tokens per micro-batch, <= 0 splits a full batch into two per stage
+    if (micro_batch <= 0) { micro_batch = (max_batch + 2 * n_stages - 1) / (2 * n_stages); }
+    return micro_batch < max_batch ? micro_batch : max_batch;
+}
+
+int numa_nodes() {
+    // nodes of the host, 1 without NUMA
+    int n = 0;
+    char path[64];
+    for (;; n++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+        if (access(path, F_OK) != 0) { break; }
+    }
+    return n > 0 ? n : 1;
+}
+
+int node_cpus(int node, cpu_set_t *set) {
+    // the CPUs of a node into set, returns how many
+    char path[64], list[4096];
+    CPU_ZERO(set);
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) { return 0; }
+    int n = 0;
+    if (fgets(list, sizeof(list), file) != NULL) {
+        // e.g. "0-15,32-47"
+        char *p = list;
+        while (*p >= '0' && *p <= '9') {
+            int lo = (int)strtol(p, &p, 10), hi = lo;
+            if (*p == '-') { hi = (int)strtol(p + 1, &p, 10); }
+            for (int c = lo; c <= hi && c < CPU_SETSIZE; c++) { CPU_SET(c, set); n++; }
+            if (*p == ',') { p++; }
+        }
+    }
+    fclose(file);
+    return n;
+}
+
+void move_to_node(const void *ptr, size_t bytes, int node) {
+    // the pages of [ptr, ptr + bytes) to node, best effort: pages mapped by other processes stay
+    if (node < 0 || node >= (int)(8 * sizeof(unsigned long))) { return; }
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)ptr & ~(page - 1);
+    uintptr_t end = ((uintptr_t)ptr + bytes + page - 1) & ~(page - 1);
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &mask, 8 * sizeof(mask), MPOL_MF_MOVE);
+}
+
+void stage_weights_to_node(PipeStage *st) {
+    // the matrices and rmsnorm weights of the layers of the stage, whichever layout they are in
+    const Model *m = st->t.model;
+    PackedWeights row_major = row_major_weights(m);
+    const PackedWeights *w = packed_layer(&m->packed, st->l0, m->config.n_layers) ? &m->packed : &row_major;
+    float *mats[PANEL_MATS - 1] = {w->wq, w->wk, w->wv, w->wo, w->w1, w->w2, w->w3};
+    int ns[PANEL_MATS], ds[PANEL_MATS];
+    size_t offset[PANEL_MATS];
+    panel_layout(&m->config, st->l0, st->l1, ns, ds, offset);
+    size_t layers = st->l1 - st->l0;
+    for (int i = 0; i < PANEL_MATS - 1; i++) {
+        size_t floats = panel_floats(ns[i], ds[i], w->rows);
+        move_to_node(mats[i] + (st->l0 - w->l0) * floats, layers * floats * sizeof(float), st->node);
+    }
+    int dim = m->config.dim;
+    move_to_node(m->weights.rms_att_weight + (size_t)st->l0 * dim, layers * dim * sizeof(float), st->node);
+    move_to_node(m->weights.rms_ffn_weight + (size_t)st->l0 * dim, layers * dim * sizeof(float), st->node);
+}
+
+int send_all(int fd, const void *buf, size_t bytes, int more) {
+    // returns -1 if the peer is gone. more: the next send follows at once, don't push this one yet
+    const char *p = (const char *)buf;
+    while (bytes > 0) {
+        ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return -1; }
+        p += n;
+        bytes -= n;
+    }
+    return 0;
+}
+
+int recv_all(int fd, void *buf, size_t bytes) {
+    // returns -1 if the peer is gone before all of it came
+    char *p = (char *)buf;
+    while (bytes > 0) {
+        ssize_t n = recv(fd, p, bytes, 0);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return -1; }
+        p += n;
+        bytes -= n;
+    }
+    return 0;
+}
+
+int connect_to(const char *address) {
+    // address is <host>:<port>, returns the socket with Nagle off or -1
+    char host[256];
+    const char *port = strrchr(address, ':');
+    if (port == NULL) { return -1; }
+    snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port + 1, &hints, &res) != 0) { return -1; }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    int one = 1;
+    if (fd >= 0) { setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); }
+    return fd;
+}
+
+int send_micro_batch(PipeStage *st, const Batch *micro, const float *x, int first) {
+    // the tokens of a micro-batch to a remote stage: their block tables, each once and only
+    // as far as the last position of the micro-batch in it, then the position and the table
+    // of every token, then their rows of x. the first micro-batch of a batch also carries the
+    // kv cache copies since the last one
+    int n = micro->n_tokens;
+    int *tables = st->meta + st->max_meta - 3 * n; // first token of each table, its length in blocks
+    int *length = tables + n;
+    int *index = length + n;    // and the table of each token
+    int n_tables = 0;
+    for (int b = 0; b < n; b++) {
+        int t = n_tables - 1; // tokens of a sequence are next to each other, try the last table first
+        while (t >= 0 && micro->blocks[tables[t]] != micro->blocks[b]) { t--; }
+        if (t < 0) {
+            t = n_tables++;
+            tables[t] = b;
+            length[t] = 0;
+        }
+        int blocks = micro->pos[b] / KV_BLOCK_SIZE + 1;
+        if (blocks > length[t]) { length[t] = blocks; }
+        index[b] = t;
+    }
+    int *meta = st->meta, n_meta = 0;
+    for (int t = 0; t < n_tables; t++) {
+        meta[n_meta++] = length[t];
+        memcpy(meta + n_meta, micro->blocks[tables[t]], length[t] * sizeof(int));
+        n_meta += length[t];
+    }
+    for (int b = 0; b < n; b++) { meta[n_meta++] = micro->pos[b]; }
+    for (int b = 0; b < n; b++) { meta[n_meta++] = index[b]; }
+    KVCache *kv = &st->pipe->transformer->state.kv;
+    StageHeader header = {n, n_tables, first ? kv->n_log : 0, n_meta};
+    size_t dim = st->t.config.dim;
+    if (send_all(st->fd, &header, sizeof(header), 1) != 0) { return -1; }
+    if (send_all(st->fd, kv->log, header.n_log * 3 * sizeof(int), 1) != 0) { return -1; }
+    if (send_all(st->fd, meta, n_meta * sizeof(int), 1) != 0) { return -1; }
+    return send_all(st->fd, x, n * dim * sizeof(float), 0);
+}
+
+void *stage_loop(void *arg) {
+    PipeStage *st = (PipeStage *)arg;
+    Pipeline *pipe = st->pipe;
+    char name[32];
+    snprintf(name, sizeof(name), "stage %d", (int)(st - pipe->stages));
+    trace_thread_name(name);
+    if (st->node >= 0) {
+        cpu_set_t set;
+        if (node_cpus(st->node, &set) > 0) { pthread_setaffinity_np(pthread_self(), sizeof(set), &set); }
+        stage_weights_to_node(st);
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(st->threads);
+#endif
+    RunState *s = &pipe->transformer->state;
+    RunState *own = &st->t.state;
+    const Backend *backend = st->t.backend;
+    const PlanOp *ops = st->t.plan.ops;
+    size_t dim = st->t.config.dim;
+    long generation = 0;
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        while (!pipe->stop && pipe->generation == generation) { pthread_cond_wait(&pipe->cond, &pipe->lock); }
+        if (pipe->stop) { break; }
+        generation = pipe->generation;
+        Batch *batch = pipe->batch;
+        for (int r0 = 0, m = 0; r0 < batch->n_tokens; r0 += pipe->micro_batch, m++) {
+            // the stage before is done with it
+            while (st > pipe->stages && st[-1].done <= m) { pthread_cond_wait(&pipe->cond, &pipe->lock); }
+            pthread_mutex_unlock(&pipe->lock);
+            long trace_start = trace_begin();
+            Batch micro = *batch;
+            micro.n_tokens = batch->n_tokens - r0 < pipe->micro_batch ? batch->n_tokens - r0 : pipe->micro_batch;
+            micro.token += r0;
+            micro.pos += r0;
+            micro.blocks += r0;
+            micro.logits_row += r0;
+            micro.score_row += r0;
+            if (st->fd >= 0) {
+                // off to the remote stage, its reader takes the rows back and counts it done
+                if (send_micro_batch(st, &micro, s->x + r0 * dim, m == 0) != 0) {
+                    fprintf(stderr, "pipeline: lost the stage of layers %d-%d\n", st->l0, st->l1 - 1);
+                    exit(EXIT_FAILURE);
+                }
+                trace_end("send", trace_start, NULL, 0);
+                pthread_mutex_lock(&pipe->lock);
+                continue;
+            }
+            // its rows of the residual stream in, through the layers of the stage, and out again
+            if (st->op0 > 0) { backend->copy(own->x, s->x + r0 * dim, micro.n_tokens * dim * sizeof(float)); }
+            for (int i = st->op0; i < st->op1; i++) { ops[i].run(ops + i, own, &micro); }
+            backend->copy(s->x + r0 * dim, own->x, micro.n_tokens * dim * sizeof(float));
+            trace_end("stage", trace_start, NULL, 0);
+            pthread_mutex_lock(&pipe->lock);
+            st->done = m + 1;
+            pthread_cond_broadcast(&pipe->cond);
+        }
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    if (st->fd >= 0) {
+        // tell the remote stage, it hangs up and so ends the reader
+        StageHeader stop = {0, 0, 0, 0};
+        send_all(st->fd, &stop, sizeof(stop), 0);
+    }
+    return NULL;
+}
+
+void *stage_reader(void *arg) {
+    // the rows a remote stage sends back, each micro-batch into its place in x
+    PipeStage *st = (PipeStage *)arg;
+    Pipeline *pipe = st->pipe;
+    float *x = pipe->transformer->state.x;
+    size_t dim = st->t.config.dim;
+    int n;
+    while (recv_all(st->fd, &n, sizeof(n)) == 0) {
+        pthread_mutex_lock(&pipe->lock);
+        int m = st->done;
+        pthread_mutex_unlock(&pipe->lock);
+        // the rows of micro-batch m are the stage's until it's done, nothing else touches them
+        if (recv_all(st->fd, x + (size_t)m * pipe->micro_batch * dim, n * dim * sizeof(float)) != 0) { break; }
+        pthread_mutex_lock(&pipe->lock);
+        st->done = m + 1;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+    pthread_mutex_lock(&pipe->lock);
+    int stopped = pipe->stop;
+    pthread_mutex_unlock(&pipe->lock);
+    if (!stopped) {
+        fprintf(stderr, "pipeline: lost the stage of layers %d-%d\n", st->l0, st->l1 - 1);
+        exit(EXIT_FAILURE);
+    }
+    return NULL;
+}
+
+void connect_stage(PipeStage *st, const char *address) {
+    // the remote stage at address, told its layers and the sizes of what it is sent
+    const Transformer *t = st->pipe->transformer;
+    st->fd = connect_to(address);
+    StageHello hello = {STAGE_MAGIC, t->config, st->l0, st->l1, st->pipe->micro_batch, t->state.kv.n_blocks, t->state.kv.n_swap_blocks,
+                         t->model->quant.map != NULL};
+    int ok = 0;
+    if (st->fd < 0 || send_all(st->fd, &hello, sizeof(hello), 0) != 0 || recv_all(st->fd, &ok, sizeof(ok)) != 0 || !ok) {
+        fprintf(stderr, "\npipeline: no stage for layers %d-%d at %s%s\n", st->l0, st->l1 - 1, address,
+                st->fd >= 0 ? ", or it has another checkpoint or --quant" : "");
+        exit(EXIT_FAILURE);
+    }
+    int max_blocks = (t->config.max_seq_len + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+    st->max_meta = st->pipe->micro_batch * (max_blocks + 6);
+    st->meta = (int *)malloc(st->max_meta * sizeof(int));
+    // the copies of the kv cache since the last batch go to the stage with the next one
+    KVCache *kv = &st->pipe->transformer->state.kv;
+    if (kv->log == NULL) {
+        kv->max_log = 64;
+        kv->log = (int *)malloc(kv->max_log * 3 * sizeof(int));
+    }
+}
+
+void build_pipeline(Pipeline *pipe, Transformer *t, const int *layers, int n, int micro_batch, char **remote) {
+    // layers: the layers of every stage but the last, which takes the rest. remote: NULL, or the
+    // address of every stage but the first, NULL for one run by a thread here
+    int n_layers = t->config.n_layers;
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        if (layers[i] < 1) { fprintf(stderr, "--ngl: every stage needs at least one layer\n"); exit(EXIT_FAILURE); }
+        total += layers[i];
+    }
+    if (total >= n_layers || n + 1 > PIPE_MAX_STAGES) {
+        fprintf(stderr, "--ngl: %d layers go to the first stages, the last needs one of the %d, in at most %d stages\n", total, n_layers, PIPE_MAX_STAGES);
+        exit(EXIT_FAILURE);
+    }
+    pipe->transformer = t;
+    pipe->n_stages = n + 1;
+    pipe->micro_batch = pipeline_micro_batch(t->state.max_batch, pipe->n_stages, micro_batch);
+    pipe->final_op = first_op_of(&t->plan, n_layers);
+    pipe->batch = NULL;
+    pipe->generation = 0;
+    pipe->stop = 0;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    // consecutive stages share a node, the threads of a node are split between its stages
+    int nodes = numa_nodes();
+    fprintf(stderr, "pipeline: %d stages, micro-batches of %d tokens:", pipe->n_stages, pipe->micro_batch);
+    for (int i = 0, l0 = 0; i < pipe->n_stages; i++) {
+        PipeStage *st = &pipe->stages[i];
+        st->pipe = pipe;
+        st->l0 = l0;
+        st->l1 = i < n ? l0 + layers[i] : n_layers;
+        l0 = st->l1;
+        st->node = nodes > 1 ? i * nodes / pipe->n_stages : -1;
+        int sharing = 0;
+        for (int j = 0; j < pipe->n_stages; j++) { sharing += (nodes > 1 ? j * nodes / pipe->n_stages : -1) == st->node; }
+        cpu_set_t set;
+        int cpus = st->node >= 0 ? node_cpus(st->node, &set) : max_threads();
+        st->threads = cpus / sharing > 0 ? cpus / sharing : 1;
+        st->done = 0;
+        st->fd = -1;
+        if (i > 0 && remote != NULL && remote[i - 1] != NULL) {
+            st->t = *t;
+            st->node = -1;
+            connect_stage(st, remote[i - 1]);
+            fprintf(stderr, " layers %d-%d at %s", st->l0, st->l1 - 1, remote[i - 1]);
+            pthread_create(&st->thread, NULL, stage_loop, st);
+            pthread_create(&st->reader, NULL, stage_reader, st);
+            continue;
+        }
+        // a context of its own over the model: the plan, over activations for one micro-batch
+        st->t = *t;
+        st->t.profiler = NULL;
+        st->t.pipeline = NULL;
+        st->t.tp = NULL;
+        alloc_activations(&st->t.state, st->t.config, pipe->micro_batch, 1, t->backend);
+        st->t.state.kv = t->state.kv;
+        build_plan(&st->t);
+        st->op0 = i == 0 ? 0 : first_op_of(&st->t.plan, st->l0);
+        st->op1 = first_op_of(&st->t.plan, st->l1);
+        if (st->node >= 0) { fprintf(stderr, " layers %d-%d on node %d (%d threads)", st->l0, st->l1 - 1, st->node, st->threads); }
+        else { fprintf(stderr, " layers %d-%d (%d threads)", st->l0, st->l1 - 1, st->threads); }
+        pthread_create(&st->thread, NULL, stage_loop, st);
+    }
+    fprintf(stderr, "\n");
+}
+
+int local_layers(const int *layers, int n, char **remote) {
+    // of the layers of a pipeline as in build_pipeline(), the ones this process runs: the first
+    // stage's and on up to the last stage run by a thread here. 0 for all of them
+    int local = 0;
+    for (int i = 0, l1 = 0; i <= n; i++) {
+        l1 = i < n ? l1 + layers[i] : 0;
+        if (i == 0 || remote == NULL || remote[i - 1] == NULL) { local = l1; }
+    }
+    return local;
+}
+
+void free_pipeline(Pipeline *pipe) {
+    pthread_mutex_lock(&pipe->lock);
+    pipe->stop = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    for (int i = 0; i < pipe->n_stages; i++) {
+        PipeStage *st = &pipe->stages[i];
+        pthread_join(st->thread, NULL);
+        if (st->fd >= 0) {
+            pthread_join(st->reader, NULL);
+            close(st->fd);
+            free(st->meta);
+            continue;
+        }
+        // the kv cache is the transformer's
+        st->t.backend->free(st->t.state.arena);
+        free(st->t.plan.ops);
+    }
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->cond);
+    pipe->transformer->pipeline = NULL;
+}
+
+void pipeline_forward(Transformer *t, Batch *batch) {
+    // the layers on the stages, then the final rmsnorm and the classifier here
+    Pipeline *pipe = t->pipeline;
+    int n_micro = (batch->n_tokens + pipe->micro_batch - 1) / pipe->micro_batch;
+    PipeStage *last = &pipe->stages[pipe->n_stages - 1];
+    pthread_mutex_lock(&pipe->lock);
+    for (int i = 0; i < pipe->n_stages; i++) { pipe->stages[i].done = 0; }
+    pipe->batch = batch;
+    pipe->generation++;
+    pthread_cond_broadcast(&pipe->cond);
+    while (last->done < n_micro) { pthread_cond_wait(&pipe->cond, &pipe->lock); }
+    pipe->batch = NULL;
+    pthread_mutex_unlock(&pipe->lock);
+    // every remote stage has them by now
+    t->state.kv.n_log = 0;
+    ExecPlan *plan = &t->plan;
+    for (int i = pipe->final_op; i < plan->n_ops; i++) { plan->ops[i].run(plan->ops + i, &t->state, batch); }
+}
+
+// ----------------------------------------------------------------------------
+// tensor parallel: the heads of attention and the hidden columns of the ffn split
+// over P ranks. rank 0 is this process and the other ranks are fork()ed workers.
+// each rank computes q, k and v for its own heads and attends over them, then
+// w1 and w3 for its own hidden columns. so it reads only its rows of wq, wk, wv,
+// w1 and w3, and its columns of wo and w2 are copied once into its own memory.
+// after wo and after w2 every rank holds a partial sum of the residual update, and
+// an all-reduce over shared memory adds them up: each rank writes its partial,
+// sums one slice of all the partials in rank order (so the sum never depends on
+// timing), then adds all the slices into its own copy of x. a spin barrier sits
+// between the steps. the kv cache lives in the same mapping, and each rank writes
+// the positions of its own kv heads. rank 0 also runs the scheduler and the
+// classifier. on a NUMA host the ranks are pinned to nodes like pipeline stages.
+// the matmuls sum over slices on different ranks, so results match one rank up to
+// rounding. --profile would time only the unsharded plan of rank 0, so it refuses --tp, e.g.
+//   ./main -m llama2-7b.bin -M server --tp 4
+
+#define TP_MAX_RANKS 16
+
+typedef struct {
+    // written by several ranks, each on a cache line of its own and through atomics
+    long generation;    // batches started by rank 0
+    char pad0[56];
+    int arrived;        // ranks at the barrier
+    char pad1[60];
+    int sense;          // flipped by the last one to arrive
+    char pad2[60];
+    int stop;
+    int n_tokens;       // of the batch in flight
+    KernelTuning tuning; // of rank 0, for the workers
+} TPControl;
+
+struct TensorParallel {
+    int rank, n_ranks;
+    TPControl *control; // at the start of the shared mapping, the rest is carved after it
+    size_t map_bytes;
+    int *token;         // (max_batch,) of the batch in flight
+    int *pos;           // (max_batch,)
+    int *tables;        // (max_batch, max_blocks) the block table of every token
+    float *partial;     // (n_ranks, max_batch, dim) partial sums of the all-reduce
+    float *sum;         // (max_batch, dim) and what they add up to
+    int max_batch, max_blocks;
+    Transformer t;      // the rank's plan over its shard, its activations and its view of the kv cache
+    float *wo, *w2;     // (layer, dim, its columns) of wo and w2
+    int node, threads;
+    int sense;          // of the last barrier it went through
+    pid_t workers[TP_MAX_RANKS]; // on rank 0, the other ranks
+};
+
+void tp_pause(int *spins) {
+    // a rank waits microseconds inside a forward and anything up to forever for the next
+    // batch: spin first, then yield the CPU, then sleep
+    (*spins)++;
+    if (*spins < 1000) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    else if (*spins < 2000) { sched_yield(); }
+    else { usleep(50); }
+}
+
+void tp_barrier(TensorParallel *tp) {
+    // sense reversing: the last rank in resets the count and flips the sense the others spin on
+    TPControl *c = tp->control;
+    tp->sense = !tp->sense;
+    if (__atomic_add_fetch(&c->arrived, 1, __ATOMIC_ACQ_REL) == tp->n_ranks) {
+        __atomic_store_n(&c->arrived, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->sense, tp->sense, __ATOMIC_RELEASE);
+        return;
+    }
+    int spins = 0;
+    while (__atomic_load_n(&c->sense, __ATOMIC_ACQUIRE) != tp->sense) { tp_pause(&spins); }
+}
+
+void op_allreduce(const PlanOp *op, RunState *s, Batch *batch) {
+    // out += the sum over the ranks of in
+    TensorParallel *tp = (TensorParallel *)op->ctx;
+    size_t n = (size_t)batch->n_tokens * op->d;
+    size_t stride = (size_t)tp->max_batch * op->d;
+    memcpy(tp->partial + tp->rank * stride, op->in, n * sizeof(float));
+    tp_barrier(tp);
+    size_t lo = n * tp->rank / tp->n_ranks;
+    size_t hi = n * (tp->rank + 1) / tp->n_ranks;
+    for (size_t i = lo; i < hi; i++) {
+        float sum = 0.0f;
+        for (int r = 0; r < tp->n_ranks; r++) { sum += tp->partial[r * stride + i]; }
+        tp->sum[i] = sum;
+    }
+    tp_barrier(tp);
+    op->backend->residual(op->out, tp->sum, n);
+}
+
+void build_tp_plan(TensorParallel *tp) {
+    // build_plan() for the shard of the rank, with an all-reduce in place of each residual
+    Transformer *t = &tp->t;
+    Config *p = &t->config;
+    const TransformerWeights *w = &t->model->weights;
+    RunState *s = &t->state;
+    ExecPlan *plan = &t->plan;
+    int dim = p->dim;
+    int head_size = dim / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads;
+    size_t kv_dim = (size_t)p->n_kv_heads * head_size;
+    size_t hidden_dim = p->hidden_dim;
+    // the heads and hidden columns of the rank
+    int heads = p->n_heads / tp->n_ranks;
+    int q_dim = heads * head_size;
+    int kv_slice = q_dim / kv_mul;
+    size_t q0 = (size_t)tp->rank * q_dim;
+    size_t k0 = (size_t)tp->rank * kv_slice;
+    size_t c0 = hidden_dim * tp->rank / tp->n_ranks;
+    int hidden = (int)(hidden_dim * (tp->rank + 1) / tp->n_ranks - c0);
+    plan->ops = (PlanOp *)malloc((14 * (size_t)p->n_layers + 1) * sizeof(PlanOp));
+    if (!plan->ops) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    plan->n_ops = 0;
+    plan->backend = t->backend;
+    plan_op(plan, op_embed, p->n_layers, -1, w->token_embedding_table, NULL, s->x, 0, dim);
+    for (size_t l = 0; l < (size_t)p->n_layers; l++) {
+        plan_op(plan, op_rmsnorm, l, -1, w->rms_att_weight + l*dim, s->x, s->xb, dim, dim);
+        plan_op(plan, op_matmul, l, -1, w->wq + (l*dim + q0) * dim, s->xb, s->q, dim, q_dim);
+        plan_op(plan, op_matmul, l, -1, w->wk + (l*kv_dim + k0) * dim, s->xb, s->k, dim, kv_slice);
+        plan_op(plan, op_matmul, l, -1, w->wv + (l*kv_dim + k0) * dim, s->xb, s->v, dim, kv_slice);
+        size_t loff = l * KV_BLOCK_SIZE * kv_dim;
+        PlanOp *op = plan_op(plan, op_rope_kv, l, -1, NULL, NULL, NULL, kv_slice, q_dim);
+        op->head_size = head_size;
+        op->loff = loff;
+        op = plan_op(plan, op_attention, l, -1, NULL, s->q, s->xb, 0, q_dim);
+        op->n_heads = heads;
+        op->kv_mul = kv_mul;
+        op->head_size = head_size;
+        op->loff = loff;
+        plan_op(plan, op_matmul, l, -1, tp->wo + l*dim*q_dim, s->xb, s->xb2, q_dim, dim);
+        op = plan_op(plan, op_allreduce, l, -1, NULL, s->xb2, s->x, 0, dim);
+        op->ctx = tp;
+        plan_op(plan, op_rmsnorm, l, -1, w->rms_ffn_weight + l*dim, s->x, s->xb, dim, dim);
+        plan_op(plan, op_matmul, l, -1, w->w1 + (l*hidden_dim + c0) * dim, s->xb, s->hb, dim, hidden);
+        plan_op(plan, op_matmul, l, -1, w->w3 + (l*hidden_dim + c0) * dim, s->xb, s->hb2, dim, hidden);
+        plan_op(plan, op_swiglu, l, -1, NULL, s->hb, s->hb2, 0, hidden);
+        plan_op(plan, op_matmul, l, -1, tp->w2 + l*dim*hidden, s->hb, s->xb, hidden, dim);
+        op = plan_op(plan, op_allreduce, l, -1, NULL, s->xb, s->x, 0, dim);
+        op->ctx = tp;
+    }
+    // the shards are row major
+    for (int i = 0; i < plan->n_ops; i++) {
+        PlanOp *op = plan->ops + i;
+        if (op->run == op_matmul) { op->matmul = backend_matmul(op->backend, op->n); }
+        else if (op->run == op_rmsnorm) { op->rmsnorm = backend_rmsnorm(op->backend, op->d); }
+        else if (op->run == op_attention) { op->attention = backend_attention(op->backend, op->head_size); }
+    }
+}
+
+float *tp_columns(const float *w, int n_layers, int d, int n, size_t c0, int cols) {
+    // columns [c0, c0 + cols) of every (d, n) layer of w, into memory of the rank
+    float *out = (float *)malloc((size_t)n_layers * d * cols * sizeof(float));
+    if (!out) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t row = 0; row < (size_t)n_layers * d; row++) {
+        memcpy(out + row * cols, w + row * n + c0, cols * sizeof(float));
+    }
+    return out;
+}
+
+void tp_rank(TensorParallel *tp, Transformer *t) {
+    // sets up the rank of tp, in its own process: its CPUs, its shard and its plan
+    if (tp->node >= 0) {
+        cpu_set_t set;
+        if (node_cpus(tp->node, &set) > 0) { sched_setaffinity(0, sizeof(set), &set); }
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(tp->threads);
+#endif
+    tp->sense = 0;
+    tp->t = *t;
+    tp->t.profiler = NULL;
+    tp->t.pipeline = NULL;
+    tp->t.tp = NULL;
+    Config *p = &t->config;
+    int q_dim = p->dim / tp->n_ranks;
+    int kv_slice = q_dim * p->n_kv_heads / p->n_heads;
+    size_t c0 = (size_t)p->hidden_dim * tp->rank / tp->n_ranks;
+    int hidden = (int)((size_t)p->hidden_dim * (tp->rank + 1) / tp->n_ranks - c0);
+    // rank 0 forwards in the activations of the transformer, the classifier reads them after
+    if (tp->rank > 0) { alloc_activations(&tp->t.state, t->config, t->state.max_batch, 1, t->backend); }
+    // the kv heads of the rank, at their offset in every position of the shared cache
+    KVCache *kv = &tp->t.state.kv;
+    kv->key_pool += (size_t)tp->rank * kv_slice;
+    kv->value_pool += (size_t)tp->rank * kv_slice;
+    const TransformerWeights *w = &t->model->weights;
+    tp->wo = tp_columns(w->wo, p->n_layers, p->dim, p->dim, (size_t)tp->rank * q_dim, q_dim);
+    tp->w2 = tp_columns(w->w2, p->n_layers, p->dim, p->hidden_dim, c0, hidden);
+    if (tp->node >= 0) {
+        // and its rows of the others, where the page cache has them
+        for (size_t l = 0; l < (size_t)p->n_layers; l++) {
+            size_t kv_dim = (size_t)p->dim * p->n_kv_heads / p->n_heads;
+            move_to_node(w->wq + (l * p->dim + (size_t)tp->rank * q_dim) * p->dim, (size_t)q_dim * p->dim * sizeof(float), tp->node);
+            move_to_node(w->wk + (l * kv_dim + (size_t)tp->rank * kv_slice) * p->dim, (size_t)kv_slice * p->dim * sizeof(float), tp->node);
+            move_to_node(w->wv + (l * kv_dim + (size_t)tp->rank * kv_slice) * p->dim, (size_t)kv_slice * p->dim * sizeof(float), tp->node);
+            move_to_node(w->w1 + (l * p->hidden_dim + c0) * p->dim, (size_t)hidden * p->dim * sizeof(float), tp->node);
+            move_to_node(w->w3 + (l * p->hidden_dim + c0) * p->dim, (size_t)hidden * p->dim * sizeof(float), tp->node);
+        }
+    }
+    build_tp_plan(tp);
+}
+
+void tp_worker(TensorParallel *tp) {
+    // a worker rank: the layers of every batch rank 0 starts, until it stops
+    TPControl *c = tp->control;
+    int **blocks = (int **)malloc(tp->max_batch * sizeof(int *));
+    for (int b = 0; b < tp->max_batch; b++) { blocks[b] = tp->tables + (size_t)b * tp->max_blocks; }
+    Batch batch;
+    memset(&batch, 0, sizeof(Batch));
+    batch.token = tp->token;
+    batch.pos = tp->pos;
+    batch.blocks = blocks;
+    ExecPlan *plan = &tp->t.plan;
+    long generation = 0;
+    for (;;) {
+        int spins = 0;
+        while (__atomic_load_n(&c->generation, __ATOMIC_ACQUIRE) == generation && !__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) {
+            tp_pause(&spins);
+        }
+        if (__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) { break; }
+        generation++;
+        tuning = c->tuning;
+        batch.n_tokens = c->n_tokens;
+        for (int i = 0; i < plan->n_ops; i++) { plan->ops[i].run(plan->ops + i, &tp->t.state, &batch); }
+    }
+    free(blocks);
+}
+
+void build_tensor_parallel(TensorParallel *tp, Transformer *t, int n_ranks) {
+    // forks the workers, before anything in this process runs OpenMP: a child can't use the
+    // thread pool of its parent. the kv cache of t moves into the shared mapping
+    Config *p = &t->config;
+    if (n_ranks > TP_MAX_RANKS || p->n_kv_heads % n_ranks != 0) {
+        fprintf(stderr, "--tp: %d ranks don't split the %d kv heads evenly, or are more than %d\n", n_ranks, p->n_kv_heads, TP_MAX_RANKS);
+        exit(EXIT_FAILURE);
+    }
+    tp->n_ranks = n_ranks;
+    tp->max_batch = t->state.max_batch;
+    tp->max_blocks = (p->max_seq_len + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+    KVCache *kv = &t->state.kv;
+    size_t pool_bytes = (size_t)kv->n_blocks * kv->block_floats * sizeof(float);
+    size_t batch_bytes = (size_t)tp->max_batch * (2 + tp->max_blocks) * sizeof(int);
+    size_t reduce_bytes = (size_t)(n_ranks + 1) * tp->max_batch * p->dim * sizeof(float);
+    size_t control_bytes = (sizeof(TPControl) + 63) & ~(size_t)63;
+    size_t pools_at = control_bytes + ((batch_bytes + reduce_bytes + 63) & ~(size_t)63);
+    tp->map_bytes = pools_at + 2 * pool_bytes;
+    char *map = (char *)mmap(NULL, tp->map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) { fprintf(stderr, "mmap of the tensor parallel memory failed\n"); exit(EXIT_FAILURE); }
+    tp->control = (TPControl *)map;
+    tp->partial = (float *)(map + control_bytes);
+    tp->sum = tp->partial + (size_t)n_ranks * tp->max_batch * p->dim;
+    tp->token = (int *)(tp->sum + (size_t)tp->max_batch * p->dim);
+    tp->pos = tp->token + tp->max_batch;
+    tp->tables = tp->pos + tp->max_batch;
+    kv->backend->free(kv->key_pool);
+    kv->backend->free(kv->value_pool);
+    kv->key_pool = (float *)(map + pools_at);
+    kv->value_pool = (float *)(map + pools_at + pool_bytes);
+    kv->shared = 1;
+
+    // consecutive ranks share a node, the threads of a node are split between its ranks
+    int nodes = numa_nodes();
+    int ranks_per_node = nodes > 1 ? (n_ranks + nodes - 1) / nodes : n_ranks;
+    fflush(stdout);
+    fflush(stderr);
+    for (int r = n_ranks - 1; r >= 0; r--) {
+        tp->rank = r;
+        tp->node = nodes > 1 ? r * nodes / n_ranks : -1;
+        cpu_set_t set;
+        int cpus = tp->node >= 0 ? node_cpus(tp->node, &set) : max_threads();
+        tp->threads = cpus / ranks_per_node > 0 ? cpus / ranks_per_node : 1;
+        if (r == 0) { break; }
+        pid_t pid = fork();
+        if (pid == -1) { fprintf(stderr, "--tp: fork failed\n"); exit(EXIT_FAILURE); }
+        if (pid == 0) {
+            // dies with rank 0, and leaves ^C to it: rank 0 stops the workers on its way out
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            signal(SIGINT, SIG_IGN);
+            signal(SIGTERM, SIG_IGN);
+            tp_rank(tp, t);
+            tp_worker(tp);
+            _exit(0);
+        }
+        tp->workers[r] = pid;
+    }
+    tp_rank(tp, t);
+    fprintf(stderr, "tensor parallel: %d ranks of %d heads and %d ffn columns, %d threads each%s\n", n_ranks,
+            p->n_heads / n_ranks, p->hidden_dim / n_ranks, tp->threads, nodes > 1 ? ", spread over the NUMA nodes" : "");
+}
+
+void free_tensor_parallel(TensorParallel *tp) {
+    // stops the workers, and unmaps the kv cache of the transformer along with the rest
+    __atomic_store_n(&tp->control->stop, 1, __ATOMIC_RELEASE);
+    for (int r = 1; r < tp->n_ranks; r++) { waitpid(tp->workers[r], NULL, 0); }
+    free(tp->wo);
+    free(tp->w2);
+    free(tp->t.plan.ops);
+    munmap(tp->control, tp->map_bytes);
+}
+
+void tp_forward(Transformer *t, Batch *batch) {
+    // the layers on every rank, then the final rmsnorm and the classifier here
+    TensorParallel *tp = t->tp;
+    TPControl *c = tp->control;
+    memcpy(tp->token, batch->token, batch->n_tokens * sizeof(int));
+    memcpy(tp->pos, batch->pos, batch->n_tokens * sizeof(int));
+    for (int b = 0; b < batch->n_tokens; b++) {
+        memcpy(tp->tables + (size_t)b * tp->max_blocks, batch->blocks[b], (batch->pos[b] / KV_BLOCK_SIZE + 1) * sizeof(int));
+    }
+    c->n_tokens = batch->n_tokens;
+    c->tuning = tuning;
+    __atomic_store_n(&c->generation, c->generation + 1, __ATOMIC_RELEASE);
+    ExecPlan *plan = &tp->t.plan;
+    for (int i = 0; i < plan->n_ops; i++) { plan->ops[i].run(plan->ops + i, &tp->t.state, batch); }
+    plan = &t->plan;
+    for (int i = first_op_of(plan, t->config.n_layers); i < plan->n_ops; i++) { plan->ops[i].run(plan->ops + i, &t->state, batch); }
+}
+
+// ----------------------------------------------------------------------------
+// scheduler: continuous batching of many sequences over the paged kv cache.
+// every step forwards one batch, capped at max_batch_tokens tokens: a decode token
+// for each running sequence, then prompts in chunks of at most prefill_chunk
+// tokens, so prefill and decode share the batched forward. sequences are
+// admitted by priority class, then deadline, then arrival, as long as the kv pool
+// has room for them. when it runs dry the least important running sequence is
+// preempted: its blocks are swapped to the swap tier if there is space, otherwise
+// they are dropped and the sequence is recomputed from its tokens when readmitted.
+// a sequence can fork: the copy shares its kv blocks by refcount and a shared
+// block is copied when either side next writes to it. n > 1 sampling forks the
+// siblings off at the first sampled token, after a single prefill of the prompt;
+// beam search keeps a group of forks decoding side by side in the same batch.
+// a scoring sequence samples nothing: it forwards its prompt (the context) once,
+// then forks once per continuation and each fork forwards its continuation,
+// getting only the log-probability of every next token instead of logits
+// ----------------------------------------------------------------------------
+
+typedef enum { SEQ_WAITING, SEQ_RUNNING, SEQ_SWAPPED, SEQ_FINISHED } SeqState;
+typedef enum { FINISH_NONE, FINISH_LENGTH, FINISH_STOP, FINISH_DEADLINE, FINISH_CANCELLED, FINISH_REJECTED } FinishReason;
+const char *finish_reason_names[] = { "none", "length", "stop", "deadline", "cancelled", "rejected" };
+
+typedef struct Sequence Sequence;
+typedef struct SeqPool SeqPool;
+
+typedef struct {
+    int width;              // beams kept alive
+    int n_live;
+    int n_pending;          // live beams whose candidates are in for this round
+    Sequence **live;        // (width,)
+    int *cand_token;        // (width, width) best next tokens of every live beam, by slot
+    float *cand_score;      // (width, width) their total log-probabilities
+    int *order;             // (width * width,) scratch for beam_resolve
+    int *uses;              // (width,)
+    int *picks;             // (width,)
+    Sequence **beams;       // (width,)
+    Sequence **targets;     // (width,)
+    int *best;              // tokens of the best finished hypothesis, (steps + 1,)
+    int n_best;             // 0 = none yet
+    float best_score;       // its log-probability per sampled token
+    FinishReason best_finish;
+    FinishReason abort;     // set when a deadline or cancellation ends the whole group
+} BeamGroup;
+
+typedef struct {
+    int n;
+    int **tokens;           // (n,) token ids of every continuation, no BOS
+    int *n_tokens;          // (n,)
+} Continuations;
+
+// called with every sampled token, and once more with token -1 after the sequence finished
+// (seq->finish says why, the callee owns seq from then on). a non-zero return cancels the sequence
+typedef int (*token_callback)(Sequence *seq, int token, void *ctx);
+
+struct Sequence {
+    int id;
+    int *tokens;        // prompt followed by the sampled tokens, (steps + 1,)
+    int n_tokens;       // tokens known so far
+    int n_prompt;       // prompt tokens, including BOS
+    int n_computed;     // tokens whose k/v are in the cache, i.e. the next position to forward
+    int steps;          // positions to forward before the sequence is done
+    int *blocks;        // kv block table (or swap slots while swapped), (ceil(steps / KV_BLOCK_SIZE),)
+    int n_blocks;
+    Sampler sampler;
+    int priority;       // priority class, 0 is the most important
+    long deadline;      // time_in_ms() by which the sequence has to be done, 0 = none
+    long arrival;       // time_in_ms() at submission
+    long first_token;   // time_in_ms() of the first sampled token
+    long last_token;    // time_in_ms() of the latest sampled token
+    long max_itl;       // largest gap between two sampled tokens, in ms
+    SeqState state;
+    FinishReason finish;
+    token_callback on_token;
+    void *ctx;
+    const int *cancel;  // optional flag owned by the consumer, set from another thread to drop the sequence
+    int n_forks;        // siblings forked off at the first sampled token, for n > 1 sampling
+    int index;          // which of its siblings this is, 0 for the original
+    BeamGroup *beam;    // beam search group, tokens aren't passed to on_token until the group is done
+    int slot;           // index in beam->live
+    float score;        // total log-probability of the sampled tokens, beam search only
+    int has_cand;       // beam search: the candidates of this beam are in
+    int ignore_stop;    // keep going past a sampled BOS, so bench mode always runs steps tokens
+    Continuations *conts; // scoring: the continuations to fork off once the context is in, NULL after that
+    float *logprobs;    // scoring: (steps + 1,) log-probability of tokens[i] given the ones before, NULL when sampling
+    float *logprob_buf; // where logprobs go when scoring, (max_seq_len + 1,)
+    SeqPool *pool;      // the pool the sequence goes back to when freed
+    Sequence *next;     // link in the scheduler queue the sequence is on, or in the free list of its pool
+};
+
+// per-sequence contexts, recycled: a Sequence with its tokens, block table and logprobs sized for
+// max_seq_len in one allocation. a freed one goes on the free list of its pool and the next new or
+// forked sequence takes it from there, so only the peak of sequences in flight hits the allocator
+struct SeqPool {
+    int max_seq_len;
+    size_t bytes;       // of one context
+    Sequence *free;
+    int n_free;
+    int n_contexts;     // allocated so far
+};
+
+typedef struct {
+    Transformer *transformer;
+    int max_batch_tokens;   // token budget per step, prefill and decode tokens together
+    int prefill_chunk;      // prompt tokens of one sequence per step
+    int max_running;        // sequences in the running set (bounded by the logits rows)
+    int max_waiting;        // submissions beyond this many queued sequences are refused
+    int watermark;          // free blocks kept back when admitting, so running sequences can grow
+    Sequence *waiting;      // queues are kept in priority order, see seq_before()
+    Sequence *swapped;
+    Sequence *running;      // the tail is the first to be preempted
+    int n_waiting;
+    int n_swapped;
+    int n_running;
+    int next_id;
+    Batch batch;            // the batch handed to forward_batch
+    Sequence **logits_seq;  // (max_logits,) sequence each logits row belongs to
+    Sequence **score_seq;   // (max_batch,) sequence each score row belongs to
+    int *score_pos;         // (max_batch,) and the position of its target token
+    float *logits_scratch;  // (vocab_size,) copy of a logits row for siblings sampling from it
+    SeqPool seqs;           // contexts of the sequences
+    long n_preempt_swap;
+    long n_preempt_recompute;
+} Scheduler;
+
+void build_seq_pool(SeqPool *p, int max_seq_len) {
+    p->max_seq_len = max_seq_len;
+    size_t positions = (size_t)max_seq_len + 1;
+    size_t blocks = (max_seq_len + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+    p->bytes = sizeof(Sequence) + positions * sizeof(int) + blocks * sizeof(int) + positions * sizeof(float);
+    p->free = NULL;
+    p->n_free = 0;
+    p->n_contexts = 0;
+}
+
+void free_seq_pool(SeqPool *p) {
+    // frees the contexts on the free list, the pool has to have all of them back by now
+    while (p->free != NULL) {
+        Sequence *seq = p->free;
+        p->free = seq->next;
+        free(seq);
+    }
+    p->n_free = 0;
+}
+
+Sequence *seq_context(SeqPool *p) {
+    // a context off the free list (or a new one), zeroed but for its arrays
+    Sequence *seq = p->free;
+    if (seq != NULL) {
+        p->free = seq->next;
+        p->n_free--;
+    } else {
+        seq = (Sequence *)malloc(p->bytes);
+        if (!seq) {
+            fprintf(stderr, "malloc failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        p->n_contexts++;
+    }
+    memset(seq, 0, sizeof(Sequence));
+    seq->pool = p;
+    seq->tokens = (int *)(seq + 1);
+    seq->blocks = seq->tokens + p->max_seq_len + 1;
+    seq->logprob_buf = (float *)(seq->blocks + (p->max_seq_len + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE);
+    return seq;
+}
+
+void build_scheduler(Scheduler *s, Transformer *t, int max_batch_tokens, int prefill_chunk, int max_running, int max_waiting) {
+    memset(s, 0, sizeof(Scheduler));
+    s->transformer = t;
+    s->max_batch_tokens = max_batch_tokens < t->state.max_batch ? max_batch_tokens : t->state.max_batch;
+    s->prefill_chunk = prefill_chunk > 0 ? prefill_chunk : s->max_batch_tokens;
+    s->max_running = max_running < t->state.max_logits ? max_running : t->state.max_logits;
+    s->max_waiting = max_waiting;
+    s->watermark = s->max_running > 1 ? s->max_running : 0;
+    int max_batch = t->state.max_batch;
+    s->batch.token = (int *)malloc(max_batch * sizeof(int));
+    s->batch.pos = (int *)malloc(max_batch * sizeof(int));
+    s->batch.blocks = (int **)malloc(max_batch * sizeof(int *));
+    s->batch.logits_row = (int *)malloc(max_batch * sizeof(int));
+    s->batch.score_row = (int *)malloc(max_batch * sizeof(int));
+    s->batch.target = (int *)malloc(max_batch * sizeof(int));
+    s->score_seq = (Sequence **)malloc(max_batch * sizeof(Sequence *));
+    s->score_pos = (int *)malloc(max_batch * sizeof(int));
+    s->logits_seq = (Sequence **)malloc(t->state.max_logits * sizeof(Sequence *));
+    s->logits_scratch = (float *)malloc(t->config.vocab_size * sizeof(float));
+    build_seq_pool(&s->seqs, t->config.max_seq_len);
+}
+
+void free_scheduler(Scheduler *s) {
+    free(s->batch.token);
+    free(s->batch.pos);
+    free(s->batch.blocks);
+    free(s->batch.logits_row);
+    free(s->batch.score_row);
+    free(s->batch.target);
+    free(s->logits_seq);
+    free(s->score_seq);
+    free(s->score_pos);
+    free(s->logits_scratch);
+    free_seq_pool(&s->seqs);
+}
+
+Sequence* new_sequence(Scheduler *s, int *prompt_tokens, int n_prompt, int steps, Sampler *sampler) {
+    // the Sequence takes a copy of the prompt; steps is clamped to max_seq_len
+    int max_seq_len = s->transformer->config.max_seq_len;
+    if (steps <= 0 || steps > max_seq_len) { steps = max_seq_len; }
+    if (n_prompt > steps) { n_prompt = steps; } // same as generate: positions beyond steps are never forwarded
+    Sequence *seq = seq_context(&s->seqs);
+    seq->id = s->next_id++;
+    seq->steps = steps;
+    memcpy(seq->tokens, prompt_tokens, n_prompt * sizeof(int));
+    seq->n_tokens = seq->n_prompt = n_prompt;
+    if (sampler != NULL) { seq->sampler = *sampler; } // NULL for a sequence that only scores
+    seq->priority = 1;
+    return seq;
+}
+
+void free_sequence(Sequence *seq) {
+    // back to its pool, for the next sequence
+    SeqPool *p = seq->pool;
+    seq->next = p->free;
+    p->free = seq;
+    p->n_free++;
+}
+
+int build_continuations(Continuations *c, Tokenizer *t, char **texts, int n) {
+    // tokenizes and frees texts, each on its own and without BOS so it starts a new word after the
+    // context. returns the token count of the longest one
+    int longest = 0;
+    c->n = n;
+    c->tokens = (int **)malloc(n * sizeof(int *));
+    c->n_tokens = (int *)malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        c->tokens[i] = (int *)malloc((strlen(texts[i]) + 3) * sizeof(int));
+        encode(t, texts[i], 0, 0, c->tokens[i], &c->n_tokens[i]);
+        if (c->n_tokens[i] > longest) { longest = c->n_tokens[i]; }
+        free(texts[i]);
+    }
+    free(texts);
+    return longest;
+}
+
+void free_continuations(Continuations *c) {
+    for (int i = 0; i < c->n; i++) { free(c->tokens[i]); }
+    free(c->tokens);
+    free(c->n_tokens);
+}
+
+int scoring_steps(int n_prompt, int longest) {
+    // positions forwarded for the longest continuation: the context, then all of it but its last
+    // token. never less than the context, new_sequence would cut it short
+    return n_prompt - 1 + (longest > 1 ? longest : 1);
+}
+
+void start_scoring(Sequence *seq, Continuations *c) {
+    // makes seq score the continuations of its prompt instead of sampling. the prompt but its last
+    // token is forwarded once, then every continuation is forked off and forwards that last token
+    // and its own tokens but the last, as no logits are needed past it. each fork finishes with
+    // logprobs filled in from n_prompt on and index saying which continuation it scored.
+    // steps has to cover the prompt and the longest continuation, c is read until then
+    seq->conts = c;
+    seq->n_forks = c->n - 1;
+    seq->n_tokens = seq->n_prompt - 1;
+    seq->logprobs = seq->logprob_buf;
+    memset(seq->logprobs, 0, (seq->steps + 1) * sizeof(float));
+}
+
+void score_prompt(Sequence *seq, int from) {
+    // makes seq score its own prompt from position from (>= 1) on instead of sampling: it forwards
+    // all of it but the last token and finishes with logprobs filled in from n_prompt = from on
+    seq->n_tokens = seq->n_prompt - 1;
+    seq->n_prompt = from;
+    seq->logprobs = seq->logprob_buf;
+    memset(seq->logprobs, 0, (seq->steps + 1) * sizeof(float));
+}
+
+void start_beam_search(Sequence *seq, int width) {
+    // makes seq the first beam of a group of width, its callback then only gets the best hypothesis
+    BeamGroup *g = (BeamGroup *)calloc(1, sizeof(BeamGroup));
+    g->width = width;
+    g->live = (Sequence **)malloc(width * sizeof(Sequence *));
+    g->cand_token = (int *)malloc(width * width * sizeof(int));
+    g->cand_score = (float *)malloc(width * width * sizeof(float));
+    g->order = (int *)malloc(width * width * sizeof(int));
+    g->uses = (int *)malloc(width * sizeof(int));
+    g->picks = (int *)malloc(width * sizeof(int));
+    g->beams = (Sequence **)malloc(width * sizeof(Sequence *));
+    g->targets = (Sequence **)malloc(width * sizeof(Sequence *));
+    g->best = (int *)malloc((seq->steps + 1) * sizeof(int));
+    g->live[0] = seq;
+    g->n_live = 1;
+    seq->beam = g;
+    seq->slot = 0;
+}
+
+void free_beam_group(BeamGroup *g) {
+    free(g->live);
+    free(g->cand_token);
+    free(g->cand_score);
+    free(g->order);
+    free(g->uses);
+    free(g->picks);
+    free(g->beams);
+    free(g->targets);
+    free(g->best);
+    free(g);
+}
+
+int seq_before(Sequence *a, Sequence *b) {
+    // queue order: priority class, then earliest deadline, then arrival
+    if (a->priority != b->priority) { return a->priority < b->priority; }
+    if (a->deadline != b->deadline) { return b->deadline == 0 || (a->deadline != 0 && a->deadline < b->deadline); }
+    if (a->arrival != b->arrival) { return a->arrival < b->arrival; }
+    return a->id < b->id;
+}
+
+void seq_insert(Sequence **list, Sequence *seq) {
+    while (*list != NULL && !seq_before(seq, *list)) { list = &(*list)->next; }
+    seq->next = *list;
+    *list = seq;
+}
+
+void seq_remove(Sequence **list, Sequence *seq) {
+    while (*list != seq) { list = &(*list)->next; }
+    *list = seq->next;
+    seq->next = NULL;
+}
+
+Sequence* seq_tail(Sequence *list) {
+    while (list != NULL && list->next != NULL) { list = list->next; }
+    return list;
+}
+
+int blocks_for(int n_positions) {
+    return (n_positions + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+}
+
+void seq_release_blocks(Scheduler *s, Sequence *seq) {
+    KVCache *kv = &s->transformer->state.kv;
+    for (int i = 0; i < seq->n_blocks; i++) {
+        if (seq->state == SEQ_SWAPPED) { kv->free_swap[kv->n_free_swap++] = seq->blocks[i]; }
+        else { kv_free_block(kv, seq->blocks[i]); }
+    }
+    seq->n_blocks = 0;
+}
+
+void seq_unlink(Scheduler *s, Sequence *seq) {
+    // takes seq off whichever queue it is on
+    if (seq->state == SEQ_WAITING) { seq_remove(&s->waiting, seq); s->n_waiting--; }
+    else if (seq->state == SEQ_SWAPPED) { seq_remove(&s->swapped, seq); s->n_swapped--; }
+    else if (seq->state == SEQ_RUNNING) { seq_remove(&s->running, seq); s->n_running--; }
+}
+
+Sequence* fork_sequence(Scheduler *s, Sequence *seq) {
+    // a copy of seq sharing its kv blocks, copy on write. it joins the running set next to seq when
+    // there is room, otherwise it waits to be recomputed from its tokens like a preempted sequence
+    KVCache *kv = &s->transformer->state.kv;
+    Sequence *child = seq_context(&s->seqs);
+    int *tokens = child->tokens, *blocks = child->blocks;
+    float *logprob_buf = child->logprob_buf;
+    *child = *seq;
+    child->id = s->next_id++;
+    child->tokens = tokens;
+    child->blocks = blocks;
+    child->logprob_buf = logprob_buf;
+    // a scoring context holds one token more than it forwards
+    memcpy(child->tokens, seq->tokens, (seq->n_tokens > seq->n_prompt ? seq->n_tokens : seq->n_prompt) * sizeof(int));
+    if (seq->logprobs != NULL) {
+        child->logprobs = logprob_buf;
+        memset(child->logprobs, 0, (seq->steps + 1) * sizeof(float));
+    }
+    child->n_forks = 0;
+    child->has_cand = 0;
+    child->next = NULL;
+    if (seq->state == SEQ_RUNNING && s->n_running < s->max_running) {
+        memcpy(child->blocks, seq->blocks, seq->n_blocks * sizeof(int));
+        for (int i = 0; i < seq->n_blocks; i++) { kv->refs[seq->blocks[i]]++; }
+        seq_insert(&s->running, child);
+        s->n_running++;
+    } else {
+        child->n_blocks = 0;
+        child->n_computed = 0;
+        child->state = SEQ_WAITING;
+        seq_insert(&s->waiting, child);
+        s->n_waiting++;
+    }
+    if (child->beam != NULL) {
+        child->slot = child->beam->n_live;
+        child->beam->live[child->beam->n_live++] = child;
+    }
+    trace_seq('b', "sequence", child->id, "forked_from", seq->id);
+    return child;
+}
+
+void beam_hypothesis(BeamGroup *g, Sequence *seq, float score, int n_sampled, FinishReason finish) {
+    // keeps the tokens of seq if they beat the best finished hypothesis, by log-probability per token
+    float normalized = score / (n_sampled > 0 ? n_sampled : 1);
+    if (g->n_best > 0 && normalized <= g->best_score) { return; }
+    memcpy(g->best, seq->tokens, seq->n_tokens * sizeof(int));
+    g->n_best = seq->n_tokens;
+    g->best_score = normalized;
+    g->best_finish = finish;
+}
+
+void beam_remove(Scheduler *s, Sequence *seq) {
+    // takes an unlinked beam out of its group. the last one to go reports the best hypothesis
+    BeamGroup *g = seq->beam;
+    trace_seq('e', "sequence", seq->id, "tokens", seq->n_tokens - seq->n_prompt);
+    if (seq->has_cand) { g->n_pending--; }
+    g->live[seq->slot] = g->live[--g->n_live];
+    g->live[seq->slot]->slot = seq->slot;
+    if (g->n_live > 0) { free_sequence(seq); return; }
+    if (g->n_best > 0) {
+        memcpy(seq->tokens, g->best, g->n_best * sizeof(int));
+        seq->n_tokens = g->n_best;
+        seq->finish = g->best_finish;
+    }
+    if (g->abort != FINISH_NONE) { seq->finish = g->abort; }
+    seq->beam = NULL;
+    free_beam_group(g);
+    seq->on_token(seq, -1, seq->ctx);
+}
+
+void finish_sequence(Scheduler *s, Sequence *seq, FinishReason reason) {
+    // siblings that were never forked off finish along with it, so each one still reports
+    for (; seq->n_forks > 0; seq->n_forks--) {
+        Sequence *child = fork_sequence(s, seq);
+        child->index = seq->n_forks;
+        child->conts = NULL;
+        finish_sequence(s, child, reason);
+    }
+    seq_unlink(s, seq);
+    seq_release_blocks(s, seq);
+    seq->state = SEQ_FINISHED;
+    seq->finish = reason;
+    if (seq->beam == NULL) {
+        trace_seq('e', "sequence", seq->id, "tokens", seq->n_tokens - seq->n_prompt);
+        seq->on_token(seq, -1, seq->ctx);
+        return;
+    }
+    BeamGroup *g = seq->beam;
+    if (reason == FINISH_LENGTH) {
+        beam_hypothesis(g, seq, seq->score, seq->n_tokens - seq->n_prompt, reason);
+    } else if (reason != FINISH_STOP) {
+        // a deadline or cancellation ends the whole group, seq goes last so it reports
+        g->abort = reason;
+        for (int i = g->n_live - 1; i >= 0; i--) {
+            Sequence *other = g->live[i];
+            if (other == seq) { continue; }
+            seq_unlink(s, other);
+            seq_release_blocks(s, other);
+            beam_remove(s, other);
+        }
+    }
+    beam_remove(s, seq);
+}
+
+int seq_fanout(Sequence *seq) {
+    // sequences seq may still fork off, each needs a running slot and a block to copy on write
+    return seq->n_forks + (seq->beam != NULL ? seq->beam->width - seq->beam->n_live : 0);
+}
+
+int scheduler_submit(Scheduler *s, Sequence *seq) {
+    // queues seq, or returns -1 (leaving seq to the caller) when it can never be served
+    // or the waiting queue is full, so overload turns into fast rejections instead of latency
+    if (s->n_waiting >= s->max_waiting) { return -1; }
+    if (blocks_for(seq->steps) > s->transformer->state.kv.n_blocks) { return -1; }
+    if (1 + seq_fanout(seq) > s->max_running) { return -1; }
+    // a beam group runs all at once, it has to fit even without any sharing left between the beams
+    if (seq->beam != NULL && seq->beam->width * blocks_for(seq->steps) > s->transformer->state.kv.n_blocks) { return -1; }
+    seq->arrival = time_in_ms();
+    seq->state = SEQ_WAITING;
+    seq_insert(&s->waiting, seq);
+    s->n_waiting++;
+    trace_seq('b', "sequence", seq->id, "prompt_tokens", seq->n_prompt);
+    return 0;
+}
+
+int scheduler_idle(Scheduler *s) {
+    return s->n_waiting + s->n_swapped + s->n_running == 0;
+}
+
+void recompute(Scheduler *s, Sequence *seq) {
+    // drops the kv blocks of a running sequence, it is forwarded again from its first token once readmitted
+    seq_remove(&s->running, seq);
+    s->n_running--;
+    seq_release_blocks(s, seq);
+    seq->n_computed = 0;
+    seq->state = SEQ_WAITING;
+    seq_insert(&s->waiting, seq);
+    s->n_waiting++;
+    s->n_preempt_recompute++;
+    trace_seq('n', "recompute", seq->id, NULL, 0);
+}
+
+void preempt_group(Scheduler *s, BeamGroup *g) {
+    // beams are preempted and admitted as a whole group, a group only advances with every beam
+    // running. they are always recomputed, a partly swapped group could never be brought back
+    for (int i = 0; i < g->n_live; i++) {
+        Sequence *beam = g->live[i];
+        if (beam->state != SEQ_RUNNING) { continue; }
+        beam->has_cand = 0;
+        recompute(s, beam);
+    }
+    g->n_pending = 0;
+}
+
+void preempt(Scheduler *s, Sequence *seq) {
+    // frees the kv blocks of a running sequence, by swapping or by dropping them for recompute
+    KVCache *kv = &s->transformer->state.kv;
+    if (seq->beam != NULL) { preempt_group(s, seq->beam); return; }
+    if (kv_swap_out(kv, seq->blocks, seq->n_blocks) != 0) { recompute(s, seq); return; }
+    seq_remove(&s->running, seq);
+    s->n_running--;
+    seq->state = SEQ_SWAPPED;
+    seq_insert(&s->swapped, seq);
+    s->n_swapped++;
+    s->n_preempt_swap++;
+    trace_seq('n', "swap_out", seq->id, NULL, 0);
+}
+
+int preempt_for(Scheduler *s, Sequence *seq) {
+    // preempts the least important running sequence if it ranks below seq, returns 1 if it did
+    Sequence *victim = seq_tail(s->running);
+    if (victim == NULL || victim == seq || !seq_before(seq, victim)) { return 0; }
+    preempt(s, victim);
+    return 1;
+}
+
+int grow_blocks(Scheduler *s, Sequence *seq, int n_positions) {
+    // makes the block table of seq cover n_positions, returns -1 when the pool is exhausted.
+    // the block of the next position to write is copied first if seq shares it with a fork
+    KVCache *kv = &s->transformer->state.kv;
+    int b = seq->n_computed / KV_BLOCK_SIZE;
+    if (b < seq->n_blocks && kv->refs[seq->blocks[b]] > 1) {
+        int block = kv_alloc_block(kv);
+        if (block < 0) { return -1; }
+        kv_copy_block(kv, block, seq->blocks[b]);
+        kv_free_block(kv, seq->blocks[b]);
+        seq->blocks[b] = block;
+    }
+    while (seq->n_blocks < blocks_for(n_positions)) {
+        int block = kv_alloc_block(kv);
+        if (block < 0) { return -1; }
+        seq->blocks[seq->n_blocks++] = block;
+    }
+    return 0;
+}
+
+void batch_add(Scheduler *s, Sequence *seq, int n) {
+    // appends the next n uncomputed tokens of seq, asking for logits if that reaches its last token.
+    // a scoring sequence asks for the log-probability of the next token at every continuation position
+    Batch *b = &s->batch;
+    for (int i = 0; i < n; i++) {
+        int pos = seq->n_computed++;
+        b->token[b->n_tokens] = seq->tokens[pos];
+        b->pos[b->n_tokens] = pos;
+        b->blocks[b->n_tokens] = seq->blocks;
+        b->logits_row[b->n_tokens] = -1;
+        b->score_row[b->n_tokens] = -1;
+        if (seq->logprobs != NULL) {
+            if (seq->conts == NULL && pos + 1 >= seq->n_prompt) {
+                s->score_seq[b->n_scored] = seq;
+                s->score_pos[b->n_scored] = pos + 1;
+                b->target[b->n_scored] = seq->tokens[pos + 1];
+                b->score_row[b->n_tokens] = b->n_scored++;
+            }
+        } else if (seq->n_computed == seq->n_tokens) {
+            s->logits_seq[b->n_logits] = seq;
+            b->logits_row[b->n_tokens] = b->n_logits++;
+        }
+        b->n_tokens++;
+    }
+}
+
+void drop_expired(Scheduler *s, long now) {
+    // finishes sequences that are past their deadline or were cancelled by their consumer,
+    // before anything is scheduled, so their blocks and batch slots go to the others right away.
+    // finishing a beam takes its whole group along, so the scan restarts after every drop
+    Sequence **queues[3] = { &s->waiting, &s->swapped, &s->running };
+    for (int i = 0; i < 3; i++) {
+        Sequence *seq = *queues[i];
+        while (seq != NULL) {
+            if (seq->cancel != NULL && __atomic_load_n(seq->cancel, __ATOMIC_ACQUIRE)) { finish_sequence(s, seq, FINISH_CANCELLED); }
+            else if (seq->deadline != 0 && now > seq->deadline) { finish_sequence(s, seq, FINISH_DEADLINE); }
+            else { seq = seq->next; continue; }
+            seq = *queues[i];
+        }
+    }
+}
+
+int running_slots(Scheduler *s) {
+    // running sequences plus the forks they may still make, which are promised a place next to them
+    int slots = 0;
+    for (Sequence *seq = s->running; seq != NULL; seq = seq->next) {
+        slots += 1 + seq->n_forks;
+        if (seq->beam != NULL && seq->slot == 0) { slots += seq->beam->width - seq->beam->n_live; }
+    }
+    return slots;
+}
+
+int can_admit(Scheduler *s, Sequence *seq) {
+    // room in the running set and blocks for all of seq's tokens and its forks, keeping the watermark free.
+    // a beam comes in with the rest of its group
+    KVCache *kv = &s->transformer->state.kv;
+    int reserve = s->n_running > 0 ? s->watermark : 0;
+    int slots = 1 + seq_fanout(seq);
+    int blocks = blocks_for(seq->n_tokens) + seq_fanout(seq);
+    if (seq->beam != NULL) {
+        BeamGroup *g = seq->beam;
+        slots = g->width;
+        blocks = g->width - g->n_live;
+        for (int i = 0; i < g->n_live; i++) { blocks += blocks_for(g->live[i]->n_tokens); }
+    }
+    return running_slots(s) + slots <= s->max_running && kv->n_free >= blocks + reserve;
+}
+
+void schedule_priority(Scheduler *s) {
+    // a more important waiting request takes the place of less important running ones.
+    // runs before anything is put in the batch, so a victim never has tokens in flight
+    while (s->waiting != NULL && !can_admit(s, s->waiting) && preempt_for(s, s->waiting)) {}
+}
+
+void grow_beams(Scheduler *s) {
+    // beams take the block for their next token before anything is put in the batch, so preempting
+    // whole groups is safe here and schedule_decode never has to preempt a beam
+    Sequence *seq = s->running;
+    while (seq != NULL) {
+        if (seq->beam == NULL || seq->n_tokens - seq->n_computed != 1 || grow_blocks(s, seq, seq->n_computed + 1) == 0) {
+            seq = seq->next;
+            continue;
+        }
+        preempt(s, seq_tail(s->running));
+        seq = s->running; // the victim can be anywhere in the list, start over
+    }
+}
+
+Sequence* decode_victim(Scheduler *s) {
+    // the least important running sequence that isn't a beam, beams may already be in the batch
+    Sequence *victim = NULL;
+    for (Sequence *seq = s->running; seq != NULL; seq = seq->next) {
+        if (seq->beam == NULL) { victim = seq; }
+    }
+    return victim;
+}
+
+void schedule_decode(Scheduler *s) {
+    // one token for every running sequence past its prompt, in priority order, preempting
+    // from the tail when a sequence needs a new kv block and the pool is empty
+    Batch *b = &s->batch;
+    Sequence *seq = s->running;
+    while (seq != NULL && b->n_tokens < s->max_batch_tokens) {
+        Sequence *next = seq->next;
+        if (seq->n_tokens - seq->n_computed != 1) { seq = next; continue; } // still in its prompt, or a beam waiting for its group
+        if (grow_blocks(s, seq, seq->n_computed + 1) != 0) {
+            Sequence *victim = decode_victim(s);
+            preempt(s, victim);
+            if (victim == seq) { break; } // every non-beam after seq is gone too
+            continue; // retry seq
+        }
+        batch_add(s, seq, 1);
+        seq = next;
+    }
+}
+
+int next_chunk(Scheduler *s, Sequence *seq) {
+    // tokens of seq's prompt that go into this step: at most one chunk, and what is left of the budget
+    int todo = seq->n_tokens - seq->n_computed;
+    int budget = s->max_batch_tokens - s->batch.n_tokens;
+    int n = todo < s->prefill_chunk ? todo : s->prefill_chunk;
+    return n < budget ? n : budget;
+}
+
+void admit(Scheduler *s, Sequence *seq) {
+    // the blocks for the whole prompt are taken at admission, so chunks never stall on memory
+    seq_remove(&s->waiting, seq);
+    s->n_waiting--;
+    grow_blocks(s, seq, seq->n_tokens);
+    seq->state = SEQ_RUNNING;
+    seq_insert(&s->running, seq);
+    s->n_running++;
+    batch_add(s, seq, next_chunk(s, seq));
+}
+
+void schedule_prefill(Scheduler *s) {
+    // fills the budget left over by the decodes with prompt chunks: first of sequences whose
+    // prompt is partly forwarded, then of newly admitted ones. a long prompt thus advances
+    // one chunk per step next to the running streams instead of stalling them
+    KVCache *kv = &s->transformer->state.kv;
+    Batch *b = &s->batch;
+    for (Sequence *seq = s->running; seq != NULL && b->n_tokens < s->max_batch_tokens; seq = seq->next) {
+        if (seq->n_tokens - seq->n_computed <= 1) { continue; } // decoding, or already in this batch
+        batch_add(s, seq, next_chunk(s, seq));
+    }
+    // bring back swapped sequences before anything new, they already paid for their prefill
+    while (s->swapped != NULL && running_slots(s) < s->max_running) {
+        Sequence *seq = s->swapped;
+        if (s->waiting != NULL && seq_before(s->waiting, seq)) { break; } // would only be preempted again
+        int reserve = s->n_running > 0 ? s->watermark : 0;
+        if (kv->n_free < seq->n_blocks + reserve || kv_swap_in(kv, seq->blocks, seq->n_blocks) != 0) { break; }
+        seq_remove(&s->swapped, seq);
+        s->n_swapped--;
+        seq->state = SEQ_RUNNING;
+        seq_insert(&s->running, seq);
+        s->n_running++;
+    }
+    while (s->waiting != NULL && b->n_tokens < s->max_batch_tokens && can_admit(s, s->waiting)) {
+        BeamGroup *g = s->waiting->beam;
+        if (g == NULL) { admit(s, s->waiting); continue; }
+        for (int i = 0; i < g->n_live; i++) {
+            if (g->live[i]->state == SEQ_WAITING) { admit(s, g->live[i]); }
+        }
+    }
+}
+
+void append_token(Scheduler *s, Sequence *seq, int next, long now) {
+    // data-dependent terminating condition: the BOS (=1) token delimits sequences
+    if (next == 1 && !seq->ignore_stop) { finish_sequence(s, seq, FINISH_STOP); return; }
+    seq->tokens[seq->n_tokens++] = next;
+    if (seq->first_token == 0) { seq->first_token = now; trace_seq('n', "first_token", seq->id, NULL, 0); }
+    else if (now - seq->last_token > seq->max_itl) { seq->max_itl = now - seq->last_token; }
+    seq->last_token = now;
+    if (seq->beam == NULL && seq->on_token(seq, next, seq->ctx) != 0) { finish_sequence(s, seq, FINISH_CANCELLED); }
+    else if (seq->n_tokens > seq->steps) { finish_sequence(s, seq, FINISH_LENGTH); }
+}
+
+void beam_resolve(Scheduler *s, BeamGroup *g, long now) {
+    // every live beam has its candidates in: the best width of them go on. a beam picked more than
+    // once forks, a beam nobody picks is dropped, and a picked stop token ends a hypothesis
+    int width = g->width;
+    int n = g->n_live * width;
+    for (int i = 0; i < n; i++) {
+        // insertion sort by score, there are only width^2 of them
+        int c = i, j = i;
+        for (; j > 0 && g->cand_score[g->order[j - 1]] < g->cand_score[c]; j--) { g->order[j] = g->order[j - 1]; }
+        g->order[j] = c;
+    }
+    int n_beams = g->n_live;
+    memcpy(g->beams, g->live, n_beams * sizeof(Sequence *));
+    memset(g->uses, 0, n_beams * sizeof(int));
+    int n_picks = 0;
+    for (int i = 0; i < n && n_picks < width; i++) {
+        int c = g->order[i];
+        Sequence *beam = g->live[c / width];
+        if (g->cand_token[c] < 0) { break; } // fewer tokens than beams, the rest are padding
+        if (g->cand_token[c] == 1) { beam_hypothesis(g, beam, g->cand_score[c], beam->n_tokens - beam->n_prompt + 1, FINISH_STOP); continue; }
+        g->picks[n_picks++] = c;
+        g->uses[c / width]++;
+    }
+    for (int i = 0; i < n_beams; i++) { g->beams[i]->has_cand = 0; }
+    g->n_pending = 0;
+    // drops first, they make room in the running set for the forks
+    for (int i = 0; i < n_beams; i++) {
+        if (g->uses[i] > 0) { continue; }
+        seq_unlink(s, g->beams[i]);
+        seq_release_blocks(s, g->beams[i]);
+        g->beams[i]->state = SEQ_FINISHED;
+        beam_remove(s, g->beams[i]);
+        if (n_picks == 0 && i == n_beams - 1) { return; } // that was the last one, the group is gone
+    }
+    // forks before appends, a fork copies its beam as it was before this round
+    for (int k = 0; k < n_picks; k++) {
+        int i = g->picks[k] / width;
+        g->targets[k] = g->uses[i]-- == 1 ? g->beams[i] : fork_sequence(s, g->beams[i]);
+    }
+    // the group goes away once its last beam finishes, so nothing of it is read after that
+    for (int k = 0; k < n_picks; k++) {
+        Sequence *target = g->targets[k];
+        int token = g->cand_token[g->picks[k]];
+        target->score = g->cand_score[g->picks[k]];
+        append_token(s, target, token, now);
+    }
+}
+
+void beam_candidates(Scheduler *s, Sequence *seq, float *logits, long now) {
+    // the width most likely next tokens of a beam, scored by the total log-probability they give it
+    BeamGroup *g = seq->beam;
+    int vocab_size = s->transformer->config.vocab_size;
+    float max_val = logits[0];
+    for (int i = 1; i < vocab_size; i++) { if (logits[i] > max_val) { max_val = logits[i]; } }
+    float sum = 0.0f;
+    for (int i = 0; i < vocab_size; i++) { sum += expf(logits[i] - max_val); }
+    float log_norm = max_val + logf(sum);
+    int *tokens = g->cand_token + seq->slot * g->width;
+    float *scores = g->cand_score + seq->slot * g->width;
+    for (int k = 0; k < g->width; k++) { tokens[k] = -1; scores[k] = -INFINITY; }
+    for (int i = 0; i < vocab_size; i++) {
+        float score = seq->score + logits[i] - log_norm;
+        if (score <= scores[g->width - 1]) { continue; }
+        int k = g->width - 1;
+        for (; k > 0 && scores[k - 1] < score; k--) { tokens[k] = tokens[k - 1]; scores[k] = scores[k - 1]; }
+        tokens[k] = i;
+        scores[k] = score;
+    }
+    if (!seq->has_cand) { seq->has_cand = 1; g->n_pending++; }
+    if (g->n_pending == g->n_live) { beam_resolve(s, g, now); }
+}
+
+void append_continuation(Scheduler *s, Sequence *seq, Continuations *c) {
+    // puts continuation seq->index after the context, the last context token is forwarded again with it
+    memcpy(seq->tokens + seq->n_prompt, c->tokens[seq->index], c->n_tokens[seq->index] * sizeof(int));
+    seq->n_tokens = seq->n_prompt - 1 + c->n_tokens[seq->index];
+    // when the pool can't take it, it waits to be recomputed. swapping it out would bring it back short of blocks
+    if (seq->state == SEQ_RUNNING && grow_blocks(s, seq, seq->n_tokens) != 0) { recompute(s, seq); }
+}
+
+void finish_scored(Scheduler *s) {
+    // scoring sequences that forwarded all they had to: a context forks off its continuations,
+    // a continuation is done and goes back with its log-probabilities
+    Sequence *seq = s->running;
+    while (seq != NULL) {
+        Sequence *next = seq->next;
+        if (seq->logprobs != NULL && seq->n_computed == seq->n_tokens) {
+            if (seq->conts == NULL) { finish_sequence(s, seq, FINISH_LENGTH); seq = next; continue; }
+            Continuations *c = seq->conts;
+            seq->conts = NULL;
+            for (; seq->n_forks > 0; seq->n_forks--) {
+                Sequence *child = fork_sequence(s, seq);
+                child->index = seq->n_forks;
+                append_continuation(s, child, c);
+            }
+            append_continuation(s, seq, c);
+            next = s->running; // forks and preemptions move things around, the context won't match again
+        }
+        seq = next;
+    }
+}
+
+void process_logits(Scheduler *s) {
+    // samples the next token of every sequence that got logits in this step,
+    // and files the log-probabilities of the scored tokens
+    Batch *b = &s->batch;
+    int vocab_size = s->transformer->config.vocab_size;
+    long now = time_in_ms();
+    for (int r = 0; r < b->n_scored; r++) {
+        s->score_seq[r]->logprobs[s->score_pos[r]] = s->transformer->state.logprobs[r];
+    }
+    for (int r = 0; r < b->n_logits; r++) {
+        Sequence *seq = s->logits_seq[r];
+        float *logits = s->transformer->state.logits + (size_t)r * vocab_size;
+        if (seq->beam != NULL) { beam_candidates(s, seq, logits, now); continue; }
+        // the siblings of an n > 1 request fork off here, sharing the prompt's kv blocks.
+        // sample() scales and softmaxes in place, so each takes its own copy of the row
+        for (; seq->n_forks > 0; seq->n_forks--) {
+            Sequence *child = fork_sequence(s, seq);
+            child->index = seq->n_forks;
+            child->sampler.rng_state = seq->sampler.rng_state + child->index * 0x9E3779B97F4A7C15ULL;
+            memcpy(s->logits_scratch, logits, vocab_size * sizeof(float));
+            append_token(s, child, sample(&child->sampler, s->logits_scratch), now);
+        }
+        append_token(s, seq, sample(&seq->sampler, logits), now);
+    }
+}
+
+int scheduler_step(Scheduler *s) {
+    // runs one batched forward and samples from it, returns the number of tokens forwarded
+    Batch *b = &s->batch;
+    Profiler *prof = s->transformer->profiler;
+    PROF_START(prof);
+    long trace_start = trace_begin();
+    b->n_tokens = 0;
+    b->n_logits = 0;
+    b->n_scored = 0;
+    drop_expired(s, time_in_ms());
+    finish_scored(s);
+    // decodes go first so running streams advance every step, prompt chunks take the rest
+    schedule_priority(s);
+    grow_beams(s);
+    schedule_decode(s);
+    schedule_prefill(s);
+    if (b->n_tokens == 0) { return 0; }
+    int n_layers = s->transformer->config.n_layers;
+    PROF_OP(prof, n_layers, OP_SCHEDULE, 0, 0);
+    long trace_forward = trace_begin();
+    forward_batch(s->transformer, b);
+    trace_end("forward", trace_forward, "tokens", b->n_tokens);
+    PROF_RESTART(prof);
+    long trace_sample = trace_begin();
+    process_logits(s);
+    trace_end("sample", trace_sample, "rows", b->n_logits);
+    PROF_OP(prof, n_layers, OP_SAMPLE, (double)b->n_logits * s->transformer->config.vocab_size * sizeof(float), 0);
+    if (prof != NULL) { prof->steps++; }
+    trace_end("step", trace_start, "tokens", b->n_tokens);
+    return b->n_tokens;
+}
+
+// ----------------------------------------------------------------------------
+// generation loop
+// ----------------------------------------------------------------------------
+
+typedef struct {
+    Tokenizer *tokenizer;
+    long start;  // used to time our code, only initialized after the first sampled token
+    int done;
+} StdoutStream;
+
+int stdout_token(Sequence *seq, int token, void *ctx) {
+    StdoutStream *out = (StdoutStream *)ctx;
+    if (token < 0) { out->done = 1; return 0; }
+    long trace_start = trace_begin();
+    // print the token as string, decode it with the Tokenizer object
+    char* piece = decode(out->tokenizer, seq->tokens[seq->n_tokens - 2], token);
+    safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
+    fflush(stdout);
+    trace_end("output", trace_start, NULL, 0);
+    // init the timer here because the first iteration can be slower
+    if (out->start == 0) { out->start = time_in_ms(); }
+    return 0;
+}
+
+void generate(Scheduler *scheduler, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps) {
+    char *empty_prompt = (char *)"";
+    if (prompt == NULL) {prompt = empty_prompt;}
+
+    // encode the (string) prompt into tokens sequence
+    int num_prompt_tokens = 0;
+    int *prompt_tokens = (int *)malloc((strlen(prompt)+3) * sizeof(int)); // +3 for '\0', ?BOS, ?EOS
+    encode(tokenizer, prompt, 1, 0, prompt_tokens, &num_prompt_tokens);
+    if (num_prompt_tokens < 1) {
+        fprintf(stderr, "something is wrong, expected at least 1 prompt token\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // echo the prompt, the whole of it is forwarded in chunks before sampling starts
+    for (int i = 1; i < num_prompt_tokens && i < steps; i++) {
+        safe_printf(decode(tokenizer, prompt_tokens[i - 1], prompt_tokens[i]));
+    }
+    fflush(stdout);
+
+    StdoutStream out = { tokenizer, 0, 0 };
+    Sequence *seq = new_sequence(scheduler, prompt_tokens, num_prompt_tokens, steps, sampler);
+    seq->on_token = stdout_token;
+    seq->ctx = &out;
+    if (scheduler_submit(scheduler, seq) != 0) {
+        fprintf(stderr, "sequence doesn't fit in the kv cache\n");
+        exit(EXIT_FAILURE);
+    }
+    // run the scheduler until the sequence is done
+    while (!out.done) { scheduler_step(scheduler); }
+    printf("\n");
+
+    // report achieved tok/s (n-1 because the timer starts after the first sampled token)
+    int n_sampled = seq->n_tokens - seq->n_prompt;
+    if (n_sampled > 1) {
+        long end = time_in_ms();
+        fprintf(stderr, "achieved tok/s: %f\n", (n_sampled-1) / (double)(end-out.start)*1000);
+    }
+
+    free_sequence(seq);
+    free(prompt_tokens);
+}
+
+// ----------------------------------------------------------------------------
+// lock-free single producer single consumer ring, passes work between the engine
+// thread and the threads around it without locks on either side
+
+typedef struct {
+    intptr_t *buf;
+    unsigned int mask;      // capacity - 1, the capacity is a power of two
+    unsigned int head;      // next slot to read, only written by the consumer
+    char pad[64];           // keeps the two indices on separate cache lines
+    unsigned int tail;      // next slot to write, only written by the producer
+} SPSCRing;
+
+void build_ring(SPSCRing *r, size_t min_capacity) {
+    // the indices wrap at 2^32, so 2^31 slots at most
+    if (min_capacity > (size_t)1 << 31) {
+        fprintf(stderr, "ring of %zu slots is too large\n", min_capacity);
+        exit(EXIT_FAILURE);
+    }
+    unsigned int capacity = 1;
+    while (capacity < min_capacity) { capacity <<= 1; }
+    r->buf = (intptr_t *)malloc(capacity * sizeof(intptr_t));
+    r->mask = capacity - 1;
+    r->head = 0;
+    r->tail = 0;
+}
+
+void free_ring(SPSCRing *r) {
+    free(r->buf);
+}
+
+int ring_push(SPSCRing *r, intptr_t v) {
+    // producer side, returns -1 if the ring is full
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask) { return -1; }
+    r->buf[tail & r->mask] = v;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE); // publishes the slot and everything written before
+    return 0;
+}
+
+int ring_pop(SPSCRing *r, intptr_t *v) {
+    // consumer side, returns 0 if the ring is empty
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) { return 0; }
+    *v = r->buf[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// a ring with blocking ends for pipelines between threads: eventfds wake the
+// consumer when items arrive and the producer when slots free up
+
+typedef struct {
+    SPSCRing ring;
+    int items_fd;
+    int space_fd;
+} Channel;
+
+void build_channel(Channel *c, int capacity) {
+    build_ring(&c->ring, capacity);
+    c->items_fd = eventfd(0, EFD_CLOEXEC);
+    c->space_fd = eventfd(0, EFD_CLOEXEC);
+}
+
+void free_channel(Channel *c) {
+    free_ring(&c->ring);
+    close(c->items_fd);
+    close(c->space_fd);
+}
+
+void channel_send(Channel *c, intptr_t v) {
+    // blocks while the channel is full
+    eventfd_t n;
+    while (ring_push(&c->ring, v) != 0) { eventfd_read(c->space_fd, &n); }
+    eventfd_write(c->items_fd, 1);
+}
+
+int channel_try_recv(Channel *c, intptr_t *v) {
+    if (!ring_pop(&c->ring, v)) { return 0; }
+    eventfd_write(c->space_fd, 1);
+    return 1;
+}
+
+intptr_t channel_recv(Channel *c) {
+    // blocks while the channel is empty
+    intptr_t v;
+    eventfd_t n;
+    while (!channel_try_recv(c, &v)) { eventfd_read(c->items_fd, &n); }
+    return v;
+}
+
+// ----------------------------------------------------------------------------
+// server mode: the Transformer, Tokenizer and Sampler are built once and every
+// completion request reuses them. Requests arrive over a Unix or TCP socket and
+// tokens are streamed back as Server-Sent Events in a chunked HTTP response:
+//   ./main -m model.bin -M server -L unix:/tmp/llama2.sock
+//   curl -N --unix-socket /tmp/llama2.sock -d '{"prompt": "Once upon a time"}' http://localhost/completion
+// concurrent requests are continuously batched by the Scheduler. Optional request
+// fields: steps, temperature, topp, seed (default --seed plus the number of the
+// request, so concurrent requests differ), priority (0 is the most important
+// class, default 1), deadline_ms (relative to arrival, late requests are dropped)
+// and n (completions sampled from one prefill of the prompt, their events carry
+// an "index" and each ends with its own finish_reason event).
+// POST /score takes {"context": "...", "continuations": ["...", ...]} and answers with
+// the summed and per-token log-probabilities of every continuation after the context,
+// which is forwarded once and shared by all of them (for multiple choice and reranking)
+//
+// connections are served by a few I/O threads (--io-threads), each an epoll loop
+// resuming one stackless coroutine per connection, so a client costs no thread.
+// the engine (main thread) never touches a socket: an I/O thread tokenizes the
+// prompt and hands the Request over a ring, the engine sends the sampled tokens
+// back over a ring per request and kicks the I/O thread's eventfd once per step.
+// when a client goes away its request is flagged and the scheduler drops the
+// sequence, kv blocks and batch slot included, at the start of the next step.
+// SIGINT or SIGTERM stop the server after the current step, so a profile or
+// trace of the run still gets written
+// ----------------------------------------------------------------------------
+
+#define MAX_REQUEST_BYTES (1 << 20)
+#define SUBMIT_RING_SIZE 1024   // requests in flight from one I/O thread to the engine
+
+// protothread style coroutines: the resume point is kept in co->line and a switch
+// jumps back to it. locals don't survive a yield, state lives in the struct
+#define CO_BEGIN(co) switch ((co)->line) { case 0:
+#define CO_YIELD(co) do { (co)->line = __LINE__; return 0; case __LINE__:; } while (0)
+#define CO_EXIT(co) do { (co)->line = -1; return 1; } while (0)
+#define CO_END(co) } (co)->line = -1; return 1
+
+// events on a request's ring are a token id in the low 32 bits and the index of
+// the completion it belongs to in the high ones. besides the sampled token ids:
+#define EVENT_DONE -1       // the completion finished, the stats below are filled in
+#define EVENT_ACCEPTED -2   // the scheduler took the request
+#define EVENT(index, token) (((intptr_t)(index) << 32) | (uint32_t)(token))
+
+typedef struct IOThread IOThread;
+
+typedef struct {
+    int *prompt_tokens;     // encoded on the I/O thread
+    int n_prompt;
+    int steps;
+    float temperature;
+    float topp;
+    unsigned long long rng_seed;
+    int priority;
+    long deadline_ms;       // 0 = none
+    int n;                  // completions, or continuations to score
+    Continuations conts;    // a /score request: the prompt is the context and these are scored after it
+    float **logprobs;       // (n,) log-probability of every continuation token, NULL unless scoring
+    IOThread *io;           // thread serving the connection
+    SPSCRing events;        // engine -> I/O thread, room for every event of the request
+    int cancelled;          // I/O thread -> engine, set once the client is gone
+    // written by the engine before it sends EVENT_DONE, the totals are complete with the last one
+    FinishReason *finish;   // (n,)
+    int n_generated;
+    long first_token;
+    long last_token;
+    long max_itl_ms;
+    long arrival;
+    long end;
+} Request;
+
+typedef struct Connection {
+    int line;               // coroutine resume point, -1 once done
+    int fd;
+    IOThread *io;
+    char *in;               // request bytes read so far, (MAX_REQUEST_BYTES,)
+    size_t in_len;
+    int request_len;        // length of the whole request, 0 while incomplete, -1 if malformed
+    char *body;
+    char *out;              // bytes the socket hasn't taken yet
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    int rc;
+    Request *req;
+    int *prev_tokens;       // (n,) for decode()
+    int n_done;             // completions that got EVENT_DONE
+    int engine_done;        // all of them did, the engine no longer touches req
+    int hup;                // the client is gone
+    struct Connection *next;
+} Connection;
+
+typedef struct Server Server;
+
+struct IOThread {
+    Server *server;
+    pthread_t thread;
+    int epfd;
+    int wake_fd;            // eventfd the engine kicks after sending events
+    SPSCRing submit;        // I/O thread -> engine, Request pointers
+    int wake_pending;       // engine side only, events were sent to this thread during the step
+    Connection *conns;
+    char *escaped;          // scratch for json_escape
+    char *event;            // scratch for the SSE events
+};
+
+struct Server {
+    int listen_fd;
+    int engine_fd;          // eventfd the I/O threads kick after submitting
+    IOThread *io;
+    int n_io;
+    Tokenizer *tokenizer;
+    int max_seq_len;
+    int max_running;        // of the scheduler, no request can ask for more completions at once
+    // defaults for the fields a request leaves out
+    int steps;
+    float temperature;
+    float topp;
+    unsigned long long rng_seed; // plus the number of the request
+    unsigned long long n_requests; // parsed so far, by all the I/O threads
+    int stopping;           // set by the engine on SIGINT/SIGTERM, the I/O threads return
+};
+
+// minimal JSON field lookup, enough for flat request objects like {"prompt": "...", "steps": 64}
+
+const char* json_find(const char *json, const char *key) {
+    // returns a pointer to the value of "key", or NULL if absent
+    size_t klen = strlen(key);
+    for (const char *p = strchr(json, '"'); p != NULL; p = strchr(p + 1, '"')) {
+        if (p > json && p[-1] == '\\') { continue; } // escaped quote inside a string value
+        if (strncmp(p + 1, key, klen) != 0 || p[1 + klen] != '"') { continue; }
+        const char *v = p + klen + 2;
+        while (isspace((unsigned char)*v)) { v++; }
+        if (*v != ':') { continue; }
+        v++;
+        while (isspace((unsigned char)*v)) { v++; }
+        return v;
+    }
+    return NULL;
+}
+
+int json_get_number(const char *json, const char *key, double *out) {
+    const char *v = json_find(json, key);
+    if (v == NULL) { return 0; }
+    char *end;
+    double d = strtod(v, &end);
+    if (end == v) { return 0; }
+    *out = d;
+    return 1;
+}
+
+char* json_parse_string(const char *v, const char **end) {
+    // returns a malloc'd, unescaped copy of the JSON string at v, or NULL. *end is set past its closing quote
+    if (*v != '"') { return NULL; }
+    v++;
+    char *out = (char *)malloc(strlen(v) + 1); // unescaping never grows the string
+    size_t n = 0;
+    while (*v && *v != '"') {
+        if (*v != '\\') { out[n++] = *v++; continue; }
+        v++;
+        switch (*v) {
+            case 'n': out[n++] = '\n'; break;
+            case 't': out[n++] = '\t'; break;
+            case 'r': out[n++] = '\r'; break;
+            case 'b': out[n++] = '\b'; break;
+            case 'f': out[n++] = '\f'; break;
+            case 'u': {
+                // \uXXXX, re-encoded as UTF-8 (surrogate pairs are not combined)
+                unsigned int cp = 0;
+                if (sscanf(v + 1, "%4x", &cp) != 1) { free(out); return NULL; }
+                v += 4;
+                if (cp < 0x80) { out[n++] = cp; }
+                else if (cp < 0x800) { out[n++] = 0xC0 | (cp >> 6); out[n++] = 0x80 | (cp & 0x3F); }
+                else { out[n++] = 0xE0 | (cp >> 12); out[n++] = 0x80 | ((cp >> 6) & 0x3F); out[n++] = 0x80 | (cp & 0x3F); }
+                break;
+            }
+            case '\0': free(out); return NULL;
+            default: out[n++] = *v; break; // \" \\ \/
+        }
+        v++;
+    }
+    if (*v != '"') { free(out); return NULL; }
+    out[n] = '\0';
+    *end = v + 1;
+    return out;
+}
+
+char* json_get_string(const char *json, const char *key) {
+    // returns a malloc'd, unescaped copy of the string value of "key", or NULL
+    const char *v = json_find(json, key);
+    const char *end;
+    return v != NULL ? json_parse_string(v, &end) : NULL;
+}
+
+void free_strings(char **strs, int n) {
+    if (strs == NULL) { return; }
+    for (int i = 0; i < n; i++) { free(strs[i]); }
+    free(strs);
+}
+
+char** json_get_strings(const char *json, const char *key, int *n) {
+    // returns a malloc'd array of the strings of the array value of "key", or NULL if it isn't one
+    const char *v = json_find(json, key);
+    if (v == NULL || *v != '[') { return NULL; }
+    char **out = NULL;
+    *n = 0;
+    for (v++; ; v++) {
+        while (isspace((unsigned char)*v)) { v++; }
+        char *str = json_parse_string(v, &v);
+        if (str == NULL) { break; }
+        out = (char **)realloc(out, (*n + 1) * sizeof(char *));
+        out[(*n)++] = str;
+        while (isspace((unsigned char)*v)) { v++; }
+        if (*v == ']') { return out; }
+        if (*v != ',') { break; }
+    }
+    free_strings(out, *n);
+    return NULL;
+}
+
+char* json_get_raw(const char *json, const char *key) {
+    // returns a malloc'd copy of the value of "key" as written (a string keeps its quotes), or NULL
+    const char *v = json_find(json, key);
+    if (v == NULL) { return NULL; }
+    const char *end = v;
+    if (*end == '"') {
+        for (end++; *end && *end != '"'; end++) { if (*end == '\\' && end[1]) { end++; } }
+        if (*end != '"') { return NULL; }
+        end++;
+    } else {
+        while (*end && *end != ',' && *end != '}' && !isspace((unsigned char)*end)) { end++; }
+    }
+    return end > v ? strndup(v, end - v) : NULL;
+}
+
+void json_get_sampling(const char *json, int *steps, float *temperature, float *topp, unsigned long long *rng_seed) {
+    // overrides the defaults passed in with the sampling fields present in json
+    double v;
+    if (json_get_number(json, "steps", &v)) { *steps = (int)v; }
+    if (json_get_number(json, "temperature", &v) && v >= 0.0) { *temperature = (float)v; }
+    if (json_get_number(json, "topp", &v) && 0.0 <= v && v < 1.0) { *topp = (float)v; }
+    if (json_get_number(json, "seed", &v) && v > 0) { *rng_seed = (unsigned long long)v; }
+}
+
+size_t json_escape(char *out, const char *s) {
+    // out must hold 6 * strlen(s) + 1 bytes, returns the escaped length
+    size_t n = 0;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') { out[n++] = '\\'; out[n++] = c; }
+        else if (c == '\n') { out[n++] = '\\'; out[n++] = 'n'; }
+        else if (c == '\r') { out[n++] = '\\'; out[n++] = 'r'; }
+        else if (c == '\t') { out[n++] = '\\'; out[n++] = 't'; }
+        else if (c < 0x20) { n += sprintf(out + n, "\\u%04x", c); }
+        else { out[n++] = c; }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+size_t json_logprobs(char *out, const float *logprobs, int n) {
+    // the fields of a scored continuation, out must hold 32 * (n + 2) bytes. returns the length
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) { sum += logprobs[i]; }
+    size_t len = sprintf(out, "\"tokens\":%d,\"logprob\":%.6f,\"token_logprobs\":[", n, sum);
+    for (int i = 0; i < n; i++) { len += sprintf(out + len, i ? ",%.6f" : "%.6f", logprobs[i]); }
+    out[len++] = ']';
+    out[len] = '\0';
+    return len;
+}
+
+void out_append(Connection *c, const char *data, size_t len) {
+    if (c->hup) { return; } // nobody left to read it
+    if (c->out_len + len > c->out_cap) {
+        while (c->out_len + len > c->out_cap) { c->out_cap = c->out_cap ? 2 * c->out_cap : 4096; }
+        c->out = (char *)realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+void out_chunk(Connection *c, const char *data, size_t len) {
+    // one chunk of a Transfer-Encoding: chunked body
+    char head[32];
+    int hlen = snprintf(head, sizeof(head), "%zx\r\n", len);
+    out_append(c, head, hlen);
+    out_append(c, data, len);
+    out_append(c, "\r\n", 2);
+}
+
+void out_response(Connection *c, int status, const char *reason, const char *json_body) {
+    char head[256];
+    int hlen = snprintf(head, sizeof(head),
+        "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+        status, reason, strlen(json_body));
+    out_append(c, head, hlen);
+    out_append(c, json_body, strlen(json_body));
+}
+
+int conn_flush(Connection *c) {
+    // sends what the socket takes without blocking: 1 when all went out, 0 if it's full, -1 if the peer is gone.
+    // MSG_NOSIGNAL keeps a closed socket from raising SIGPIPE
+    long trace_start = c->out_sent < c->out_len ? trace_begin() : 0;
+    size_t trace_sent = c->out_sent;
+    while (c->out_sent < c->out_len) {
+        ssize_t w = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) { continue; }
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return 0; }
+        if (w <= 0) { return -1; }
+        c->out_sent += w;
+    }
+    if (trace_start != 0) { trace_end("send", trace_start, "bytes", c->out_sent - trace_sent); }
+    c->out_len = 0;
+    c->out_sent = 0;
+    return 1;
+}
+
+int conn_fill(Connection *c) {
+    // reads what has arrived: the byte count, 0 if the socket would block, -1 on EOF, errors or a full buffer
+    while (1) {
+        if (c->in_len == MAX_REQUEST_BYTES - 1) { return -1; }
+        ssize_t r = recv(c->fd, c->in + c->in_len, MAX_REQUEST_BYTES - 1 - c->in_len, 0);
+        if (r < 0 && errno == EINTR) { continue; }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return 0; }
+        if (r <= 0) { return -1; }
+        c->in_len += r;
+        c->in[c->in_len] = '\0';
+        return r;
+    }
+}
+
+int http_request_length(char *buf, char **body) {
+    // length of the request in buf (headers and Content-Length body), 0 if it isn't all there yet, -1 if too large
+    char *header_end = strstr(buf, "\r\n\r\n");
+    if (header_end == NULL) { return 0; }
+    *body = header_end + 4;
+    size_t content_length = 0;
+    for (char *line = strstr(buf, "\r\n"); line != NULL && line < header_end; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) { content_length = strtoul(line + 17, NULL, 10); }
+    }
+    size_t total = (*body - buf) + content_length;
+    if (total >= MAX_REQUEST_BYTES) { return -1; }
+    if (strlen(buf) < total) { return 0; }
+    buf[total] = '\0';
+    return total;
+}
+
+Request* parse_completion_request(Server *server, const char *body, const char **error) {
+    // parses and tokenizes a completion request, NULL with *error set if it can't be run
+    char *prompt = json_get_string(body, "prompt");
+    if (prompt == NULL) { return NULL; }
+    double v;
+    if (json_get_number(body, "n", &v) && v > server->max_running) {
+        // the completions run all at once, more than the running set holds never could
+        *error = "{\"error\":\"n is more than the sequences the server runs at once (--max-seqs)\"}";
+        free(prompt);
+        return NULL;
+    }
+    Request *r = (Request *)calloc(1, sizeof(Request));
+    r->steps = server->steps;
+    r->temperature = server->temperature;
+    r->topp = server->topp;
+    r->rng_seed = server->rng_seed + __atomic_fetch_add(&server->n_requests, 1, __ATOMIC_RELAXED);
+    json_get_sampling(body, &r->steps, &r->temperature, &r->topp, &r->rng_seed);
+    r->priority = json_get_number(body, "priority", &v) ? (int)v : 1;
+    r->deadline_ms = json_get_number(body, "deadline_ms", &v) && v > 0 ? (long)v : 0;
+    r->n = json_get_number(body, "n", &v) && v > 1 ? (int)v : 1;
+    if (r->steps <= 0 || r->steps > server->max_seq_len) { r->steps = server->max_seq_len; }
+    r->prompt_tokens = (int *)malloc((strlen(prompt) + 3) * sizeof(int));
+    encode(server->tokenizer, prompt, 1, 0, r->prompt_tokens, &r->n_prompt);
+    free(prompt);
+    build_ring(&r->events, (size_t)r->n * (r->steps + 1) + 1); // accepted, then at most steps tokens and done per completion
+    r->finish = (FinishReason *)calloc(r->n, sizeof(FinishReason));
+    return r;
+}
+
+void free_request(Request *r) {
+    free(r->prompt_tokens);
+    if (r->logprobs != NULL) {
+        for (int i = 0; i < r->n; i++) { free(r->logprobs[i]); }
+        free_continuations(&r->conts);
+        free(r->logprobs);
+    }
+    free(r->finish);
+    free_ring(&r->events);
+    free(r);
+}
+
+Request* parse_score_request(Server *server, const char *body, const char **error) {
+    // parses and tokenizes a scoring request, NULL with *error set if it can't be run
+    char *context = json_get_string(body, "context");
+    int n = 0;
+    char **continuations = json_get_strings(body, "continuations", &n);
+    if (context == NULL || continuations == NULL) {
+        *error = "{\"error\":\"expected a JSON body with a \\\"context\\\" string and a \\\"continuations\\\" array of strings\"}";
+        free(context);
+        free_strings(continuations, n);
+        return NULL;
+    }
+    Request *r = (Request *)calloc(1, sizeof(Request));
+    double v;
+    r->priority = json_get_number(body, "priority", &v) ? (int)v : 1;
+    r->deadline_ms = json_get_number(body, "deadline_ms", &v) && v > 0 ? (long)v : 0;
+    r->prompt_tokens = (int *)malloc((strlen(context) + 3) * sizeof(int));
+    encode(server->tokenizer, context, 1, 0, r->prompt_tokens, &r->n_prompt);
+    free(context);
+    r->n = n;
+    r->steps = scoring_steps(r->n_prompt, build_continuations(&r->conts, server->tokenizer, continuations, n));
+    r->logprobs = (float **)malloc(n * sizeof(float *));
+    for (int i = 0; i < n; i++) { r->logprobs[i] = (float *)malloc((r->conts.n_tokens[i] + 1) * sizeof(float)); }
+    build_ring(&r->events, n + 1); // accepted, then done per continuation
+    r->finish = (FinishReason *)calloc(n, sizeof(FinishReason));
+    if (r->steps > server->max_seq_len) {
+        *error = "{\"error\":\"context and continuation are longer than the model's max_seq_len\"}";
+        free_request(r);
+        return NULL;
+    }
+    return r;
+}
+
+void conn_cancel(Connection *c) {
+    // the client is gone: drop pending output and have the engine drop the sequence
+    c->hup = 1;
+    c->out_len = 0;
+    c->out_sent = 0;
+    if (c->req != NULL && !c->engine_done) {
+        __atomic_store_n(&c->req->cancelled, 1, __ATOMIC_RELEASE);
+        eventfd_write(c->io->server->engine_fd, 1);
+    }
+}
+
+void conn_score_response(Connection *c) {
+    // the whole /score response in one go, once every continuation is in
+    Request *r = c->req;
+    size_t cap = 64;
+    for (int i = 0; i < r->n; i++) { cap += 64 + 32 * (r->conts.n_tokens[i] + 2); }
+    char *json = (char *)malloc(cap);
+    size_t len = sprintf(json, "{\"context_tokens\":%d,\"time_ms\":%ld,\"results\":[", r->n_prompt, r->end - r->arrival);
+    for (int i = 0; i < r->n; i++) {
+        // a continuation cut short by a deadline or cancellation has no scores
+        len += sprintf(json + len, "%s{\"index\":%d,\"finish_reason\":\"%s\"", i ? "," : "", i, finish_reason_names[r->finish[i]]);
+        if (r->finish[i] == FINISH_LENGTH) {
+            json[len++] = ',';
+            len += json_logprobs(json + len, r->logprobs[i], r->conts.n_tokens[i]);
+        }
+        json[len++] = '}';
+    }
+    strcpy(json + len, "]}");
+    out_response(c, 200, "OK", json);
+    free(json);
+}
+
+void conn_drain_events(Connection *c) {
+    // turns what the engine sent since the last wakeup into response bytes
+    static const char *head = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                              "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+    Request *r = c->req;
+    IOThread *io = c->io;
+    intptr_t event;
+    while (!c->engine_done && ring_pop(&r->events, &event)) {
+        int index = (int)(event >> 32);
+        int token = (int32_t)event;
+        // with n > 1 every event says which completion it is about
+        char tag[32] = "";
+        if (r->n > 1) { sprintf(tag, "\"index\":%d,", index); }
+        if (token == EVENT_ACCEPTED) {
+            if (r->logprobs == NULL) { out_append(c, head, strlen(head)); }
+        } else if (token == EVENT_DONE) {
+            if (r->finish[index] == FINISH_REJECTED) {
+                c->engine_done = 1;
+                out_response(c, 503, "Service Unavailable", "{\"error\":\"server overloaded or request too long\"}");
+                break;
+            }
+            if (r->logprobs != NULL) {
+                if (++c->n_done == r->n) { c->engine_done = 1; conn_score_response(c); }
+                continue;
+            }
+            if (r->n > 1) {
+                int len = sprintf(io->event, "data: {%s\"content\":\"\",\"finish_reason\":\"%s\"}\n\n", tag, finish_reason_names[r->finish[index]]);
+                out_chunk(c, io->event, len);
+            }
+            if (++c->n_done < r->n) { continue; }
+            // summary event and the end of the chunked body
+            c->engine_done = 1;
+            int sampled = r->n_generated - r->n; // the timer of every completion starts at its first token
+            double tok_s = sampled > 0 && r->last_token > r->first_token ? sampled / (double)(r->last_token - r->first_token) * 1000 : 0.0;
+            int len = sprintf(io->event, "data: {\"content\":\"\",\"stop\":true,\"finish_reason\":\"%s\",\"tokens_predicted\":%d,"
+                              "\"ttft_ms\":%ld,\"max_itl_ms\":%ld,\"time_ms\":%ld,\"tokens_per_second\":%.3f}\n\n",
+                              finish_reason_names[r->finish[0]], r->n_generated, r->first_token ? r->first_token - r->arrival : -1,
+                              r->max_itl_ms, r->end - r->arrival, tok_s);
+            out_chunk(c, io->event, len);
+            out_append(c, "0\r\n\r\n", 5);
+        } else {
+            char *piece = decode(io->server->tokenizer, c->prev_tokens[index], token);
+            c->prev_tokens[index] = token;
+            if (!is_safe_piece(piece)) { continue; }
+            json_escape(io->escaped, piece);
+            int len = sprintf(io->event, "data: {%s\"content\":\"%s\"}\n\n", tag, io->escaped);
+            out_chunk(c, io->event, len);
+        }
+    }
+}
+
+int conn_resume(Connection *c) {
+    // the life of a connection as a coroutine, run until it would block. returns 1 once it is done
+    CO_BEGIN(c);
+    // read the whole request
+    while ((c->request_len = http_request_length(c->in, &c->body)) == 0) {
+        c->rc = conn_fill(c);
+        if (c->rc < 0) { CO_EXIT(c); }
+        if (c->rc == 0) { CO_YIELD(c); }
+    }
+    if (c->request_len < 0) {
+        out_response(c, 400, "Bad Request", "{\"error\":\"malformed request\"}");
+    } else if (strncmp(c->in, "GET /health ", 12) == 0) {
+        out_response(c, 200, "OK", "{\"status\":\"ok\"}");
+    } else if (strncmp(c->in, "POST /completion ", 17) == 0 || strncmp(c->in, "POST /score ", 12) == 0) {
+        const char *error = "{\"error\":\"expected a JSON body with a \\\"prompt\\\" string\"}";
+        if (strncmp(c->in, "POST /score ", 12) == 0) { c->req = parse_score_request(c->io->server, c->body, &error); }
+        else { c->req = parse_completion_request(c->io->server, c->body, &error); }
+        if (c->req == NULL) {
+            out_response(c, 400, "Bad Request", error);
+        } else {
+            c->req->io = c->io;
+            c->prev_tokens = (int *)malloc(c->req->n * sizeof(int));
+            for (int i = 0; i < c->req->n; i++) { c->prev_tokens[i] = c->req->prompt_tokens[c->req->n_prompt - 1]; }
+            if (ring_push(&c->io->submit, (intptr_t)c->req) != 0) {
+                out_response(c, 503, "Service Unavailable", "{\"error\":\"server overloaded\"}");
+                free_request(c->req);
+                c->req = NULL;
+            } else {
+                eventfd_write(c->io->server->engine_fd, 1);
+            }
+        }
+    } else {
+        out_response(c, 404, "Not Found", "{\"error\":\"unknown endpoint\"}");
+    }
+    // stream the engine's events until the sequence is done, even after a hangup: req is shared until then
+    while (c->req != NULL && !c->engine_done) {
+        conn_drain_events(c);
+        if (!c->hup && conn_flush(c) < 0) { conn_cancel(c); }
+        if (!c->engine_done) { CO_YIELD(c); }
+    }
+    while (!c->hup && (c->rc = conn_flush(c)) == 0) { CO_YIELD(c); }
+    CO_END(c);
+}
 
-        // forward the transformer to get logits for the next token
-        float* logits = forward(transformer, token, pos, device);
+void free_connection(Connection *c) {
+    close(c->fd); // also takes it out of the epoll set
+    if (c->req != NULL) { free_request(c->req); }
+    free(c->prev_tokens);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+void io_accept(IOThread *io) {
+    // takes every pending connection; with several I/O threads some calls find nothing left
+    while (1) {
+        int fd = accept4(io->server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) { perror("accept"); }
+            return;
+        }
+        Connection *c = (Connection *)calloc(1, sizeof(Connection));
+        c->fd = fd;
+        c->io = io;
+        c->in = (char *)malloc(MAX_REQUEST_BYTES);
+        c->in[0] = '\0';
+        // edge triggered, the coroutine always runs until the socket would block.
+        // a socket that is already readable reports so right after it is added
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) { perror("epoll_ctl"); free_connection(c); continue; }
+        c->next = io->conns;
+        io->conns = c;
+    }
+}
+
+void* io_thread(void *arg) {
+    IOThread *io = (IOThread *)arg;
+    struct epoll_event events[64];
+    trace_thread_name("io");
+    while (1) {
+        int n = epoll_wait(io->epfd, events, 64, -1);
+        if (__atomic_load_n(&io->server->stopping, __ATOMIC_ACQUIRE)) { return NULL; }
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &io->server->listen_fd) {
+                io_accept(io);
+            } else if (tag == &io->wake_fd) {
+                // the engine sent events, resume everything that waits on it
+                eventfd_t count;
+                eventfd_read(io->wake_fd, &count);
+                for (Connection *c = io->conns; c != NULL; c = c->next) {
+                    if (c->req != NULL && !c->engine_done) { conn_resume(c); }
+                }
+            } else {
+                Connection *c = (Connection *)tag;
+                if (c->req != NULL && !c->hup && (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) { conn_cancel(c); }
+                conn_resume(c);
+            }
+        }
+        // reap finished connections only now, later events of this round may still point at them
+        Connection **link = &io->conns;
+        while (*link != NULL) {
+            Connection *c = *link;
+            if (c->line == -1) { *link = c->next; free_connection(c); }
+            else { link = &c->next; }
+        }
+    }
+    return NULL;
+}
 
-        // advance the state machine
-        if (pos < num_prompt_tokens - 1) {
-            // if we are still processing the input prompt, force the next prompt token
-            next = prompt_tokens[pos + 1];
+int open_listener(const char *address) {
+    // address is unix:<path>, <host>:<port> or just <port> (bound on all interfaces)
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(addr.sun_path)) { fprintf(stderr, "socket path too long: %s\n", address + 5); exit(EXIT_FAILURE); }
+        strcpy(addr.sun_path, address + 5);
+        unlink(addr.sun_path); // a stale socket from a previous run would make bind() fail
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) { perror("bind"); exit(EXIT_FAILURE); }
+    } else {
+        char host[256] = "";
+        const char *port = strrchr(address, ':');
+        if (port != NULL) {
+            snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+            port++;
         } else {
-            // otherwise sample the next token from the logits
-            // next = sample(sampler, logits);
+            port = address;
+        }
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+        if (err != 0) { fprintf(stderr, "bad listen address %s: %s\n", address, gai_strerror(err)); exit(EXIT_FAILURE); }
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) != 0) { perror("bind"); exit(EXIT_FAILURE); }
+        freeaddrinfo(res);
+    }
+    if (listen(fd, 64) != 0) { perror("listen"); exit(EXIT_FAILURE); }
+    return fd;
+}
+
+int stream_token(Sequence *seq, int token, void *ctx) {
+    // engine side: hands the token to the connection's I/O thread, which is kicked after the step
+    Request *r = (Request *)ctx;
+    IOThread *io = r->io; // r belongs to the I/O thread again once it has EVENT_DONE
+    int index = seq->index;
+    if (token < 0) {
+        r->finish[index] = seq->finish;
+        if (r->logprobs != NULL) { memcpy(r->logprobs[index], seq->logprobs + seq->n_prompt, r->conts.n_tokens[index] * sizeof(float)); }
+        r->n_generated += seq->n_tokens - seq->n_prompt;
+        if (seq->first_token != 0 && (r->first_token == 0 || seq->first_token < r->first_token)) { r->first_token = seq->first_token; }
+        if (seq->last_token > r->last_token) { r->last_token = seq->last_token; }
+        if (seq->max_itl > r->max_itl_ms) { r->max_itl_ms = seq->max_itl; }
+        r->arrival = seq->arrival;
+        r->end = time_in_ms();
+        free_sequence(seq);
+        token = EVENT_DONE;
+    }
+    io->wake_pending = 1;
+    ring_push(&r->events, EVENT(index, token)); // sized for every event of the request, never full
+    return 0;
+}
+
+void start_completion(Scheduler *scheduler, Sampler *sampler, Request *r) {
+    // turns a submitted request into a Sequence on the scheduler, or sends it back rejected
+    // the probindex scratch is shared, only the sampling knobs and rng are per request
+    Sampler request_sampler = *sampler;
+    request_sampler.temperature = r->temperature;
+    request_sampler.topp = r->topp;
+    request_sampler.rng_state = r->rng_seed;
+    Sequence *seq = new_sequence(scheduler, r->prompt_tokens, r->n_prompt, r->steps, &request_sampler);
+    seq->priority = r->priority;
+    seq->on_token = stream_token;
+    seq->ctx = r;
+    seq->cancel = &r->cancelled;
+    seq->n_forks = r->n - 1;
+    if (r->logprobs != NULL) { start_scoring(seq, &r->conts); }
+    if (scheduler_submit(scheduler, seq) != 0) {
+        seq->finish = FINISH_REJECTED;
+        stream_token(seq, -1, r);
+        return;
+    }
+    if (r->deadline_ms > 0) { seq->deadline = seq->arrival + r->deadline_ms; }
+    r->io->wake_pending = 1;
+    ring_push(&r->events, EVENT(0, EVENT_ACCEPTED));
+}
+
+static volatile sig_atomic_t server_stop = 0;
+static int server_stop_fd = -1;
+
+void server_signal(int sig) {
+    // only async-signal-safe calls in here: flag the stop and wake the engine if it waits
+    server_stop = 1;
+    uint64_t one = 1;
+    if (write(server_stop_fd, &one, sizeof(one)) < 0) { return; }
+}
+
+void serve(Scheduler *scheduler, Tokenizer *tokenizer, Sampler *sampler, char *listen_address, int steps, int n_io_threads) {
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.tokenizer = tokenizer;
+    server.max_seq_len = scheduler->transformer->config.max_seq_len;
+    server.max_running = scheduler->max_running;
+    server.steps = steps;
+    server.temperature = sampler->temperature;
+    server.topp = sampler->topp;
+    server.rng_seed = sampler->rng_state;
+    sort_vocab(tokenizer); // the I/O threads encode prompts concurrently
+    server.listen_fd = open_listener(listen_address);
+    fcntl(server.listen_fd, F_SETFL, fcntl(server.listen_fd, F_GETFL) | O_NONBLOCK);
+    server.engine_fd = eventfd(0, EFD_CLOEXEC);
+    server.n_io = n_io_threads;
+    server.io = (IOThread *)calloc(n_io_threads, sizeof(IOThread));
+    for (int i = 0; i < n_io_threads; i++) {
+        IOThread *io = &server.io[i];
+        io->server = &server;
+        io->epfd = epoll_create1(EPOLL_CLOEXEC);
+        io->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        build_ring(&io->submit, SUBMIT_RING_SIZE);
+        io->escaped = (char *)malloc(6 * tokenizer->max_token_length + 1);
+        io->event = (char *)malloc(6 * tokenizer->max_token_length + 256);
+        // every I/O thread watches the listener, EPOLLEXCLUSIVE wakes just one of them per connection
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &server.listen_fd;
+        epoll_ctl(io->epfd, EPOLL_CTL_ADD, server.listen_fd, &ev);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &io->wake_fd;
+        epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->wake_fd, &ev);
+        if (pthread_create(&io->thread, NULL, io_thread, io) != 0) { fprintf(stderr, "failed to start I/O thread\n"); exit(EXIT_FAILURE); }
+    }
+    fprintf(stderr, "listening on %s with %d I/O threads\n", listen_address, n_io_threads);
+    server_stop_fd = server.engine_fd;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!server_stop) {
+        // block only when there is nothing to do, the I/O threads kick engine_fd after submitting
+        if (scheduler_idle(scheduler)) {
+            eventfd_t count;
+            eventfd_read(server.engine_fd, &count);
+        }
+        // new requests join the running batch between steps
+        for (int i = 0; i < server.n_io; i++) {
+            intptr_t r;
+            while (ring_pop(&server.io[i].submit, &r)) { start_completion(scheduler, sampler, (Request *)r); }
         }
-        pos++;
-        exit(-1);   // stop for now
+        scheduler_step(scheduler);
+        // one wakeup per I/O thread and step, however many of its requests got tokens
+        for (int i = 0; i < server.n_io; i++) {
+            if (server.io[i].wake_pending) {
+                server.io[i].wake_pending = 0;
+                eventfd_write(server.io[i].wake_fd, 1);
+            }
+        }
+    }
 
-        // // data-dependent terminating condition: the BOS (=1) token delimits sequences
-        // if (next == 1) { break; }
+    // requests still in flight are abandoned, the process is about to exit
+    fprintf(stderr, "stopping\n");
+    __atomic_store_n(&server.stopping, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < server.n_io; i++) {
+        eventfd_write(server.io[i].wake_fd, 1);
+        pthread_join(server.io[i].thread, NULL);
+    }
+    close(server.listen_fd);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+}
 
-        // // print the token as string, decode it with the Tokenizer object
-        // char* piece = decode(tokenizer, token, next);
-        // safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
-        // fflush(stdout);
-        // token = next;
+// ----------------------------------------------------------------------------
+// stage mode: one stage of a pipeline whose first stage runs in another process, the
+// head. the head connects (see connect_stage()), says which layers are this stage's and
+// how big its micro-batches and kv cache are, then sends every micro-batch: the kv cache
+// copies since the last batch, the block tables and positions of its tokens and their
+// rows of the residual stream. the stage runs its layers over them and sends the rows
+// back. of the checkpoint and of its kv cache it only ever touches the pages of its own
+// layers, and it packs the panels of just those, so a model too big for the memory of
+// one host runs split over several. every host needs the checkpoint
+// at its own path. a stage serves one head at a time, and the next once it hangs up, e.g.
+//   host2$ ./main -m llama2-70b.bin -M stage -L 0.0.0.0:9000
+//   host3$ ./main -m llama2-70b.bin -M stage -L 0.0.0.0:9000
+//   host1$ ./main -m llama2-70b.bin -M server --ngl 27,27 --stages host2:9000,host3:9000
+// with --stages loopback the head forks the stage instead: a process on this host, over
+// TCP on 127.0.0.1, to run all of it on one machine. the results are the same bits as
+// with the stages as threads
 
-        // // init the timer here because the first iteration can be slower
-        // if (start == 0) { start = time_in_ms(); }
+void stage_session(Model *model, int fd, const char *tune_cache, const char *pack_dir, int force_pack, int quant) {
+    // one head, until it hangs up or sends no tokens. pack_dir NULL: no panels
+    StageHello hello;
+    if (recv_all(fd, &hello, sizeof(hello)) != 0) { return; }
+    const Config *c = &model->config, *h = &hello.config;
+    int ok = hello.magic == STAGE_MAGIC && h->dim == c->dim && h->hidden_dim == c->hidden_dim && h->n_layers == c->n_layers
+             && h->n_heads == c->n_heads && h->n_kv_heads == c->n_kv_heads && h->vocab_size == c->vocab_size
+             && h->max_seq_len <= c->max_seq_len && 0 < hello.l0 && hello.l0 < hello.l1 && hello.l1 <= c->n_layers
+             && hello.micro_batch > 0 && hello.kv_blocks > 0 && hello.swap_blocks >= 0
+             && hello.quant == quant;
+    send_all(fd, &ok, sizeof(ok), 0);
+    if (!ok) {
+        fprintf(stderr, "stage: refused a head with another checkpoint or --quant\n");
+        return;
     }
-    printf("\n");
+    // the panels or int8 matrices of these layers, unless the last head had the same ones
+    if (quant && (model->quant.map == NULL || model->quant.l0 != hello.l0 || model->quant.l1 != hello.l1)) {
+        quantize_weights(model, hello.l0, hello.l1);
+    }
+    if (pack_dir != NULL && (model->packed.map == NULL || model->packed.l0 != hello.l0 || model->packed.l1 != hello.l1)) {
+        pack_weights(model, hello.l0, hello.l1, force_pack, pack_dir);
+    }
+    Transformer t;
+    build_transformer(&t, model, hello.micro_batch, 1, hello.kv_blocks, h->max_seq_len);
+    build_kv_swap(&t.state.kv, hello.swap_blocks, NULL);
+    if (tune_cache != NULL) { autotune(&t, hello.l0, 0, tune_cache); }
+    int op0 = first_op_of(&t.plan, hello.l0), op1 = first_op_of(&t.plan, hello.l1);
+    fprintf(stderr, "stage: layers %d-%d, micro-batches of %d tokens\n", hello.l0, hello.l1 - 1, hello.micro_batch);
 
-    // report achieved tok/s (pos-1 because the timer starts after first iteration)
-    if (pos > 1) {
-        long end = time_in_ms();
-        fprintf(stderr, "achieved tok/s: %f\n", (pos-1) / (double)(end-start)*1000);
+    // what a micro-batch is read into, sized as the head sizes what it sends
+    int n = hello.micro_batch;
+    int max_meta = n * ((h->max_seq_len + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE + 3);
+    int *meta = (int *)malloc(max_meta * sizeof(int));
+    int **tables = (int **)malloc(n * sizeof(int *));
+    int **blocks = (int **)malloc(n * sizeof(int *));
+    int max_log = 64;
+    int *log = (int *)malloc(max_log * 3 * sizeof(int));
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.blocks = blocks;
+    size_t dim = c->dim;
+    float *x = t.state.x;
+    const PlanOp *ops = t.plan.ops;
+    StageHeader header;
+    while (recv_all(fd, &header, sizeof(header)) == 0 && header.n_tokens > 0) {
+        if (header.n_tokens > n || header.n_tables > header.n_tokens || header.n_meta > max_meta || header.n_log < 0) {
+            fprintf(stderr, "stage: bad micro-batch from the head\n");
+            break;
+        }
+        if (header.n_log > max_log) {
+            max_log = header.n_log;
+            log = (int *)realloc(log, max_log * 3 * sizeof(int));
+        }
+        if (recv_all(fd, log, header.n_log * 3 * sizeof(int)) != 0 || recv_all(fd, meta, header.n_meta * sizeof(int)) != 0
+            || recv_all(fd, x, header.n_tokens * dim * sizeof(float)) != 0) { break; }
+        // the copies the scheduler of the head made to its kv cache, then the batch
+        for (int i = 0; i < header.n_log; i++) { kv_replay(&t.state.kv, log + 3 * i, hello.l0, hello.l1); }
+        int *p = meta;
+        for (int i = 0; i < header.n_tables && p < meta + header.n_meta; i++) {
+            tables[i] = p + 1;
+            p += 1 + p[0];
+        }
+        if (p + 2 * header.n_tokens != meta + header.n_meta) {
+            fprintf(stderr, "stage: bad micro-batch from the head\n");
+            break;
+        }
+        batch.n_tokens = header.n_tokens;
+        batch.pos = p;
+        for (int b = 0; b < batch.n_tokens; b++) { blocks[b] = tables[p[batch.n_tokens + b]]; }
+        for (int i = op0; i < op1; i++) { ops[i].run(ops + i, &t.state, &batch); }
+        if (send_all(fd, &header.n_tokens, sizeof(int), 1) != 0 || send_all(fd, x, header.n_tokens * dim * sizeof(float), 0) != 0) { break; }
     }
+    free(meta);
+    free(tables);
+    free(blocks);
+    free(log);
+    free_transformer(&t);
+}
 
-    free(prompt_tokens);
+void run_stage(char *checkpoint_path, const Backend *backend, int listen_fd, int once, const char *pack, const char *pack_cache,
+               const char *tune_cache, int quant) {
+    // serves heads on listen_fd, just one with once. tune_cache NULL: no autotune
+    Model model;
+    build_model(&model, checkpoint_path, backend);
+    // the panels and int8 matrices wait for the layers of the head
+    char dir[1024];
+    if (pack_cache != NULL) { snprintf(dir, sizeof(dir), "%s", pack_cache); }
+    else { cache_dir(dir, sizeof(dir)); }
+    int packed = backend->panel_rows > 0 && strcmp(pack, "off") != 0 && !quant;
+    do {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0 && errno == EINTR) { continue; }
+        if (fd < 0) { perror("accept"); break; }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        stage_session(&model, fd, tune_cache, packed ? dir : NULL, strcmp(pack, "force") == 0, quant);
+        close(fd);
+    } while (!once);
+    close(listen_fd);
+    free_model(&model);
+}
+
+pid_t spawn_stage(char *address, size_t size, char *checkpoint_path, const Backend *backend, const char *pack, const char *pack_cache,
+                  const char *tune_cache, int quant) {
+    // a stage for --stages loopback: a process of its own listening on 127.0.0.1, at a port
+    // picked by the kernel that goes into address. it goes first, before this process starts
+    // any OpenMP threads, which a fork()ed child can't use
+    int fd = open_listener("127.0.0.1:0");
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    snprintf(address, size, "127.0.0.1:%d", ntohs(addr.sin_port));
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); exit(EXIT_FAILURE); }
+    if (pid == 0) {
+        // dies with the head, and a ^C to the head stops it through the head
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        run_stage(checkpoint_path, backend, fd, 1, pack, pack_cache, tune_cache, quant);
+        _exit(0);
+    }
+    close(fd);
+    return pid;
+}
+
+// ----------------------------------------------------------------------------
+// batch mode: runs every prompt of a JSONL file through the continuously batched
+// engine with the weights loaded once, one JSON object per line in and out:
+//   ./main -m model.bin -M batch --input prompts.jsonl --output results.jsonl
+//   {"id": "q1", "prompt": "Once upon a time", "steps": 64, "temperature": 0.8, "topp": 0.9, "seed": 7}
+//   {"id":"q1","text":"...","finish_reason":"length","prompt_tokens":5,"completion_tokens":59}
+// id, steps, temperature, topp and seed are optional (id defaults to the line
+// number, seed to --seed plus the line number). "n": k samples k completions of
+// the prompt, one result line each with an "index"; "beams": w runs a beam search
+// of width w instead and writes the best beam. a line with a "context" string
+// and a "continuations" array instead of a prompt scores every continuation after
+// the context, one result line each with its "index", "logprob" and
+// "token_logprobs", the context forwarded once for all. results are written as they
+// finish, so out of order, to stdout without --output: it carries them and nothing
+// else, the diagnostics go to stderr. a reader thread tokenizes ahead of the engine
+// and a writer thread detokenizes behind it, both connected to it through Channels
+// ----------------------------------------------------------------------------
+
+#define BATCH_CHANNEL_SIZE 4096
+
+typedef struct BatchPipeline BatchPipeline;
+
+typedef struct {
+    char *id;               // raw JSON of the id, copied into the result
+    const char *error;      // why the line can't be run, NULL if it can
+    int *tokens;            // the prompt, then once done the prompt and the sampled tokens
+    int n_tokens;
+    int n_prompt;
+    int steps;
+    float temperature;
+    float topp;
+    unsigned long long rng_seed;
+    int n;                  // completions to sample, or continuations to score
+    int beams;              // beam width, 0 = sample instead
+    Continuations conts;    // scoring: the prompt is the context and these are scored after it
+    float *logprobs;        // scoring: once done, of the n_scored tokens of continuation index, NULL when sampling
+    int n_scored;
+    int n_live;             // engine side, completions still running
+    int index;              // which completion a result is
+    FinishReason finish;
+    BatchPipeline *pipeline;
+} BatchJob;
+
+struct BatchPipeline {
+    FILE *in;
+    FILE *out;
+    Tokenizer *tokenizer;
+    // defaults for the fields a line leaves out
+    int steps;
+    float temperature;
+    float topp;
+    unsigned long long rng_seed;
+    int max_seq_len;
+    int max_running;        // of the scheduler, the most completions or beams a line can ask for
+    Channel jobs;           // reader -> engine, NULL after the last line
+    Channel done;           // engine -> writer, NULL once everything finished
+    long n_jobs;            // engine side counters
+    long n_prompt_tokens;
+    long n_generated;
+};
+
+void free_batch_job(BatchJob *job) {
+    free(job->id);
+    free(job->tokens);
+    free_continuations(&job->conts);
+    free(job->logprobs);
+    free(job);
+}
+
+void* batch_reader(void *arg) {
+    // parses and tokenizes the input lines ahead of the engine, blocking while it is far enough ahead
+    BatchPipeline *p = (BatchPipeline *)arg;
+    char *line = NULL;
+    size_t cap = 0;
+    long line_no = 0;
+    trace_thread_name("reader");
+    while (getline(&line, &cap, p->in) != -1) {
+        line_no++;
+        if (strspn(line, " \t\r\n") == strlen(line)) { continue; }
+        BatchJob *job = (BatchJob *)calloc(1, sizeof(BatchJob));
+        job->pipeline = p;
+        job->id = json_get_raw(line, "id");
+        if (job->id == NULL) {
+            job->id = (char *)malloc(24);
+            sprintf(job->id, "%ld", line_no);
+        }
+        char *prompt = json_get_string(line, "prompt");
+        char *context = json_get_string(line, "context");
+        int n_conts = 0;
+        char **continuations = json_get_strings(line, "continuations", &n_conts);
+        if (context != NULL && continuations != NULL) {
+            job->tokens = (int *)malloc((strlen(context) + 3) * sizeof(int));
+            encode(p->tokenizer, context, 1, 0, job->tokens, &job->n_tokens);
+            job->n_prompt = job->n_tokens;
+            job->n = n_conts;
+            job->steps = scoring_steps(job->n_prompt, build_continuations(&job->conts, p->tokenizer, continuations, n_conts));
+            if (job->steps > p->max_seq_len) { job->error = "context and continuation are longer than the model's max_seq_len"; }
+        } else if (prompt == NULL) {
+            free_strings(continuations, n_conts);
+            job->error = "expected a \\\"prompt\\\" string, or a \\\"context\\\" string and a \\\"continuations\\\" array of strings";
+        } else {
+            job->steps = p->steps;
+            job->temperature = p->temperature;
+            job->topp = p->topp;
+            job->rng_seed = p->rng_seed + line_no;
+            json_get_sampling(line, &job->steps, &job->temperature, &job->topp, &job->rng_seed);
+            double v;
+            // more completions or beams than the running set holds could never be scheduled,
+            // and would only allocate for them (a beam group is width * width candidates)
+            if ((json_get_number(line, "n", &v) && v > p->max_running) || (json_get_number(line, "beams", &v) && v > p->max_running)) {
+                job->error = "n or beams is more than the sequences run at once (--max-seqs)";
+            }
+            job->n = json_get_number(line, "n", &v) && v > 1 && v <= p->max_running ? (int)v : 1;
+            job->beams = json_get_number(line, "beams", &v) && v > 1 && v <= p->max_running ? (int)v : 0;
+            if (job->beams > 0) { job->n = 1; }
+            if (job->steps <= 0 || job->steps > p->max_seq_len) { job->steps = p->max_seq_len; }
+            job->tokens = (int *)malloc((strlen(prompt) + 3) * sizeof(int));
+            encode(p->tokenizer, prompt, 1, 0, job->tokens, &job->n_tokens);
+            job->n_prompt = job->n_tokens;
+            free_strings(continuations, n_conts);
+        }
+        free(prompt);
+        free(context);
+        channel_send(&p->jobs, (intptr_t)job);
+    }
+    free(line);
+    channel_send(&p->jobs, 0);
+    return NULL;
+}
+
+void* batch_writer(void *arg) {
+    // detokenizes the finished jobs and writes one result line each
+    BatchPipeline *p = (BatchPipeline *)arg;
+    Tokenizer *t = p->tokenizer;
+    char *escaped = (char *)malloc(6 * t->max_token_length + 1);
+    char *text = NULL;
+    size_t cap = 0;
+    BatchJob *job;
+    trace_thread_name("writer");
+    while ((job = (BatchJob *)channel_recv(&p->done)) != NULL) {
+        if (job->error != NULL) {
+            fprintf(p->out, "{\"id\":%s,\"error\":\"%s\"}\n", job->id, job->error);
+            free_batch_job(job);
+            continue;
+        }
+        if (job->logprobs != NULL) {
+            if (32 * (size_t)(job->n_scored + 2) > cap) {
+                cap = 32 * (size_t)(job->n_scored + 2);
+                text = (char *)realloc(text, cap);
+            }
+            json_logprobs(text, job->logprobs, job->n_scored);
+            fprintf(p->out, "{\"id\":%s,\"index\":%d,\"finish_reason\":\"%s\",%s}\n", job->id, job->index, finish_reason_names[job->finish], text);
+            free_batch_job(job);
+            continue;
+        }
+        long trace_start = trace_begin();
+        size_t len = 0;
+        for (int i = job->n_prompt; i < job->n_tokens; i++) {
+            char *piece = decode(t, job->tokens[i - 1], job->tokens[i]);
+            if (!is_safe_piece(piece)) { continue; }
+            size_t n = json_escape(escaped, piece);
+            if (len + n + 1 > cap) {
+                cap = 2 * (len + n + 1);
+                text = (char *)realloc(text, cap);
+            }
+            memcpy(text + len, escaped, n + 1);
+            len += n;
+        }
+        fprintf(p->out, "{\"id\":%s,", job->id);
+        if (job->n > 1) { fprintf(p->out, "\"index\":%d,", job->index); }
+        fprintf(p->out, "\"text\":\"%s\",\"finish_reason\":\"%s\",\"prompt_tokens\":%d,\"completion_tokens\":%d}\n",
+                len ? text : "", finish_reason_names[job->finish], job->n_prompt, job->n_tokens - job->n_prompt);
+        trace_end("output", trace_start, "tokens", job->n_tokens - job->n_prompt);
+        free_batch_job(job);
+    }
+    fflush(p->out);
+    free(text);
+    free(escaped);
+    return NULL;
+}
+
+int batch_token(Sequence *seq, int token, void *ctx) {
+    // engine side: only the end matters, the finished job goes to the writer with its tokens.
+    // completions of an n > 1 job that finish before the last one go as copies of it
+    if (token >= 0) { return 0; }
+    BatchJob *job = (BatchJob *)ctx;
+    BatchPipeline *p = job->pipeline;
+    if (--job->n_live > 0) {
+        BatchJob *copy = (BatchJob *)malloc(sizeof(BatchJob));
+        *copy = *job;
+        copy->id = strdup(job->id);
+        copy->tokens = NULL;
+        memset(&copy->conts, 0, sizeof(Continuations));
+        job = copy;
+    }
+    if (seq->logprobs != NULL) {
+        // a scored continuation, the context was forwarded once for all of them
+        BatchJob *scored = (BatchJob *)ctx;
+        job->n_scored = scored->conts.n_tokens[seq->index];
+        job->logprobs = (float *)malloc((job->n_scored + 1) * sizeof(float));
+        memcpy(job->logprobs, seq->logprobs + seq->n_prompt, job->n_scored * sizeof(float));
+        job->index = seq->index;
+        job->finish = seq->finish;
+        if (job == ctx) { p->n_prompt_tokens += job->n_prompt; }
+        p->n_prompt_tokens += job->n_scored;
+        free_sequence(seq);
+        channel_send(&p->done, (intptr_t)job);
+        return 0;
+    }
+    // the tokens go out with the job, the context goes back to the pool
+    free(job->tokens);
+    job->index = seq->index;
+    job->tokens = (int *)malloc((seq->n_tokens + 1) * sizeof(int));
+    memcpy(job->tokens, seq->tokens, seq->n_tokens * sizeof(int));
+    job->n_tokens = seq->n_tokens;
+    job->n_prompt = seq->n_prompt;
+    job->finish = seq->finish;
+    free_sequence(seq);
+    if (job == ctx) { p->n_prompt_tokens += job->n_prompt; } // the prompt was forwarded once for all of them
+    p->n_generated += job->n_tokens - job->n_prompt;
+    channel_send(&p->done, (intptr_t)job);
+    return 0;
+}
+
+void start_batch_job(Scheduler *scheduler, Sampler *sampler, BatchJob *job) {
+    BatchPipeline *p = job->pipeline;
+    p->n_jobs++;
+    if (job->error != NULL) { channel_send(&p->done, (intptr_t)job); return; }
+    Sampler job_sampler = *sampler;
+    job_sampler.temperature = job->temperature;
+    job_sampler.topp = job->topp;
+    job_sampler.rng_state = job->rng_seed;
+    Sequence *seq = new_sequence(scheduler, job->tokens, job->n_tokens, job->steps, &job_sampler);
+    seq->on_token = batch_token;
+    seq->ctx = job;
+    seq->n_forks = job->n - 1;
+    job->n_live = job->n;
+    if (job->beams > 0) { start_beam_search(seq, job->beams); }
+    if (job->conts.n > 0) { start_scoring(seq, &job->conts); }
+    if (scheduler_submit(scheduler, seq) != 0) {
+        job->error = "doesn't fit in the kv cache or needs more than --max-seqs sequences";
+        if (seq->beam != NULL) { free_beam_group(seq->beam); }
+        free_sequence(seq);
+        channel_send(&p->done, (intptr_t)job);
+    }
+}
+
+void run_batch(Scheduler *scheduler, Tokenizer *tokenizer, Sampler *sampler, char *input_path, char *output_path, int steps, unsigned long long rng_seed) {
+    BatchPipeline p;
+    memset(&p, 0, sizeof(p));
+    p.in = input_path == NULL || strcmp(input_path, "-") == 0 ? stdin : fopen(input_path, "r");
+    if (p.in == NULL) { fprintf(stderr, "couldn't open input %s\n", input_path); exit(EXIT_FAILURE); }
+    p.out = output_path == NULL || strcmp(output_path, "-") == 0 ? stdout : fopen(output_path, "w");
+    if (p.out == NULL) { fprintf(stderr, "couldn't open output %s\n", output_path); exit(EXIT_FAILURE); }
+    p.tokenizer = tokenizer;
+    p.steps = steps;
+    p.temperature = sampler->temperature;
+    p.topp = sampler->topp;
+    p.rng_seed = rng_seed;
+    p.max_seq_len = scheduler->transformer->config.max_seq_len;
+    p.max_running = scheduler->max_running;
+    build_channel(&p.jobs, BATCH_CHANNEL_SIZE);
+    build_channel(&p.done, BATCH_CHANNEL_SIZE);
+
+    long start = time_in_ms();
+    pthread_t reader, writer;
+    if (pthread_create(&reader, NULL, batch_reader, &p) != 0 || pthread_create(&writer, NULL, batch_writer, &p) != 0) {
+        fprintf(stderr, "failed to start batch threads\n");
+        exit(EXIT_FAILURE);
+    }
+    int input_done = 0;
+    while (!input_done || !scheduler_idle(scheduler)) {
+        // top the waiting queue up from the reader, so the batch never runs short of work
+        while (!input_done && scheduler->n_waiting < scheduler->max_waiting) {
+            intptr_t job;
+            if (scheduler_idle(scheduler)) { job = channel_recv(&p.jobs); }
+            else if (!channel_try_recv(&p.jobs, &job)) { break; }
+            if (job == 0) { input_done = 1; break; }
+            start_batch_job(scheduler, sampler, (BatchJob *)job);
+        }
+        scheduler_step(scheduler);
+    }
+    channel_send(&p.done, 0);
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    long end = time_in_ms();
+
+    double seconds = (end - start) / 1000.0;
+    fprintf(stderr, "batch: %ld prompts, %ld prompt tokens, %ld generated tokens in %.3f s\n",
+            p.n_jobs, p.n_prompt_tokens, p.n_generated, seconds);
+    fprintf(stderr, "achieved tok/s: %f generated, %f including prompts\n",
+            p.n_generated / seconds, (p.n_generated + p.n_prompt_tokens) / seconds);
+    if (p.in != stdin) { fclose(p.in); }
+    if (p.out != stdout) { fclose(p.out); }
+    free_channel(&p.jobs);
+    free_channel(&p.done);
+}
+
+// ----------------------------------------------------------------------------
+// perplexity mode: the log-likelihood of a whole file under the model, for gating
+// model and quantization changes:
+//   ./main -m model.bin -M ppl --input wiki.test.txt [--stride 128]
+// the text (or a .bin of uint16 tokens, as pretokenized by llama2.c) is packed into
+// windows of max_seq_len tokens. with a stride below max_seq_len the windows overlap
+// and each one only scores the tokens past the previous one, with the overlap as
+// context. every window is a scoring sequence on the Scheduler, so many windows are
+// prefilled side by side in batched forwards, and only the log-probability of the
+// next token is taken out of the classifier at every position
+// ----------------------------------------------------------------------------
+
+#define TEXT_CHUNK 4096     // bytes of text encoded at once, encode() is quadratic in its input
+
+typedef struct {
+    double nll;             // summed negative log-likelihood of the scored tokens
+    long n_scored;
+    long n_forwarded;
+    long n_windows;
+} Perplexity;
+
+int* read_tokens(Tokenizer *t, char *path, int *n_tokens) {
+    // the tokens of a text file (with BOS in front), or of a .bin file of uint16 tokens
+    FILE *file = path == NULL || strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (file == NULL) { fprintf(stderr, "couldn't open input %s\n", path); exit(EXIT_FAILURE); }
+    char *data = NULL;
+    size_t len = 0, cap = 0, n;
+    do {
+        if (len + 65536 > cap) { cap = 2 * (len + 65536); data = (char *)realloc(data, cap + 1); }
+        n = fread(data + len, 1, cap - len, file);
+        len += n;
+    } while (n > 0);
+    if (file != stdin) { fclose(file); }
+    size_t path_len = path != NULL ? strlen(path) : 0;
+    if (path_len > 4 && strcmp(path + path_len - 4, ".bin") == 0) {
+        *n_tokens = len / sizeof(uint16_t);
+        int *tokens = (int *)malloc((*n_tokens + 1) * sizeof(int));
+        for (int i = 0; i < *n_tokens; i++) { tokens[i] = ((uint16_t *)data)[i]; }
+        free(data);
+        return tokens;
+    }
+    data[len] = '\0';
+    // encode the text a chunk at a time, cutting at a single space between two words: a piece is
+    // never merged across a space, and the dummy prefix encode() puts in front of the next chunk
+    // stands in for the space. so the tokens are the same as encoding it all at once
+    int *tokens = (int *)malloc((len + len / TEXT_CHUNK + 3) * sizeof(int));
+    *n_tokens = 0;
+    char *p = data, *limit = data + len;
+    while (p < limit) {
+        char *cut = p + TEXT_CHUNK;
+        while (cut < limit - 1 && !(cut[0] == ' ' && !isspace((unsigned char)cut[-1]) && !isspace((unsigned char)cut[1]))) { cut++; }
+        if (cut >= limit - 1) { cut = limit; }
+        *cut = '\0';
+        int n_chunk;
+        encode(t, p, p == data, 0, tokens + *n_tokens, &n_chunk);
+        *n_tokens += n_chunk;
+        p = cut + 1;
+    }
+    free(data);
+    return tokens;
+}
+
+int perplexity_window(Sequence *seq, int token, void *ctx) {
+    // adds up the log-likelihood of a finished window
+    if (token >= 0) { return 0; }
+    Perplexity *ppl = (Perplexity *)ctx;
+    for (int i = seq->n_prompt; i <= seq->n_tokens; i++) { ppl->nll -= seq->logprobs[i]; }
+    ppl->n_scored += seq->n_tokens + 1 - seq->n_prompt;
+    ppl->n_forwarded += seq->n_tokens;
+    ppl->n_windows++;
+    free_sequence(seq);
+    return 0;
+}
+
+void perplexity(Scheduler *scheduler, Tokenizer *tokenizer, char *input_path, int stride) {
+    int n_tokens;
+    int *tokens = read_tokens(tokenizer, input_path, &n_tokens);
+    int window = scheduler->transformer->config.max_seq_len;
+    if (stride <= 0 || stride > window) { stride = window; }
+    if (n_tokens < 2) { fprintf(stderr, "need at least 2 tokens, got %d\n", n_tokens); exit(EXIT_FAILURE); }
+    Perplexity ppl;
+    memset(&ppl, 0, sizeof(ppl));
+
+    long start = time_in_ms();
+    int begin = 0;      // start of the next window
+    int scored = 1;     // tokens before this one are already scored, the first one can't be
+    while (scored < n_tokens || !scheduler_idle(scheduler)) {
+        // keep the waiting queue topped up so every step has a full budget of prefill
+        while (scored < n_tokens && scheduler->n_waiting < scheduler->max_waiting) {
+            int len = n_tokens - begin < window ? n_tokens - begin : window;
+            Sequence *seq = new_sequence(scheduler, tokens + begin, len, len, NULL);
+            // with windows that don't overlap, the first token of a window has no context to score it
+            score_prompt(seq, scored - begin > 1 ? scored - begin : 1);
+            seq->on_token = perplexity_window;
+            seq->ctx = &ppl;
+            if (scheduler_submit(scheduler, seq) != 0) { fprintf(stderr, "a window doesn't fit in the kv cache\n"); exit(EXIT_FAILURE); }
+            scored = begin + len;
+            begin += stride;
+        }
+        scheduler_step(scheduler);
+    }
+    long end = time_in_ms();
+
+    double seconds = (end - start) / 1000.0;
+    printf("perplexity: %.4f over %ld tokens, %.6f nll per token\n", exp(ppl.nll / ppl.n_scored), ppl.n_scored, ppl.nll / ppl.n_scored);
+    fprintf(stderr, "ppl: %ld windows of up to %d tokens, stride %d, %ld tokens forwarded in %.3f s\n",
+            ppl.n_windows, window, stride, ppl.n_forwarded, seconds);
+    fprintf(stderr, "achieved tok/s: %f forwarded, %f scored\n", ppl.n_forwarded / seconds, ppl.n_scored / seconds);
+    free(tokens);
+}
+
+// ----------------------------------------------------------------------------
+// bench mode: generation speed on synthetic prompts, for tracking over releases:
+//   ./main -m model.bin -M bench --bench-prompt 128,512 --bench-gen 128 --bench-batch 1,8
+// every combination of prompt length, generated tokens and batch size (sequences
+// submitted together) runs --warmup times unmeasured, then --reps times measured,
+// timed on the monotonic nanosecond clock. per combination it reports:
+// time to first token; prefill tok/s, the prompt tokens over the time until every
+// sequence has its first token; decode tok/s, the tokens sampled after that over
+// the time they took; inter-token latency percentiles; the effective memory
+// bandwidth of the decode phase, counting the weights the plan reads once per step
+// (int8 layer matrices with --quant int8) and the kv cache read by every token. the
+// peak RSS is the high-water mark of the process, so it is reported once, after all
+// the combinations, as process_peak_rss_mb. results go out as one JSON object
+// ----------------------------------------------------------------------------
+
+#define BENCH_MAX_CONFIGS 16    // values per --bench-* list
+
+typedef struct {
+    int batch;
+    long *ttft;             // (batch * reps,) ns from submission to the first token
+    long *itl;              // (batch * reps * gen,) ns between two tokens of a sequence
+    int n_ttft;
+    int n_itl;
+    long *last;             // (batch,) ns of the latest token of every sequence
+    long submitted;         // ns, when the sequences of the running repetition went in
+    int n_first;            // sequences of the running repetition that have their first token
+    long prefill_end;       // ns, when the last of them got it
+    int decoding;           // the running step comes after prefill_end
+    int measure;            // 0 while warming up
+    size_t kv_token_bytes;  // kv cache of one position, keys and values of all layers
+    // measured totals
+    long prefill_tokens;
+    long prefill_ns;
+    long decode_tokens;
+    long decode_ns;
+    long decode_steps;
+    double kv_bytes;        // kv cache read by the forwards of the decode phase
+} BenchRun;
+
+int parse_int_list(const char *list, int *out) {
+    // "128,512" -> {128, 512}, returns the count
+    int n = 0;
+    for (char *p = (char *)list; *p && n < BENCH_MAX_CONFIGS; p++) {
+        out[n++] = (int)strtol(p, &p, 10);
+        if (*p != ',') { break; }
+    }
+    return n;
+}
+
+int int_list_max(const char *list) {
+    int values[BENCH_MAX_CONFIGS];
+    int n = parse_int_list(list, values);
+    int max = 0;
+    for (int i = 0; i < n; i++) { if (values[i] > max) { max = values[i]; } }
+    return max;
+}
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile_ms(long *sorted, int n, double q) {
+    return n > 0 ? sorted[(int)(q * (n - 1) + 0.5)] / 1e6 : 0.0;
+}
+
+int bench_token(Sequence *seq, int token, void *ctx) {
+    // timestamps every token. the forward that made it attended over all the positions before it
+    BenchRun *run = (BenchRun *)ctx;
+    if (token < 0) { free_sequence(seq); return 0; }
+    long now = time_in_ns();
+    if (seq->n_tokens == seq->n_prompt + 1) {
+        if (run->measure) { run->ttft[run->n_ttft++] = now - run->submitted; }
+        if (++run->n_first == run->batch) { run->prefill_end = now; }
+    } else if (run->measure) {
+        run->itl[run->n_itl++] = now - run->last[seq->index];
+        if (run->decoding) {
+            run->decode_tokens++;
+            run->kv_bytes += (double)(seq->n_tokens - 1) * run->kv_token_bytes;
+        }
+    }
+    run->last[seq->index] = now;
+    return 0;
+}
+
+void bench_config(Scheduler *scheduler, Sampler *sampler, BenchRun *run, int n_prompt, int gen, int rep) {
+    // one repetition: batch sequences with random prompts go in together and generate gen tokens each
+    int vocab_size = scheduler->transformer->config.vocab_size;
+    int *prompt = (int *)malloc(n_prompt * sizeof(int));
+    unsigned long long rng = 1234 + rep;
+    run->n_first = 0;
+    run->prefill_end = 0;
+    run->decoding = 0;
+    long start = run->submitted = time_in_ns();
+    for (int i = 0; i < run->batch; i++) {
+        prompt[0] = 1; // BOS
+        for (int j = 1; j < n_prompt; j++) { prompt[j] = 3 + random_u32(&rng) % (vocab_size - 3); }
+        // steps counts the positions forwarded, the last generated token is never forwarded
+        Sequence *seq = new_sequence(scheduler, prompt, n_prompt, n_prompt + gen - 1, sampler);
+        seq->ignore_stop = 1;
+        seq->index = i;
+        seq->on_token = bench_token;
+        seq->ctx = run;
+        if (scheduler_submit(scheduler, seq) != 0) { fprintf(stderr, "bench: the batch doesn't fit in the kv cache, raise --kv-blocks\n"); exit(EXIT_FAILURE); }
+    }
+    while (!scheduler_idle(scheduler)) {
+        run->decoding = run->n_first == run->batch;
+        scheduler_step(scheduler);
+        if (run->decoding && run->measure) { run->decode_steps++; }
+    }
+    long end = time_in_ns();
+    if (run->measure) {
+        run->prefill_tokens += (long)run->batch * n_prompt;
+        run->prefill_ns += run->prefill_end - start;
+        run->decode_ns += end - run->prefill_end;
+    }
+    free(prompt);
+}
+
+void bench(Scheduler *scheduler, Sampler *sampler, char *prompt_lens, char *gen_lens, char *batch_sizes, int warmup, int reps, char *output_path) {
+    Transformer *t = scheduler->transformer;
+    Config *p = &t->config;
+    FILE *out = output_path == NULL || strcmp(output_path, "-") == 0 ? stdout : fopen(output_path, "w");
+    if (out == NULL) { fprintf(stderr, "couldn't open output %s\n", output_path); exit(EXIT_FAILURE); }
+    int prompts[BENCH_MAX_CONFIGS], gens[BENCH_MAX_CONFIGS], batches[BENCH_MAX_CONFIGS];
+    int n_prompts = parse_int_list(prompt_lens, prompts);
+    int n_gens = parse_int_list(gen_lens, gens);
+    int n_batches = parse_int_list(batch_sizes, batches);
+    Sampler greedy = *sampler;
+    greedy.temperature = 0.0f; // argmax, the cheapest sampler, so the forward is what gets measured
+    // the weights of a decode step as the plan counts them, less the logprob classifier it never runs
+    double weight_bytes = 0.0;
+    for (int i = 0; i < t->plan.n_ops; i++) {
+        if (t->plan.ops[i].rows != ROWS_SCORED) { weight_bytes += t->plan.ops[i].bytes; }
+    }
+
+    fprintf(out, "{\"model\":{\"dim\":%d,\"hidden_dim\":%d,\"n_layers\":%d,\"n_heads\":%d,\"n_kv_heads\":%d,\"vocab_size\":%d,\"max_seq_len\":%d,\"weight_bytes\":%.0f},",
+            p->dim, p->hidden_dim, p->n_layers, p->n_heads, p->n_kv_heads, p->vocab_size, p->max_seq_len, weight_bytes);
+    fprintf(out, "\"backend\":\"%s\",\"device\":%d,\"batch_tokens\":%d,\"warmup\":%d,\"reps\":%d,\"results\":[", t->backend->name, t->backend->device,
+            scheduler->max_batch_tokens, warmup, reps);
+    int first = 1;
+    for (int a = 0; a < n_prompts; a++) {
+        for (int b = 0; b < n_gens; b++) {
+            for (int c = 0; c < n_batches; c++) {
+                int n_prompt = prompts[a], gen = gens[b], batch = batches[c];
+                if (n_prompt < 1 || gen < 1 || batch < 1 || n_prompt + gen - 1 > p->max_seq_len) {
+                    fprintf(stderr, "bench: skipping prompt %d gen %d batch %d, out of range\n", n_prompt, gen, batch);
+                    continue;
+                }
+                BenchRun run;
+                memset(&run, 0, sizeof(run));
+                run.batch = batch;
+                run.ttft = (long *)malloc((size_t)batch * reps * sizeof(long));
+                run.itl = (long *)malloc((size_t)batch * reps * gen * sizeof(long));
+                run.last = (long *)malloc(batch * sizeof(long));
+                run.kv_token_bytes = (size_t)p->n_layers * 2 * (p->dim * p->n_kv_heads / p->n_heads) * sizeof(float);
+                for (int r = 0; r < warmup + reps; r++) {
+                    run.measure = r >= warmup;
+                    bench_config(scheduler, &greedy, &run, n_prompt, gen, r);
+                }
+                qsort(run.ttft, run.n_ttft, sizeof(long), compare_long);
+                qsort(run.itl, run.n_itl, sizeof(long), compare_long);
+                double prefill_tok_s = run.prefill_ns > 0 ? run.prefill_tokens / (run.prefill_ns / 1e9) : 0.0;
+                double decode_tok_s = run.decode_ns > 0 ? run.decode_tokens / (run.decode_ns / 1e9) : 0.0;
+                double bandwidth = run.decode_ns > 0 ? (run.decode_steps * weight_bytes + run.kv_bytes) / run.decode_ns : 0.0; // bytes per ns = GB/s
+                fprintf(out, "%s{\"prompt_tokens\":%d,\"gen_tokens\":%d,\"batch\":%d,"
+                        "\"ttft_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f},\"prefill_tok_s\":%.2f,\"decode_tok_s\":%.2f,"
+                        "\"itl_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f},\"decode_gb_s\":%.3f}",
+                        first ? "" : ",", n_prompt, gen, batch,
+                        percentile_ms(run.ttft, run.n_ttft, 0.5), percentile_ms(run.ttft, run.n_ttft, 0.9), percentile_ms(run.ttft, run.n_ttft, 0.99),
+                        prefill_tok_s, decode_tok_s,
+                        percentile_ms(run.itl, run.n_itl, 0.5), percentile_ms(run.itl, run.n_itl, 0.9), percentile_ms(run.itl, run.n_itl, 0.99),
+                        bandwidth);
+                fflush(out);
+                first = 0;
+                fprintf(stderr, "bench: prompt %d gen %d batch %d: ttft p50 %.3f ms, prefill %.1f tok/s, decode %.1f tok/s, itl p99 %.3f ms\n",
+                        n_prompt, gen, batch, percentile_ms(run.ttft, run.n_ttft, 0.5), prefill_tok_s, decode_tok_s, percentile_ms(run.itl, run.n_itl, 0.99));
+                free(run.ttft);
+                free(run.itl);
+                free(run.last);
+            }
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(out, "],\"process_peak_rss_mb\":%.1f}\n", usage.ru_maxrss / 1024.0);
+    if (out != stdout) { fclose(out); }
+}
+
+// ----------------------------------------------------------------------------
+// memory planner: the bytes a run takes, worked out from the Config and the run
+// settings before anything is allocated. with --mem-budget the settings shrink to
+// the largest that fit, in order: the kv cache pool down to one sequence of
+// max_seq_len, then the tokens per forward down to PLAN_MIN_BATCH, then max_seq_len
+// itself, and the tokens per forward on down to one only if not even a block of the
+// kv cache fits otherwise. below a few tokens per forward prefill is matvecs, which
+// costs far more than a shorter context. the breakdown
+// goes to stderr before loading, and a model that can't fit is refused right away
+// instead of dying halfway through its allocations, e.g.
+//   ./main -m model.bin -M server --max-seqs 16 --mem-budget 6G
+// the kv cache is fp32, the layer matrices fp32 or int8 with --quant int8
+
+#define PLAN_MIN_BATCH 16       // tokens per forward kept before max_seq_len gets shorter
+
+typedef struct {
+    // the settings, as asked for and then as planned
+    int max_batch;      // tokens per forward
+    int max_seqs;       // sequences decoding at once
+    int kv_blocks;      // kv cache pool size
+    int max_seq_len;    // context of every sequence
+    int swap_blocks;    // kv swap tier in host memory, 0 with a swap file
+    int packed;         // weights get packed into panels
+    int stages;         // pipeline stages, 1 for none
+    int ranks;          // tensor parallel ranks, 1 for none
+    int micro_batch;    // tokens per micro-batch of the pipeline, as given to build_pipeline()
+    int quant;          // layer matrices quantized to int8
+    int layers;         // of them this process runs, from the first one, 0 for all (see local_layers())
+    // and the bytes they take
+    size_t weights;     // the checkpoint, less the matrices the panels or int8 ones stand in for
+    size_t panels;      // the packed matrices
+    size_t quant_bytes; // the int8 matrices
+    size_t activations; // the RunState arena, and the ones of the pipeline stages
+    size_t kv;          // key and value pools
+    size_t swap;        // the swap tier
+    size_t sequences;   // contexts of the sequences and the scheduler batch
+    size_t total;
+} MemPlan;
+
+size_t kv_block_bytes(const Config *config) {
+    // one block of keys and one of values
+    size_t kv_dim = (size_t)config->dim * config->n_kv_heads / config->n_heads;
+    return 2 * (size_t)config->n_layers * KV_BLOCK_SIZE * kv_dim * sizeof(float);
+}
+
+void plan_bytes(MemPlan *m, Config config, uint64_t file_size) {
+    config.max_seq_len = m->max_seq_len;
+    m->weights = file_size;
+    m->panels = 0;
+    size_t layers = m->layers > 0 && m->layers < config.n_layers ? m->layers : config.n_layers;
+    if (m->packed) {
+        // the per layer matrices are never touched again once they are panels, wcls may be shared
+        int ns[PANEL_MATS], ds[PANEL_MATS];
+        size_t offset[PANEL_MATS];
+        m->panels = panel_layout(&config, 0, layers, ns, ds, offset);
+        for (int i = 0; i < PANEL_MATS - 1; i++) { m->weights -= layers * ns[i] * ds[i] * sizeof(float); }
+    }
+    m->quant_bytes = 0;
+    if (m->quant) {
+        // the same for the int8 copies, which never get packed
+        int ns[PANEL_MATS], ds[PANEL_MATS];
+        size_t offset[PANEL_MATS];
+        panel_layout(&config, 0, layers, ns, ds, offset);
+        m->quant_bytes = quant_bytes(&config, 0, layers);
+        for (int i = 0; i < QUANT_MATS; i++) { m->weights -= layers * ns[i] * ds[i] * sizeof(float); }
+    }
+    RunState s;
+    s.max_batch = m->max_batch;
+    s.max_logits = m->max_seqs;
+    Arena a = {NULL, 0};
+    carve_run_state(&s, &a, config);
+    if (m->stages > 1) {
+        s.max_batch = pipeline_micro_batch(m->max_batch, m->stages, m->micro_batch);
+        s.max_logits = 1;
+        for (int i = 0; i < m->stages; i++) { carve_run_state(&s, &a, config); }
+    }
+    if (m->ranks > 1) {
+        // the activations of the workers, the partial sums of the all-reduce, and the columns of wo and w2
+        s.max_batch = m->max_batch;
+        s.max_logits = 1;
+        for (int i = 1; i < m->ranks; i++) { carve_run_state(&s, &a, config); }
+        a.used += (size_t)(m->ranks + 1) * m->max_batch * config.dim * sizeof(float);
+        m->weights += (size_t)config.n_layers * config.dim * (config.dim + config.hidden_dim) * sizeof(float);
+    }
+    m->activations = a.used;
+    m->kv = (size_t)m->kv_blocks * kv_block_bytes(&config);
+    m->swap = (size_t)m->swap_blocks * kv_block_bytes(&config);
+    SeqPool pool;
+    build_seq_pool(&pool, m->max_seq_len);
+    m->sequences = (size_t)m->max_seqs * pool.bytes
+                 + (size_t)m->max_batch * (6 * sizeof(int) + 2 * sizeof(void *))
+                 + (size_t)m->max_seqs * sizeof(void *) + (size_t)config.vocab_size * sizeof(float);
+    m->total = m->weights + m->panels + m->quant_bytes + m->activations + m->kv + m->swap + m->sequences;
+}
+
+int plan_fit_blocks(MemPlan *m, Config config, uint64_t file_size, size_t budget) {
+    // kv blocks that fit in budget next to everything else
+    int kv_blocks = m->kv_blocks;
+    m->kv_blocks = 0;
+    plan_bytes(m, config, file_size);
+    m->kv_blocks = kv_blocks;
+    if (m->total >= budget) { return 0; }
+    size_t fit = (budget - m->total) / kv_block_bytes(&config);
+    return fit < INT_MAX ? (int)fit : INT_MAX;
+}
+
+void print_size(const char *name, size_t bytes) {
+    fprintf(stderr, "  %-12s %10.1f MB\n", name, bytes / (1024.0 * 1024.0));
 }
 
-// long arguments
+void plan_memory(MemPlan *m, char *checkpoint, size_t budget) {
+    // m comes in with the settings asked for, kv_blocks <= 0 for full length sequences and
+    // max_seq_len <= 0 for the one of the checkpoint, and leaves with the largest of them
+    // that fit in budget (0 = any). exits if not even one block of one token fits
+    Config config;
+    uint64_t file_size;
+    read_config(checkpoint, &config, &file_size);
+    if (m->max_seq_len <= 0 || m->max_seq_len > config.max_seq_len) { m->max_seq_len = config.max_seq_len; }
+    if (m->kv_blocks <= 0) { m->kv_blocks = m->max_seqs * blocks_for(m->max_seq_len); }
+    MemPlan asked = *m;
+    plan_bytes(m, config, file_size);
+    if (budget > 0 && m->total > budget) {
+        int fit = plan_fit_blocks(m, config, file_size, budget);
+        int min_batch = asked.max_batch < PLAN_MIN_BATCH ? asked.max_batch : PLAN_MIN_BATCH;
+        while (fit < blocks_for(m->max_seq_len) && m->max_batch > min_batch) {
+            m->max_batch = m->max_batch / 2 > min_batch ? m->max_batch / 2 : min_batch;
+            fit = plan_fit_blocks(m, config, file_size, budget);
+        }
+        while (fit <= 0 && m->max_batch > 1) {
+            m->max_batch /= 2;
+            fit = plan_fit_blocks(m, config, file_size, budget);
+        }
+        if (fit < blocks_for(m->max_seq_len) && fit > 0) {
+            // shorter contexts only shrink the sequence contexts, so fit holds
+            m->max_seq_len = fit * KV_BLOCK_SIZE;
+        }
+        if (fit <= 0) {
+            m->kv_blocks = 0;
+            plan_bytes(m, config, file_size);
+            fprintf(stderr, "memory: %s needs %.1f MB before any kv cache at one token per forward, over the budget of %.1f MB\n",
+                    checkpoint, m->total / (1024.0 * 1024.0), budget / (1024.0 * 1024.0));
+            exit(EXIT_FAILURE);
+        }
+        m->kv_blocks = fit < asked.kv_blocks ? fit : asked.kv_blocks;
+        plan_bytes(m, config, file_size);
+    }
+    fprintf(stderr, "memory: weights %s, kv cache fp32, max_seq_len %d%s, batch tokens %d%s, kv blocks %d%s\n",
+            m->quant ? "int8 (w8a8)" : "fp32", m->max_seq_len, m->max_seq_len < asked.max_seq_len ? " (lowered)" : "",
+            m->max_batch, m->max_batch < asked.max_batch ? " (lowered)" : "",
+            m->kv_blocks, m->kv_blocks < asked.kv_blocks ? " (lowered)" : "");
+    print_size("weights", m->weights);
+    if (m->packed) { print_size("panels", m->panels); }
+    if (m->quant) { print_size("int8 weights", m->quant_bytes); }
+    print_size("activations", m->activations);
+    print_size("kv cache", m->kv);
+    if (m->swap > 0) { print_size("kv swap", m->swap); }
+    print_size("sequences", m->sequences);
+    print_size("total", m->total);
+    if (budget > 0) { print_size("budget", budget); }
+}
+
+size_t parse_bytes(const char *s) {
+    // a size with an optional K, M or G suffix, e.g. 512M or 1.5G
+    char *end;
+    double v = strtod(s, &end);
+    switch (toupper((unsigned char)*end)) {
+        case 'K': v *= 1024.0; end++; break;
+        case 'M': v *= 1024.0 * 1024.0; end++; break;
+        case 'G': v *= 1024.0 * 1024.0 * 1024.0; end++; break;
+    }
+    if (end == s || *end != '\0' || v < 0) {
+        fprintf(stderr, "bad size %s, expected e.g. 512M or 8G\n", s);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t)v;
+}
+
+// ----------------------------------------------------------------------------
+// CLI, include only if LLAMA2_NO_MAIN is not defined: tools built on this file,
+// like kernelbench.cu, define it and #include "llama2.cu" to reuse everything above
+#ifndef LLAMA2_NO_MAIN
+
+// long arguments, the ones without a short form get ids past the char range
+enum { OPT_BATCH_TOKENS = 256, OPT_PREFILL_CHUNK, OPT_MAX_SEQS, OPT_KV_BLOCKS, OPT_SWAP_BLOCKS, OPT_SWAP_FILE, OPT_MAX_QUEUE, OPT_IO_THREADS, OPT_INPUT, OPT_OUTPUT, OPT_STRIDE,
+       OPT_BENCH_PROMPT, OPT_BENCH_GEN, OPT_BENCH_BATCH, OPT_WARMUP, OPT_REPS, OPT_PROFILE, OPT_TRACE, OPT_TUNE, OPT_TUNE_CACHE, OPT_BACKEND,
+       OPT_PACK, OPT_PACK_CACHE, OPT_MEM_BUDGET, OPT_MICRO_BATCH, OPT_TP, OPT_STAGES, OPT_QUANT };
+
 static struct option long_options[] = {
     {"model", required_argument, NULL, 'm'},
     {"tokenizer", optional_argument, NULL, 'z'},
@@ -653,10 +6607,40 @@ static struct option long_options[] = {
     {"prompt", required_argument, NULL, 'i'},
     {"mode", optional_argument, NULL, 'M'},
     {"system-prompt", optional_argument, NULL, 'y'},
-    {"ngl", optional_argument, NULL, 'l'},
+    {"ngl", required_argument, NULL, 'l'},
     {"stream", no_argument, NULL, 'S'},
-    {"device", no_argument, NULL, 'd'},
+    {"device", required_argument, NULL, 'd'},
+    {"listen", required_argument, NULL, 'L'},
+    {"batch-tokens", required_argument, NULL, OPT_BATCH_TOKENS},
+    {"prefill-chunk", required_argument, NULL, OPT_PREFILL_CHUNK},
+    {"max-seqs", required_argument, NULL, OPT_MAX_SEQS},
+    {"kv-blocks", required_argument, NULL, OPT_KV_BLOCKS},
+    {"swap-blocks", required_argument, NULL, OPT_SWAP_BLOCKS},
+    {"swap-file", required_argument, NULL, OPT_SWAP_FILE},
+    {"max-queue", required_argument, NULL, OPT_MAX_QUEUE},
+    {"io-threads", required_argument, NULL, OPT_IO_THREADS},
+    {"input", required_argument, NULL, OPT_INPUT},
+    {"output", required_argument, NULL, OPT_OUTPUT},
+    {"stride", required_argument, NULL, OPT_STRIDE},
+    {"bench-prompt", required_argument, NULL, OPT_BENCH_PROMPT},
+    {"bench-gen", required_argument, NULL, OPT_BENCH_GEN},
+    {"bench-batch", required_argument, NULL, OPT_BENCH_BATCH},
+    {"warmup", required_argument, NULL, OPT_WARMUP},
+    {"reps", required_argument, NULL, OPT_REPS},
+    {"profile", required_argument, NULL, OPT_PROFILE},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"tune", required_argument, NULL, OPT_TUNE},
+    {"tune-cache", required_argument, NULL, OPT_TUNE_CACHE},
+    {"backend", required_argument, NULL, OPT_BACKEND},
+    {"pack", required_argument, NULL, OPT_PACK},
+    {"pack-cache", required_argument, NULL, OPT_PACK_CACHE},
+    {"mem-budget", required_argument, NULL, OPT_MEM_BUDGET},
+    {"micro-batch", required_argument, NULL, OPT_MICRO_BATCH},
+    {"tp", required_argument, NULL, OPT_TP},
+    {"stages", required_argument, NULL, OPT_STAGES},
+    {"quant", required_argument, NULL, OPT_QUANT},
     {"help", optional_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
 };
 
 void help_msg() {
@@ -670,11 +6654,42 @@ void help_msg() {
     fprintf(stderr, "  -s, --seed <int> random seed, default time(NULL)\n");
     fprintf(stderr, "  -n, --step <int> number of steps to run for, default 256. 0 = max_seq_len\n");
     fprintf(stderr, "  -i, --prompt <string> input prompt\n");
-    fprintf(stderr, "  -M, --mode <string> mode: generate|chat, default: generate\n");
+    fprintf(stderr, "  -M, --mode <string> mode: generate|chat|server|batch|ppl|bench|stage, default: generate\n");
     fprintf(stderr, "  -y, --system_prompt <string> (optional) system prompt in chat mode\n");
-    fprintf(stderr, "  -l, --ngl <int> (optional) number of layers offload to CPU\n");
+    fprintf(stderr, "  -l, --ngl <string> layers of the pipeline stages but the last, which takes the rest, e.g. 16 or 8,8, default one stage\n");
     fprintf(stderr, "  -S, --stream (optional) whether to stream outputs\n");
-    fprintf(stderr, "  -d, --device <int> (optional) CUDA device to use, default is 0\n");
+    fprintf(stderr, "  -d, --device <int> (optional) CUDA device to use, default the CPU\n");
+    fprintf(stderr, "  --backend <string> cpu (scalar reference), simd or cuda, default cuda with a device and cpu without\n");
+    fprintf(stderr, "  -L, --listen <string> (server mode) unix:<path> or [host:]port, (stage mode) [host:]port, default 127.0.0.1:8080\n");
+    fprintf(stderr, "  --batch-tokens <int> token budget of a batched forward step, default 256\n");
+    fprintf(stderr, "  --prefill-chunk <int> prompt tokens of one sequence per step, default 64, the whole budget in ppl mode\n");
+    fprintf(stderr, "  --max-seqs <int> sequences batched at once, default 8 in server, batch and ppl mode, the largest batch in bench mode, 1 otherwise\n");
+    fprintf(stderr, "  --kv-blocks <int> kv cache blocks of %d positions, default max-seqs full length sequences\n", KV_BLOCK_SIZE);
+    fprintf(stderr, "  --swap-blocks <int> kv blocks in the swap tier for preempted sequences, default 0 (recompute)\n");
+    fprintf(stderr, "  --swap-file <string> back the swap tier with this file instead of host memory\n");
+    fprintf(stderr, "  --max-queue <int> (server mode) waiting requests beyond which new ones are refused, default 64\n");
+    fprintf(stderr, "  --io-threads <int> (server mode) threads serving the connections, default 2\n");
+    fprintf(stderr, "  --input <string> (batch mode) JSONL file of prompts, default stdin\n");
+    fprintf(stderr, "                   (ppl mode) text file, or .bin file of uint16 tokens as pretokenized by llama2.c\n");
+    fprintf(stderr, "  --output <string> (batch mode) JSONL file for the results, (bench mode) JSON report, default stdout\n");
+    fprintf(stderr, "  --stride <int> (ppl mode) tokens between the starts of two windows, default max_seq_len\n");
+    fprintf(stderr, "  --bench-prompt <list> (bench mode) comma separated prompt lengths, default 128\n");
+    fprintf(stderr, "  --bench-gen <list> (bench mode) comma separated generated tokens per sequence, default 128\n");
+    fprintf(stderr, "  --bench-batch <list> (bench mode) comma separated sequences run together, default 1\n");
+    fprintf(stderr, "  --warmup <int> (bench mode) unmeasured runs of every combination, default 1\n");
+    fprintf(stderr, "  --reps <int> (bench mode) measured runs of every combination, default 3\n");
+    fprintf(stderr, "  --profile <string> time every op, print a summary at exit and write folded stacks to this file\n");
+    fprintf(stderr, "  --trace <string> record a timeline of the run, written at exit to this file as Chrome trace JSON\n");
+    fprintf(stderr, "  --tune <string> CPU thread counts and tiles: auto (tune once per host and model shape), off or force, default auto\n");
+    fprintf(stderr, "  --tune-cache <string> autotune cache file, default ~/.cache/llama2.cu/autotune.tsv\n");
+    fprintf(stderr, "  --pack <string> CPU weights in panels: auto (pack once per checkpoint), off or force, default auto\n");
+    fprintf(stderr, "  --pack-cache <string> directory of the packed weights, \"\" for none, default ~/.cache/llama2.cu\n");
+    fprintf(stderr, "  --mem-budget <size> memory for the run, e.g. 8G: kv cache, batch tokens and max_seq_len shrink to fit, default no limit\n");
+    fprintf(stderr, "  --micro-batch <int> tokens per micro-batch of the pipeline stages, 0 = two per stage, default 0\n");
+    fprintf(stderr, "  --stages <list> the pipeline stages after the first: host:port of a stage mode process, loopback to fork one here\n");
+    fprintf(stderr, "                  or local for a thread here, e.g. local,host2:9000, default all local\n");
+    fprintf(stderr, "  --tp <int> processes the heads and ffn columns of every layer are split over, not with --profile, default 1\n");
+    fprintf(stderr, "  --quant <string> CPU layer matrices: fp32, or int8 (quantized at load, with int8 activations), default fp32\n");
     fprintf(stderr, "  -h, --help print this message\n");
     exit(EXIT_FAILURE);
 }
@@ -692,37 +6707,66 @@ int main(int argc, char *argv[]) {
     char *mode = (char *)"generate";    // generate|chat
     char *system_prompt = NULL;     // optional system prompt used in chat mode
     bool stream = false;
-    int layers = -1;    // layers to offload to CPU
+    char *ngl = NULL;   // layers of the pipeline stages but the last, NULL = one stage
+    int micro_batch = 0; // tokens per micro-batch of the pipeline, 0 = two per stage
+    char *stages = NULL; // where the pipeline stages after the first run, NULL = threads here
+    int tp_ranks = 1;   // tensor parallel processes
     int device = -1;     // cuda device
+    char *backend_name = NULL;  // cpu|simd|cuda, NULL = by device
+    char *listen_address = (char *)"127.0.0.1:8080";   // server mode socket
+    int batch_tokens = 256;     // token budget per batched forward
+    int prefill_chunk = 0;      // prompt tokens of one sequence per step, 0 = pick by mode
+    int max_seqs = 0;           // sequences batched at once, 0 = pick by mode
+    int kv_blocks = 0;          // kv cache pool size, 0 = max_seqs full length sequences
+    int swap_blocks = 0;        // kv swap tier size, 0 = preempted sequences are recomputed
+    char *swap_file = NULL;     // file backing the swap tier, NULL = host memory
+    int max_queue = 64;         // server admission queue bound
+    int io_threads = 2;         // server connection threads
+    char *input_path = NULL;    // batch mode prompts, NULL = stdin
+    char *output_path = NULL;   // batch mode results, NULL = stdout
+    int stride = 0;             // ppl mode window stride, 0 = max_seq_len
+    char *bench_prompt = (char *)"128"; // bench mode sweeps
+    char *bench_gen = (char *)"128";
+    char *bench_batch = (char *)"1";
+    int warmup = 1;
+    int reps = 3;
+    char *profile_path = NULL;  // folded stacks of the per op profile, NULL = no profiling
+    char *trace_path = NULL;    // Chrome trace of the run, NULL = no tracing
+    char *tune = (char *)"auto"; // CPU kernel tuning: auto|off|force
+    char *tune_cache = NULL;    // autotune cache file, NULL = the default one
+    char *pack = (char *)"auto"; // weight panels: auto|off|force
+    char *pack_cache = NULL;    // directory of the packed weights, NULL = the default one
+    size_t mem_budget = 0;      // bytes the run may take, 0 = no limit
+    char *quant_name = (char *)"fp32"; // layer matrices: fp32|int8
 
     // parse arguments
     int opt = 0;
-    while ((opt = getopt_long(argc, argv, "m:z:t:p:s:n:i:M:y:l:d:Sh",
+    while ((opt = getopt_long(argc, argv, "m:z:t:p:s:n:i:M:y:l:d:L:Sh",
                     long_options, NULL)) != -1) {
         switch (opt) {
             case 'm':
                 checkpoint_path = optarg;
-                printf("checkpoint_path: %s\n", checkpoint_path);
+                fprintf(stderr, "checkpoint_path: %s\n", checkpoint_path);
                 break;
             case 'z':
                 tokenizer_path = optarg;
-                printf("tokenizer path: %s\n", tokenizer_path);
+                fprintf(stderr, "tokenizer path: %s\n", tokenizer_path);
                 break;
             case 't':
                 temperature = atoi(optarg);
-                printf("temperature is %f\n", temperature);
+                fprintf(stderr, "temperature is %f\n", temperature);
                 break;
             case 'p':
                 topp = atoi(optarg);
-                printf("topp is %f\n", topp);
+                fprintf(stderr, "topp is %f\n", topp);
                 break;
             case 's':
                 rng_seed = atoi(optarg);
-                printf("rng seed %llu\n", rng_seed);
+                fprintf(stderr, "rng seed %llu\n", rng_seed);
                 break;
             case 'n':
                 steps = atoi(optarg);
-                printf("step is %d\n", steps);
+                fprintf(stderr, "step is %d\n", steps);
                 break;
             case 'i':
                 prompt = optarg;
@@ -734,15 +6778,102 @@ int main(int argc, char *argv[]) {
                 system_prompt = optarg;
                 break;
             case 'l':
-                layers = atoi(optarg);
+                ngl = optarg;
                 break;
             case 'S':
                 stream = true;
-                printf("stream is: %d\n", stream);
+                fprintf(stderr, "stream is: %d\n", stream);
                 break;
             case 'd':
                 device = atoi(optarg);
                 break;
+            case 'L':
+                listen_address = optarg;
+                break;
+            case OPT_BATCH_TOKENS:
+                batch_tokens = atoi(optarg);
+                break;
+            case OPT_PREFILL_CHUNK:
+                prefill_chunk = atoi(optarg);
+                break;
+            case OPT_MAX_SEQS:
+                max_seqs = atoi(optarg);
+                break;
+            case OPT_KV_BLOCKS:
+                kv_blocks = atoi(optarg);
+                break;
+            case OPT_SWAP_BLOCKS:
+                swap_blocks = atoi(optarg);
+                break;
+            case OPT_SWAP_FILE:
+                swap_file = optarg;
+                break;
+            case OPT_MAX_QUEUE:
+                max_queue = atoi(optarg);
+                break;
+            case OPT_IO_THREADS:
+                io_threads = atoi(optarg);
+                break;
+            case OPT_INPUT:
+                input_path = optarg;
+                break;
+            case OPT_OUTPUT:
+                output_path = optarg;
+                break;
+            case OPT_STRIDE:
+                stride = atoi(optarg);
+                break;
+            case OPT_BENCH_PROMPT:
+                bench_prompt = optarg;
+                break;
+            case OPT_BENCH_GEN:
+                bench_gen = optarg;
+                break;
+            case OPT_BENCH_BATCH:
+                bench_batch = optarg;
+                break;
+            case OPT_WARMUP:
+                warmup = atoi(optarg);
+                break;
+            case OPT_REPS:
+                reps = atoi(optarg);
+                break;
+            case OPT_PROFILE:
+                profile_path = optarg;
+                break;
+            case OPT_TRACE:
+                trace_path = optarg;
+                break;
+            case OPT_TUNE:
+                tune = optarg;
+                break;
+            case OPT_TUNE_CACHE:
+                tune_cache = optarg;
+                break;
+            case OPT_BACKEND:
+                backend_name = optarg;
+                break;
+            case OPT_PACK:
+                pack = optarg;
+                break;
+            case OPT_PACK_CACHE:
+                pack_cache = optarg;
+                break;
+            case OPT_MEM_BUDGET:
+                mem_budget = parse_bytes(optarg);
+                break;
+            case OPT_MICRO_BATCH:
+                micro_batch = atoi(optarg);
+                break;
+            case OPT_TP:
+                tp_ranks = atoi(optarg);
+                break;
+            case OPT_STAGES:
+                stages = optarg;
+                break;
+            case OPT_QUANT:
+                quant_name = optarg;
+                break;
             case 'h':
                 help_msg();
                 break;
@@ -760,12 +6891,148 @@ int main(int argc, char *argv[]) {
     if (temperature < 0.0) {temperature = 0.0f;}
     if (topp < 0.0 || 1.0 <= topp) {topp = 0.9f;}
     if (steps < 0) {steps = 0;}
-    if (device < 0) {device = cudaCpuDeviceId;} // if not cuda device specified, use CPU
+    if (batch_tokens < 1) {batch_tokens = 1;}
+    if (max_seqs <= 0 && strcmp(mode, "bench") == 0) {max_seqs = int_list_max(bench_batch) > 0 ? int_list_max(bench_batch) : 1;}
+    if (max_seqs <= 0) {max_seqs = strcmp(mode, "server") == 0 || strcmp(mode, "batch") == 0 || strcmp(mode, "ppl") == 0 ? 8 : 1;}
+    // ppl mode has no decodes to keep flowing, a window can take the whole budget
+    if (prefill_chunk <= 0) {prefill_chunk = strcmp(mode, "ppl") == 0 ? batch_tokens : 64;}
+    if (warmup < 0) {warmup = 0;}
+    if (reps < 1) {reps = 1;}
+    if (max_queue < 1) {max_queue = 1;}
+    if (io_threads < 1) {io_threads = 1;}
+
+    // the trace starts before anything it could record
+    Tracer trace;
+    if (trace_path != NULL) {
+        build_tracer(&trace, trace_path);
+        trace_thread_name("main");
+    }
+
+    // the backend everything runs on, cuda if a device is given and the CPU otherwise
+    const Backend *backend = select_backend(backend_name, device);
 
-    // build Transformer from given model .bin file
+    // the layers of the pipeline stages, on the CPU where the stages run
+    int stage_layers[BENCH_MAX_CONFIGS];
+    int n_stage_layers = ngl != NULL ? parse_int_list(ngl, stage_layers) : 0;
+    if (n_stage_layers > 0 && backend->device != cudaCpuDeviceId) {
+        fprintf(stderr, "pipeline: the stages run on the CPU backends, --ngl ignored\n");
+        n_stage_layers = 0;
+    }
+    if (tp_ranks > 1 && backend->device != cudaCpuDeviceId) {
+        fprintf(stderr, "tensor parallel: the ranks run on the CPU backends, --tp ignored\n");
+        tp_ranks = 1;
+    }
+    if (tp_ranks > 1 && n_stage_layers > 0) {
+        fprintf(stderr, "--tp and --ngl don't go together\n");
+        exit(EXIT_FAILURE);
+    }
+    if (tp_ranks > 1 && profile_path != NULL) {
+        fprintf(stderr, "--profile and --tp don't go together, a profiled forward runs on one rank\n");
+        exit(EXIT_FAILURE);
+    }
+    if (strcmp(quant_name, "fp32") != 0 && strcmp(quant_name, "int8") != 0) {
+        fprintf(stderr, "--quant: fp32 or int8, not %s\n", quant_name);
+        exit(EXIT_FAILURE);
+    }
+    int quant = strcmp(quant_name, "int8") == 0;
+    if (quant && backend->matmul_q8 == NULL) {
+        fprintf(stderr, "w8a8: the %s backend has no int8 matmul, --quant ignored\n", backend->name);
+        quant = 0;
+    }
+    if (quant && tp_ranks > 1) {
+        fprintf(stderr, "--quant int8 and --tp don't go together\n");
+        exit(EXIT_FAILURE);
+    }
+    int tuned = backend->device == cudaCpuDeviceId && strcmp(tune, "off") != 0;
+    char tune_path[1024] = "";
+    if (tuned) {
+        if (tune_cache != NULL) { snprintf(tune_path, sizeof(tune_path), "%s", tune_cache); }
+        else { default_tune_cache(tune_path, sizeof(tune_path)); }
+    }
+
+    // a stage of some other process's pipeline, until it's killed
+    if (strcmp(mode, "stage") == 0) {
+        int fd = open_listener(listen_address);
+        fprintf(stderr, "stage: listening on %s\n", listen_address);
+        run_stage(checkpoint_path, backend, fd, 0, pack, pack_cache, tuned ? tune_path : NULL, quant);
+        return 0;
+    }
+
+    // and where the stages of this one run: the remote ones are connected to by build_pipeline(),
+    // the loopback ones forked first
+    char *remote[PIPE_MAX_STAGES] = {NULL};
+    char loopback[PIPE_MAX_STAGES][32];
+    pid_t stage_pids[PIPE_MAX_STAGES];
+    int n_spawned = 0;
+    if (stages != NULL && n_stage_layers > 0) {
+        int n = 0;
+        for (char *s = strtok(stages, ","); s != NULL; s = strtok(NULL, ",")) {
+            if (n == n_stage_layers) { n++; break; }
+            if (strcmp(s, "local") != 0 && profile_path != NULL) {
+                fprintf(stderr, "--profile and stages in other processes don't go together, a profiled forward runs here\n");
+                exit(EXIT_FAILURE);
+            }
+            if (strcmp(s, "loopback") == 0) {
+                stage_pids[n_spawned] = spawn_stage(loopback[n], sizeof(loopback[n]), checkpoint_path, backend, pack, pack_cache, tuned ? tune_path : NULL, quant);
+                n_spawned++;
+                remote[n] = loopback[n];
+            } else if (strcmp(s, "local") != 0) {
+                remote[n] = s;
+            }
+            n++;
+        }
+        if (n != n_stage_layers) {
+            fprintf(stderr, "--stages: one entry for each of the %d stages after the first\n", n_stage_layers);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // what it all takes, shrunk to the budget if there is one. the shards of tensor parallel
+    // ranks are row major, and packing would run OpenMP before the workers are forked. int8
+    // matrices stand in for the panels
+    int packed = backend->panel_rows > 0 && strcmp(pack, "off") != 0 && tp_ranks == 1 && !quant;
+    int layers = local_layers(stage_layers, n_stage_layers, remote);
+    MemPlan plan = {batch_tokens, max_seqs, kv_blocks, 0, swap_file == NULL ? swap_blocks : 0, packed, n_stage_layers + 1, tp_ranks,
+                    micro_batch, quant, layers};
+    plan_memory(&plan, checkpoint_path, mem_budget);
+    batch_tokens = plan.max_batch;
+
+    // map the Model from given model .bin file
+    Model model;
+    build_model(&model, checkpoint_path, backend);
+    // of the layers this process runs, the rest belong to the stages in other processes
+    if (layers <= 0 || layers > model.config.n_layers) { layers = model.config.n_layers; }
+    if (quant) { quantize_weights(&model, 0, layers); }
+    if (packed) {
+        char dir[1024];
+        if (pack_cache != NULL) { snprintf(dir, sizeof(dir), "%s", pack_cache); }
+        else { cache_dir(dir, sizeof(dir)); }
+        pack_weights(&model, 0, layers, strcmp(pack, "force") == 0, dir);
+    }
+
+    // and build the Transformer that runs over it
     Transformer transformer;
-    build_transformer(&transformer, checkpoint_path, device);
+    build_transformer(&transformer, &model, batch_tokens, max_seqs, plan.kv_blocks, plan.max_seq_len);
+    build_kv_swap(&transformer.state.kv, swap_blocks, swap_file);
+    TensorParallel tp;
+    if (tp_ranks > 1) {
+        build_tensor_parallel(&tp, &transformer, tp_ranks);
+        transformer.tp = &tp;
+    }
+    if (tuned) {
+        autotune(&transformer, 0, strcmp(tune, "force") == 0, tune_path);
+    }
+    Pipeline pipeline;
+    if (n_stage_layers > 0) {
+        build_pipeline(&pipeline, &transformer, stage_layers, n_stage_layers, micro_batch, remote);
+        transformer.pipeline = &pipeline;
+    }
     if (steps == 0 || steps > transformer.config.max_seq_len) {steps = transformer.config.max_seq_len;}
+    Profiler profiler;
+    if (profile_path != NULL) {
+        build_profiler(&profiler, transformer.config.n_layers, profile_path);
+        transformer.profiler = &profiler;
+    }
 
     // build the tokenizer via the tokenizer .bin file
     Tokenizer tokenizer;
@@ -775,17 +7042,43 @@ int main(int argc, char *argv[]) {
     Sampler sampler;
     build_sampler(&sampler, transformer.config.vocab_size, temperature, topp, rng_seed);
 
+    // build the Scheduler that batches the sequences of every mode
+    Scheduler scheduler;
+    build_scheduler(&scheduler, &transformer, batch_tokens, prefill_chunk, max_seqs, max_queue);
+
     // run!
     if (strcmp(mode, "generate") == 0) {
-        generate(&transformer, &tokenizer, &sampler, prompt, steps, device);
+        generate(&scheduler, &tokenizer, &sampler, prompt, steps);
+    } else if (strcmp(mode, "server") == 0) {
+        serve(&scheduler, &tokenizer, &sampler, listen_address, steps, io_threads);
+    } else if (strcmp(mode, "batch") == 0) {
+        run_batch(&scheduler, &tokenizer, &sampler, input_path, output_path, steps, rng_seed);
+    } else if (strcmp(mode, "ppl") == 0) {
+        perplexity(&scheduler, &tokenizer, input_path, stride);
+    } else if (strcmp(mode, "bench") == 0) {
+        bench(&scheduler, &sampler, bench_prompt, bench_gen, bench_batch, warmup, reps, output_path);
     } else {
         fprintf(stderr, "unknown mode: %s\n", mode);
         help_msg();
     }
 
+    if (profile_path != NULL) {
+        profiler_report(&profiler);
+        free_profiler(&profiler);
+    }
+    if (trace_path != NULL) {
+        write_trace(&trace);
+        free_tracer(&trace);
+    }
+    free_scheduler(&scheduler);
     free_sampler(&sampler);
     free_tokenizer(&tokenizer);
+    if (transformer.pipeline != NULL) { free_pipeline(&pipeline); }
+    for (int i = 0; i < n_spawned; i++) { waitpid(stage_pids[i], NULL, 0); }
+    if (transformer.tp != NULL) { free_tensor_parallel(&tp); }
     free_transformer(&transformer);
+    free_model(&model);
 
     return 0;
 }
+#endif